@@ -0,0 +1,277 @@
+#define _POSIX_C_SOURCE 200809L
+#include <stdio.h>
+#include <time.h>
+#include "../core.h"
+
+#if defined(__x86_64__) || defined(__i386__)
+#include <x86intrin.h>
+#define BENCH_HAVE_TSC 1
+#endif
+
+/*
+ * Microbenchmarks for the primitives in core.c
+ *
+ * Every benchmark is run over a range of sizes, each size gets `bench_warmup`
+ * untimed runs followed by `bench_trials` timed runs. We report the best and
+ * the median trial as nanoseconds and cycles per operation.
+ *
+ * usage: bench [filter]
+ *   filter: only run benchmarks whose name contains `filter`
+ */
+
+#define bench_warmup 3
+#define bench_trials 15
+#define bench_sizes_len 5
+varGlobal const u32 bench_sizes[bench_sizes_len] = { 16, 256, 4096, 65536, 1 << 20 };
+
+// Keeps the compiler from optimizing away the work being timed
+varGlobal volatile u64 bench_sink;
+
+
+// --------------------------------------------------------------------------------------------
+// ~clocks
+internal inline u64
+bench_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64) ts.tv_sec * 1000000000ull + (u64) ts.tv_nsec;
+}
+
+internal inline u64
+bench_cycles(void) {
+#ifdef BENCH_HAVE_TSC
+    return __rdtsc();
+#else
+    return 0;
+#endif
+}
+
+
+// --------------------------------------------------------------------------------------------
+// ~benchmark table
+typedef struct BenchCtx BenchCtx;
+struct BenchCtx {
+    u32   size;             // elements / bytes the benchmark works on
+    char* buf;              // scratch buffer of #size bytes, prepared by the harness
+};
+
+typedef struct BenchCase BenchCase;
+struct BenchCase {
+    const char* name;
+    u64 (*run)(BenchCtx* ctx);  // returns number of operations performed
+};
+
+typedef struct BenchSample BenchSample;
+struct BenchSample {
+    u64 ns, cycles;
+};
+
+internal int
+_compare_samples(const void* s1, const void* s2) {
+    const u64 a = ((const BenchSample*) s1)->ns;
+    const u64 b = ((const BenchSample*) s2)->ns;
+    return (a > b) - (a < b);
+}
+
+
+// --------------------------------------------------------------------------------------------
+// ~DynArray
+internal u64
+bench_DynArray_push(BenchCtx* ctx) {
+    DynArray arr = DynArray_mk(sizeof(u64));
+    FOR (i, ctx->size) {
+        u64 v = i;
+        DynArray_push(&arr, (void*) &v);
+    }
+    bench_sink += *(u64*) DynArray_get(&arr, ctx->size - 1);
+    DynArray_free(&arr);
+    return ctx->size;
+}
+
+internal u64
+bench_DynArray_get(BenchCtx* ctx) {
+    DynArray arr = DynArray_mk(sizeof(u64));
+    FOR (i, ctx->size) {
+        u64 v = i;
+        DynArray_push(&arr, (void*) &v);
+    }
+
+    u64 sum = 0;
+    FOR (i, ctx->size) {
+        sum += *(u64*) DynArray_get(&arr, i);
+    }
+    bench_sink += sum;
+    DynArray_free(&arr);
+    return ctx->size;
+}
+
+
+// --------------------------------------------------------------------------------------------
+// ~CSortMemArena
+internal u64
+bench_CSortMemArenaCopyCStr(BenchCtx* ctx) {
+    CSortMemArena arena = CSortMemArena_mk();
+    FOR (i, ctx->size) {
+        // 3..10 byte names, the common case for python identifiers
+        CSortMemArenaNode* n = CSortMemArenaCopyCStr(&arena, ctx->buf, 3 + (i & 7));
+        bench_sink += n->mem_used;
+    }
+    CSortMemArena_free(&arena);
+    return ctx->size;
+}
+
+
+// --------------------------------------------------------------------------------------------
+// ~String
+internal u64
+bench_string_append(BenchCtx* ctx) {
+    String s = string("", 0);
+    FOR (i, ctx->size) {
+        string_append(&s, ctx->buf, 8);
+    }
+    bench_sink += s.len;
+    string_free(&s);
+    return ctx->size;
+}
+
+
+// --------------------------------------------------------------------------------------------
+// ~String_View
+internal u64
+bench_SV(BenchCtx* ctx) {
+    const String_View sv = SV(ctx->buf);
+    bench_sink += sv.len;
+    return 1;
+}
+
+internal u64
+bench_SV_slice(BenchCtx* ctx) {
+    u64 sum = 0;
+    FOR (i, ctx->size) {
+        const String_View sv = SV_slice(ctx->buf, ctx->buf + i);
+        sum += sv.len;
+    }
+    bench_sink += sum;
+    return ctx->size;
+}
+
+
+// --------------------------------------------------------------------------------------------
+// ~str utilities
+// #ctx->buf is filled with 'a', so these searches walk the whole buffer.
+internal u64
+bench_str_find(BenchCtx* ctx) {
+    bench_sink += (u64) str_find(ctx->buf, ctx->buf + ctx->size, 'z');
+    return ctx->size;
+}
+
+internal u64
+bench_str_findRev(BenchCtx* ctx) {
+    bench_sink += (u64) str_findRev(ctx->buf, ctx->buf + ctx->size, 'z');
+    return ctx->size;
+}
+
+internal u64
+bench_str_findFirstNotOf(BenchCtx* ctx) {
+    bench_sink += (u64) str_findFirstNotOf(ctx->buf, ctx->buf + ctx->size, 'a');
+    return ctx->size;
+}
+
+internal u64
+bench_str_findFirstNotOfRev(BenchCtx* ctx) {
+    bench_sink += (u64) str_findFirstNotOfRev(ctx->buf, ctx->buf + ctx->size, 'a');
+    return ctx->size;
+}
+
+internal int
+_is_z(int c) { return c == 'z'; }
+
+internal int
+_is_a(int c) { return c == 'a'; }
+
+internal u64
+bench_str_findPredRev(BenchCtx* ctx) {
+    bench_sink += (u64) str_findPredRev(ctx->buf, ctx->buf + ctx->size, _is_z);
+    return ctx->size;
+}
+
+internal u64
+bench_str_findFirstNotOfPredRev(BenchCtx* ctx) {
+    bench_sink += (u64) str_findFirstNotOfPredRev(ctx->buf, ctx->buf + ctx->size, _is_a);
+    return ctx->size;
+}
+
+
+varGlobal BenchCase bench_cases[] = {
+    { "DynArray_push",              bench_DynArray_push },
+    { "DynArray_get",               bench_DynArray_get },
+    { "CSortMemArenaCopyCStr",      bench_CSortMemArenaCopyCStr },
+    { "string_append",              bench_string_append },
+    { "SV",                         bench_SV },
+    { "SV_slice",                   bench_SV_slice },
+    { "str_find",                   bench_str_find },
+    { "str_findRev",                bench_str_findRev },
+    { "str_findFirstNotOf",         bench_str_findFirstNotOf },
+    { "str_findFirstNotOfRev",      bench_str_findFirstNotOfRev },
+    { "str_findPredRev",            bench_str_findPredRev },
+    { "str_findFirstNotOfPredRev",  bench_str_findFirstNotOfPredRev },
+};
+
+
+// --------------------------------------------------------------------------------------------
+internal void
+bench_run(const BenchCase* bcase, BenchCtx* ctx) {
+    BenchSample samples[bench_trials];
+    u64 ops = 0;
+
+    FOR (i, bench_warmup) {
+        bcase->run(ctx);
+    }
+
+    FOR (i, bench_trials) {
+        const u64 t0 = bench_now_ns();
+        const u64 c0 = bench_cycles();
+        ops = bcase->run(ctx);
+        const u64 c1 = bench_cycles();
+        const u64 t1 = bench_now_ns();
+        samples[i] = (BenchSample) { .ns = t1 - t0, .cycles = c1 - c0 };
+    }
+    qsort(samples, bench_trials, sizeof(BenchSample), _compare_samples);
+
+    const BenchSample* best = &samples[0];
+    const BenchSample* median = &samples[bench_trials / 2];
+    println("%-28s %9u %12.2f %12.2f %12.2f %12.2f",
+            bcase->name, ctx->size,
+            (f64) best->ns / ops, (f64) median->ns / ops,
+            (f64) best->cycles / ops, (f64) median->cycles / ops);
+}
+
+
+int main(int argc, char* argv[]) {
+    const char* filter = (argc > 1) ? argv[1] : NULL;
+    const u32 max_size = bench_sizes[bench_sizes_len - 1];
+
+    // 'a' filled, NUL terminated, so SV() and the str_find* benchmarks walk everything
+    char* buf = (char*) DEV_malloc(max_size + 1, sizeof(char));
+    memset(buf, 'a', max_size);
+    buf[max_size] = '\0';
+
+    println("%-28s %9s %12s %12s %12s %12s", "benchmark", "size", "ns/op(min)", "ns/op(med)", "cyc/op(min)", "cyc/op(med)");
+    FOR (i, sizeof(bench_cases) / sizeof(bench_cases[0])) {
+        const BenchCase* bcase = &bench_cases[i];
+        if (filter && ! strstr(bcase->name, filter)) {
+            continue;
+        }
+
+        FOR (j, bench_sizes_len) {
+            BenchCtx ctx = { .size = bench_sizes[j], .buf = buf };
+            // SV() measures strlen over #size bytes
+            buf[ctx.size] = '\0';
+            bench_run(bcase, &ctx);
+            buf[ctx.size] = 'a';
+        }
+    }
+
+    free(buf);
+    return 0;
+}
@@ -8,12 +8,18 @@ CSortConfig_init_w_lua(CSortConfig* config, CSortMemArena* arena, const char* co
     config->cmd_options = (CSortConfigCmd) {0};
     config->arena = arena;
     config->lua = luaL_newstate();
-    config->know_standard_library = DynArray_mk(sizeof(String));
+    config->know_standard_library = DynArray_mk_w_size(sizeof(String), know_standard_library_len);
     config->skip_directories = DynArray_mk(sizeof(String));
     config->file_exts = DynArray_mk(sizeof(String));
+    config->file_ext_matcher = (CSortSuffixMatcher) {0};
+    config->skip_glob = CSortGlobSet_mk();
+    config->force_to_top = DynArray_mk(sizeof(String));
+    config->force_to_bottom = DynArray_mk(sizeof(String));
+    config->import_order = (CSortImportOrder) {0};
     int luaResult = luaL_dofile(config->lua, config_file_lua);
     if (luaResult != LUA_OK) {
         lua_close(config->lua);
+        config->lua = NULL;
         return -1;
     }
 
@@ -23,35 +29,46 @@ CSortConfig_init_w_lua(CSortConfig* config, CSortMemArena* arena, const char* co
 int
 CSortConfig_init(CSortConfig* config, CSortMemArena* arena) {
     // know_standard_library
-    config->know_standard_library = DynArray_mk(sizeof(String));
+    config->know_standard_library = DynArray_mk_w_size(sizeof(String), know_standard_library_len);
     FOR (i, know_standard_library_len) {
         const char* str = know_standard_library[i];
         const String lib = string((char*) str, strlen(str));
         DynArray_push(&config->know_standard_library, (void*) &lib);
     }
-    qsort(config->know_standard_library.mem, config->know_standard_library.len, sizeof(String), string_strncmp);
+    qsort(DynArray_data(&config->know_standard_library), config->know_standard_library.len, sizeof(String), string_strncmp);
 
     // file_exts 
     // @cleanup: Manual sort them and get rid of qsort
-    config->file_exts = DynArray_mk(sizeof(String));
+    config->file_exts = DynArray_mk_w_size(sizeof(String), file_exts_len);
     FOR (i, file_exts_len) {
         const char* str = file_exts[i];
         const String file_ext = string((char*) str, strlen(str));
-        DynArray_push(&config->skip_directories, (void*) &file_ext);
+        DynArray_push(&config->file_exts, (void*) &file_ext);
     }
-    qsort(config->file_exts.mem, config->file_exts.len, sizeof(String), string_strncmp);
+    qsort(DynArray_data(&config->file_exts), config->file_exts.len, sizeof(String), string_strncmp);
+    CSortSuffixMatcher_build(&config->file_ext_matcher, &config->file_exts);
 
     // skip_directories 
-    config->skip_directories = DynArray_mk(sizeof(String));
+    config->skip_directories = DynArray_mk_w_size(sizeof(String), skip_directories_len);
     FOR (i, skip_directories_len) {
         const char* str = skip_directories[i];
         const String dir_name = string((char*) str, strlen(str));
         DynArray_push(&config->skip_directories, (void*) &dir_name);
     }
+    qsort(DynArray_data(&config->skip_directories), config->skip_directories.len, sizeof(String), string_strncmp);
+    config->skip_glob = CSortGlobSet_mk();
+    CSortConfig_compile_skip_directories(config);
+
+    // no ordering rules, modules stay in the order they were written
+    config->force_to_top = DynArray_mk(sizeof(String));
+    config->force_to_bottom = DynArray_mk(sizeof(String));
+    config->case_sensitive = true;
+    CSortImportOrder_build(&config->import_order, &config->force_to_top, &config->force_to_bottom, true);
 
     config->cmd_options = (CSortConfigCmd) {0};
     config->squash_for_duplicate_library = true;
     config->disable_wrapping = false;
+    config->respect_gitignore = false;
     config->wrap_after_n_imports = 4;
     config->import_on_each_wrap = 9;
     config->wrap_after_col = 50;
@@ -59,36 +76,6 @@ CSortConfig_init(CSortConfig* config, CSortMemArena* arena) {
     return 0;
 }
 
-bool
-CSortConfigFindStrList(CSortConfig* conf, int which_list, const char* match) {
-    assert(which_list >= 0 && which_list <= 2);
-    DynArray* list;
-    switch (which_list) {
-        case 0:
-            list = &conf->know_standard_library;
-            break;
-        case 1:
-            list = &conf->skip_directories;
-            break;
-        case 2:
-            list = &conf->file_exts;
-            break;
-        default:
-            assert(false);
-    }
-
-    // FIXME It is also matching .pyc with .py
-    return (! bsearch(&match, list->mem, list->len, sizeof(String), string_strncmp))
-        ? false : true;
-    /*FOR (i, list->len) {*/
-        /*String* s = DynArray_get(list, i);*/
-        /*if (DEV_strIsEq(s->data, match)) {*/
-            /*return true;*/
-        /*}*/
-    /*}*/
-    /*return false;*/
-}
-
 void
 CSortConfig_deinit(CSortConfig* config) {
     if (config->lua) lua_close(config->lua);
@@ -104,9 +91,181 @@ CSortConfig_deinit(CSortConfig* config) {
         String* s = (String*) DynArray_get(&config->file_exts, i);
         string_free(s);
     }
+    FOR (i, config->force_to_top.len) {
+        string_free((String*) DynArray_get(&config->force_to_top, i));
+    }
+    FOR (i, config->force_to_bottom.len) {
+        string_free((String*) DynArray_get(&config->force_to_bottom, i));
+    }
     DynArray_free(&config->know_standard_library);
     DynArray_free(&config->skip_directories);
     DynArray_free(&config->file_exts);
+    DynArray_free(&config->force_to_top);
+    DynArray_free(&config->force_to_bottom);
+    CSortImportOrder_free(&config->import_order);
+    CSortSuffixMatcher_free(&config->file_ext_matcher);
+    CSortGlobSet_free(&config->skip_glob);
+}
+
+// #skip_directories into #skip_glob, as patterns only matching directories
+void
+CSortConfig_compile_skip_directories(CSortConfig* config) {
+    FOR (i, config->skip_directories.len) {
+        const String* pattern = (const String*) DynArray_get(&config->skip_directories, i);
+        CSortGlobSet_add(&config->skip_glob, pattern->data, pattern->len, true);
+    }
+}
+
+
+// --------------------------------------------------------------------------------------------
+internal int
+_compare_last_byte(const void* a, const void* b) {
+    const String_View* s1 = a;
+    const String_View* s2 = b;
+    return (int) (u8) s1->data[s1->len - 1] - (int) (u8) s2->data[s2->len - 1];
+}
+
+void
+CSortSuffixMatcher_build(CSortSuffixMatcher* matcher, const DynArray* exts) {
+    matcher->suffixes = DynArray_mk_w_size(sizeof(String_View), exts->len);
+    FOR (i, exts->len) {
+        const String* ext = (const String*) DynArray_get((DynArray*) exts, i);
+        if (! ext->len) continue;
+        const String_View suffix = SV_buff(ext->data, ext->len);
+        DynArray_push(&matcher->suffixes, (void*) &suffix);
+    }
+
+    String_View* suffixes = DynArray_data(&matcher->suffixes);
+    qsort(suffixes, matcher->suffixes.len, sizeof(String_View), _compare_last_byte);
+    u32 s = 0;
+    FOR (c, 256) {
+        matcher->bucket[c] = s;
+        while (s < matcher->suffixes.len && (u8) suffixes[s].data[suffixes[s].len - 1] == c) ++s;
+    }
+    matcher->bucket[256] = s;
+}
+
+void
+CSortSuffixMatcher_free(CSortSuffixMatcher* matcher) {
+    DynArray_free(&matcher->suffixes);
+    *matcher = (CSortSuffixMatcher) {0};
+}
+
+// #name ends in one of the extensions and is more than just the extension
+bool
+CSortSuffixMatcher_match(const CSortSuffixMatcher* matcher, const char* name, u32 name_len) {
+    if (! name_len) return false;
+    const u8 last = (u8) name[name_len - 1];
+    const String_View* suffixes = DynArray_data(&matcher->suffixes);
+    for (u32 i = matcher->bucket[last]; i < matcher->bucket[last + 1]; ++i) {
+        const String_View* s = &suffixes[i];
+        if (s->len < name_len && memcmp(name + name_len - s->len, s->data, s->len) == 0) {
+            return true;
+        }
+    }
+    return false;
+}
+
+// --------------------------------------------------------------------------------------------
+internal int
+_compare_rule_patterns(const void* a, const void* b) {
+    const CSortOrderRule* r1 = a;
+    const CSortOrderRule* r2 = b;
+    const u32 min_len = r1->pattern.len < r2->pattern.len ? r1->pattern.len : r2->pattern.len;
+    const int cmp = memcmp(r1->pattern.data, r2->pattern.data, min_len);
+    if (cmp) return cmp;
+    if (r1->pattern.len != r2->pattern.len) return (r1->pattern.len > r2->pattern.len) - (r1->pattern.len < r2->pattern.len);
+    return (r1->rank > r2->rank) - (r1->rank < r2->rank);
+}
+
+// longest first, the same length by rank
+internal int
+_compare_rule_lengths(const void* a, const void* b) {
+    const CSortOrderRule* r1 = a;
+    const CSortOrderRule* r2 = b;
+    if (r1->pattern.len != r2->pattern.len) return (r1->pattern.len < r2->pattern.len) - (r1->pattern.len > r2->pattern.len);
+    return (r1->rank > r2->rank) - (r1->rank < r2->rank);
+}
+
+internal void
+_order_add_rules(CSortImportOrder* order, const DynArray* patterns, u32 first_rank) {
+    FOR (i, patterns->len) {
+        const String* p = (const String*) DynArray_get((DynArray*) patterns, i);
+        const bool prefix = p->len && p->data[p->len - 1] == '*';
+        const CSortOrderRule rule = {
+            .pattern = SV_buff(p->data, p->len - (prefix ? 1 : 0)),
+            .rank = first_rank + i,
+        };
+        DynArray_push(prefix ? &order->prefixes : &order->exact, (void*) &rule);
+    }
+}
+
+// #top and #bottom must outlive #order, it points into them
+void
+CSortImportOrder_build(CSortImportOrder* order, const DynArray* top, const DynArray* bottom, bool case_sensitive) {
+    order->exact = DynArray_mk(sizeof(CSortOrderRule));
+    order->prefixes = DynArray_mk(sizeof(CSortOrderRule));
+    order->fold_case = ! case_sensitive;
+    _order_add_rules(order, top, 0);
+    _order_add_rules(order, bottom, CSortImportOrder_unranked + 1);
+
+    // a pattern written twice keeps its first, lowest, rank
+    CSortOrderRule* exact = DynArray_data(&order->exact);
+    qsort(exact, order->exact.len, sizeof(CSortOrderRule), _compare_rule_patterns);
+    u32 kept = 0;
+    FOR (i, order->exact.len) {
+        if (kept && SV_isEq(exact[kept - 1].pattern, exact[i].pattern)) continue;
+        exact[kept++] = exact[i];
+    }
+    order->exact.len = kept;
+    qsort(DynArray_data(&order->prefixes), order->prefixes.len, sizeof(CSortOrderRule), _compare_rule_lengths);
+}
+
+void
+CSortImportOrder_free(CSortImportOrder* order) {
+    DynArray_free(&order->exact);
+    DynArray_free(&order->prefixes);
+    *order = (CSortImportOrder) {0};
+}
+
+// rank of the module #name, #CSortImportOrder_unranked if no pattern matches it
+u32
+CSortImportOrder_rank(const CSortImportOrder* order, const char* name, u32 name_len) {
+    const CSortOrderRule key = { .pattern = SV_buff((char*) name, name_len), .rank = 0 };
+    const CSortOrderRule* exact = DynArray_data((DynArray*) &order->exact);
+    u32 lo = 0, hi = order->exact.len;
+    while (lo < hi) {
+        const u32 mid = lo + (hi - lo) / 2;
+        if (_compare_rule_patterns(&exact[mid], &key) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo < order->exact.len && SV_isEq(exact[lo].pattern, key.pattern)) {
+        return exact[lo].rank;
+    }
+
+    const CSortOrderRule* prefixes = DynArray_data((DynArray*) &order->prefixes);
+    FOR (i, order->prefixes.len) {
+        const String_View p = prefixes[i].pattern;
+        if (p.len <= name_len && memcmp(p.data, name, p.len) == 0) {
+            return prefixes[i].rank;
+        }
+    }
+    return CSortImportOrder_unranked;
+}
+
+
+// copies of the Strings in #from, appended to #array
+void
+array_push_from_array(DynArray* array, const DynArray* from) {
+    DynArray_reserve(array, array->len + from->len);
+    FOR (i, from->len) {
+        const String* s = (const String*) DynArray_get((DynArray*) from, i);
+        const String str = string(s->data, s->len);
+        DynArray_push(array, (void*) &str);
+    }
 }
 
 int
@@ -116,6 +275,7 @@ array_push_from_str(DynArray* array, lua_State* lua, const char* table_name) {
         return -1;
     }
 
+    DynArray_reserve(array, array->len + (u32) lua_rawlen(lua, -1));
     lua_pushnil(lua);
     while (lua_next(lua, -2) != 0) {
         assert(lua_type(lua, -1) == LUA_TSTRING);
@@ -126,3 +286,27 @@ array_push_from_str(DynArray* array, lua_State* lua, const char* table_name) {
     }
     return 0;
 }
+
+// the strings of the sequence #table_name in the order they're written, -1 if it isn't
+// a table of strings
+int
+array_push_from_seq(DynArray* array, lua_State* lua, const char* table_name) {
+    lua_getglobal(lua, table_name);
+    if (! lua_istable(lua, -1)) {
+        return -1;
+    }
+
+    const u32 len = (u32) lua_rawlen(lua, -1);
+    DynArray_reserve(array, array->len + len);
+    for (u32 i = 1; i <= len; ++i) {
+        if (lua_rawgeti(lua, -1, i) != LUA_TSTRING) {
+            lua_pop(lua, 1);
+            return -1;
+        }
+        const char* cstr = lua_tostring(lua, -1);
+        const String str = string((char*) cstr, strlen(cstr));
+        DynArray_push(array, (void*) &str);
+        lua_pop(lua, 1);
+    }
+    return 0;
+}
@@ -2,6 +2,7 @@
 #define __CONFIG_H__
 
 #include "core.h"
+#include "ignore.h"
 #include "external/lua/lua.h"
 #include "external/lua/lualib.h"
 #include "external/lua/lauxlib.h"
@@ -235,12 +236,19 @@ internal char know_standard_library[know_standard_library_len][256] = {
 };
 
 /*
- * List of @param(skip_directories), which we'll skip while traversing filesystem
+ * List of @param(skip_directories), which we'll skip while traversing filesystem,
+ * these are glob patterns in .gitignore syntax, like `bazel-*` or `venv*`
  */
-#define skip_directories_len 2
+#define skip_directories_len 8
 internal char skip_directories[skip_directories_len][28] = {
     "build",
     ".git",
+    "__pycache__",
+    "venv",
+    ".venv",
+    "node_modules",
+    "site-packages",
+    "bazel-*",
 };
 
 /*
@@ -252,11 +260,65 @@ internal char file_exts[file_exts_len][22] = {
 };
 
 
+// --------------------------------------------------------------------------------------------
+// ~Suffix matcher
+//
+// Exact test of a file name against #CSortConfig::file_exts, so `.pyc` no longer passes
+// for `.py`. Extensions are grouped by their last byte, most names are turned away
+// after looking at one byte, the rest compare only the extensions ending in it.
+typedef struct CSortSuffixMatcher CSortSuffixMatcher;
+struct CSortSuffixMatcher {
+    DynArray suffixes;                      // String_View into #CSortConfig::file_exts, by last byte
+    u32 bucket[257];                        // suffixes ending in byte c are [bucket[c], bucket[c + 1])
+};
+
+extern void CSortSuffixMatcher_build(CSortSuffixMatcher* matcher, const DynArray* exts);
+extern void CSortSuffixMatcher_free(CSortSuffixMatcher* matcher);
+extern bool CSortSuffixMatcher_match(const CSortSuffixMatcher* matcher, const char* name, u32 name_len);
+
+
+// --------------------------------------------------------------------------------------------
+// ~Import order
+//
+// `force_to_top` and `force_to_bottom` of a config, compiled when it's loaded into a rank
+// for each pattern, so sorting compares integers and never goes back to the lists or Lua.
+// A pattern is a module name, or a prefix of one when it ends in `*`. The n-th pattern of
+// `force_to_top` ranks n, modules on neither list rank between the two lists and keep the
+// order they were written in. An exact pattern beats a prefix, a longer prefix a shorter.
+typedef struct CSortOrderRule CSortOrderRule;
+struct CSortOrderRule {
+    String_View pattern;                    // into the config's list, without the `*`
+    u32 rank;
+};
+
+typedef struct CSortImportOrder CSortImportOrder;
+struct CSortImportOrder {
+    DynArray exact;                         // CSortOrderRule, by pattern
+    DynArray prefixes;                      // CSortOrderRule, longest pattern first
+    bool fold_case;                         // `case_sensitive = false`, names compare lowercased
+};
+
+#define CSortImportOrder_unranked (1u << 31)
+#define CSortImportOrder_has_rules(O) ((O)->exact.len || (O)->prefixes.len)
+
+extern void CSortImportOrder_build(CSortImportOrder* order, const DynArray* top, const DynArray* bottom, bool case_sensitive);
+extern void CSortImportOrder_free(CSortImportOrder* order);
+extern u32 CSortImportOrder_rank(const CSortImportOrder* order, const char* name, u32 name_len);
+
+
 // --------------------------------------------------------------------------------------------
 typedef struct CSortConfigCmd CSortConfigCmd;
 struct CSortConfigCmd {
-    bool show_after_sort, recursive_apply;
+    bool show_after_sort, recursive_apply, print_stats, print_mem_stats;
+    bool perf_counters;                     // --perf-counters, implies --stats
     char* input_filepath;
+    char* trace_file;                       // --trace, NULL if not tracing
+    u64 max_file_size;                      // --max-file-size, files in directories above it are skipped, 0 for any
+    char* files_from;                       // --files-from, "-" for stdin
+    char* shard;                            // --shard i/N, parsed into the two below
+    u32 shard_index, shard_count;           // 0 shards for all the files
+    char* max_memory;                       // --max-memory SIZE, parsed into the one below
+    u64 max_memory_bytes;                   // 0 for no limit
 };
 
 // --------------------------------------------------------------------------------------------
@@ -267,8 +329,14 @@ struct CSortConfig {
     CSortConfigCmd cmd_options;             // Options which are read from cmdline
 
     DynArray know_standard_library, skip_directories, file_exts;
+    CSortSuffixMatcher file_ext_matcher;    // built from #file_exts once they're loaded
+    CSortGlobSet skip_glob;                 // built from #skip_directories once they're loaded
+    DynArray force_to_top, force_to_bottom; // String, module patterns in the order written
+    CSortImportOrder import_order;          // built from the two above and #case_sensitive
     bool squash_for_duplicate_library,
-         disable_wrapping;
+         disable_wrapping,
+         respect_gitignore,                 // also skip what .gitignore files in the tree ignore
+         case_sensitive;
     u64 wrap_after_n_imports,
         import_on_each_wrap,
         wrap_after_col;
@@ -278,7 +346,9 @@ struct CSortConfig {
 int CSortConfig_init(CSortConfig* config, CSortMemArena* arena);
 int CSortConfig_init_w_lua(CSortConfig* config, CSortMemArena* arena, const char* config_file_lua);
 void CSortConfig_deinit(CSortConfig* config);
-bool CSortConfigFindStrList(CSortConfig* conf, int which_list, const char* match);
+void CSortConfig_compile_skip_directories(CSortConfig* config);
 int array_push_from_str(DynArray* array, lua_State* lua, const char* table_name);
+int array_push_from_seq(DynArray* array, lua_State* lua, const char* table_name);
+void array_push_from_array(DynArray* array, const DynArray* from);
 
 #endif
@@ -1,3 +1,4 @@
+#define _GNU_SOURCE
 #include "core.h"
 
 #include <stdlib.h>
@@ -6,6 +7,8 @@
 #include <errno.h>
 #include <assert.h>
 #include <limits.h>
+#include <unistd.h>
+#include <sys/stat.h>
 
 // --------------------------------------------------------------------------------------------
 // ~utilites
@@ -67,12 +70,107 @@ void DEV_println(FILE* fp, char* fmt, ...) {
 
 
 
+// --------------------------------------------------------------------------------------------
+// ~Memory accounting
+__thread CSortMemStats csort_mem_stats = {0};
+
+varGlobal const char* mem_kind_names[CSortMem_COUNT] = {
+    "arena",
+    "DynArray",
+    "String",
+};
+
+void
+CSortMemStats_track(enum CSortMemKind kind, i64 requested, i64 reserved, enum CSortMemOp op) {
+    CSortMemStats* m = &csort_mem_stats;
+    CSortMemCounters* c = &m->kind[kind];
+
+    if (op == CSortMemOp_Alloc) c->alloc_calls += 1;
+    else if (op == CSortMemOp_Free) c->free_calls += 1;
+
+    if (requested > 0) c->requested_total += requested;
+    if (reserved > 0) c->reserved_total += reserved;
+    c->requested += requested;
+    c->reserved += reserved;
+    if (c->reserved > c->peak_reserved) c->peak_reserved = c->reserved;
+
+    m->live += reserved;
+    if (m->live > m->run_peak) m->run_peak = m->live;
+    if (m->live - m->file_base > m->file_peak) m->file_peak = m->live - m->file_base;
+}
+
+void
+CSortMemStats_file_begin(void) {
+    csort_mem_stats.file_base = csort_mem_stats.live;
+    csort_mem_stats.file_peak = 0;
+}
+
+void
+CSortMemStats_file_end(const char* file_name) {
+    CSortMemStats* m = &csort_mem_stats;
+    m->files += 1;
+    if (m->file_peak > m->file_peak_max) {
+        m->file_peak_max = m->file_peak;
+        snprintf(m->file_peak_max_name, sizeof(m->file_peak_max_name), "%s", file_name);
+    }
+}
+
+// adds another thread's to this thread's, peaks are summed, which bounds the peak of
+// the two together from above
+void
+CSortMemStats_merge(const CSortMemStats* from) {
+    CSortMemStats* m = &csort_mem_stats;
+    FOR (i, CSortMem_COUNT) {
+        CSortMemCounters* c = &m->kind[i];
+        const CSortMemCounters* f = &from->kind[i];
+        c->alloc_calls += f->alloc_calls;
+        c->free_calls += f->free_calls;
+        c->requested_total += f->requested_total;
+        c->reserved_total += f->reserved_total;
+        c->requested += f->requested;
+        c->reserved += f->reserved;
+        c->peak_reserved += f->peak_reserved;
+    }
+    m->live += from->live;
+    m->run_peak += from->run_peak;
+    m->files += from->files;
+    if (from->file_peak_max > m->file_peak_max) {
+        m->file_peak_max = from->file_peak_max;
+        memcpy(m->file_peak_max_name, from->file_peak_max_name, sizeof(m->file_peak_max_name));
+    }
+}
+
+void
+CSortMemStats_print(FILE* fp) {
+    const CSortMemStats* m = &csort_mem_stats;
+
+    fprintf(fp, "csort memory:\n");
+    fprintf(fp, "  %-10s %10s %10s %14s %14s %8s %14s %14s\n",
+            "kind", "allocs", "frees", "requested(B)", "reserved(B)", "waste", "live(B)", "peak(B)");
+    FOR (i, CSortMem_COUNT) {
+        const CSortMemCounters* c = &m->kind[i];
+        const f64 waste = c->reserved_total
+            ? 100.0 * (1.0 - (f64) c->requested_total / (f64) c->reserved_total) : 0.0;
+        fprintf(fp, "  %-10s %10lu %10lu %14lu %14lu %7.1f%% %14ld %14ld\n",
+                mem_kind_names[i], c->alloc_calls, c->free_calls,
+                c->requested_total, c->reserved_total, waste, c->reserved, c->peak_reserved);
+    }
+    fprintf(fp, "\n  run high-water:        %ld bytes\n", m->run_peak);
+    if (m->files) {
+        fprintf(fp, "  file high-water:       %ld bytes (%s)\n", m->file_peak_max, m->file_peak_max_name);
+        fprintf(fp, "  files:                 %lu\n", m->files);
+    }
+}
+
+
+
 // --------------------------------------------------------------------------------------------
 // ~memory arena node 
 void
 CSortMemArenaNode_init(CSortMemArenaNode* node) {
     node->mem_size = 512;
     node->mem = (void*) DEV_malloc(node->mem_size, 1);
+    CSortMemStats_track(CSortMem_Arena, 0, node->mem_size, CSortMemOp_Alloc);
     node->mem_cursor = (u8*) node->mem;
     node->mem_free = 512;
     node->mem_used = 0;
@@ -80,15 +178,17 @@ CSortMemArenaNode_init(CSortMemArenaNode* node) {
 
 void
 CSortMemArenaNode_init_w_size(CSortMemArenaNode* node, u32 size) {
-    node->mem_size = 512;
+    node->mem_size = size;
     node->mem = (void*) DEV_malloc(node->mem_size, 1);
+    CSortMemStats_track(CSortMem_Arena, 0, node->mem_size, CSortMemOp_Alloc);
     node->mem_cursor = (u8*) node->mem;
-    node->mem_free = 512;
+    node->mem_free = size;
     node->mem_used = 0;
 }
 
 void
 CSortMemArenaNode_free(CSortMemArenaNode* node) {
+    CSortMemStats_track(CSortMem_Arena, -(i64) node->mem_used, -(i64) node->mem_size, CSortMemOp_Free);
     free(node->mem);
 }
 
@@ -96,11 +196,14 @@ CSortMemArenaNode_free(CSortMemArenaNode* node) {
 void
 CSortMemArenaNode_fill(CSortMemArenaNode* node, void* data, u32 data_size) {
     if (data_size >= node->mem_free) {
+        const u32 prev_size = node->mem_size;
         node->mem_size += node->mem_free += (data_size + 512);
         node->mem = (void*) DEV_realloc(node->mem, 1, node->mem_size);
         node->mem_cursor = node->mem + node->mem_used;
+        CSortMemStats_track(CSortMem_Arena, 0, (i64) node->mem_size - prev_size, CSortMemOp_Alloc);
     }
 
+    CSortMemStats_track(CSortMem_Arena, data_size, 0, CSortMemOp_None);
     memcpy(node->mem_cursor, data, data_size);
     node->mem_cursor += data_size;
     node->mem_used += data_size;
@@ -115,6 +218,9 @@ CSortMemArena CSortMemArena_mk() {
     return (CSortMemArena) {
         .first = NULL,
         .head = NULL,     
+        .bump = NULL,
+        .free_list = NULL,
+        .used = 0,
     };
 }
 
@@ -124,12 +230,53 @@ CSortMemArena_free(CSortMemArena* arena) {
         ptr = ptr->next;
         CSortMemArenaNode_free(tmp);
         free(tmp);
+        CSortMemStats_track(CSortMem_Arena, 0, -(i64) sizeof(CSortMemArenaNode), CSortMemOp_Free);
+    }
+    // what they held was already released from the accounting by #CSortMemArena_reset
+    for (CSortMemArenaNode* ptr = arena->free_list, * tmp = ptr; ptr; tmp = ptr) {
+        ptr = ptr->next;
+        tmp->mem_used = 0;
+        CSortMemArenaNode_free(tmp);
+        free(tmp);
+        CSortMemStats_track(CSortMem_Arena, 0, -(i64) sizeof(CSortMemArenaNode), CSortMemOp_Free);
     }
+    *arena = CSortMemArena_mk();
 }
 
-CSortMemArenaNode*
-CSortMemArena_alloc(CSortMemArena* arena) {
-    CSortMemArenaNode* node = (CSortMemArenaNode*) DEV_malloc(1, sizeof(CSortMemArenaNode));
+// Splice every node onto the free list, their memory is kept for the next allocations.
+void
+CSortMemArena_reset(CSortMemArena* arena) {
+    if (! arena->head) {
+        return;
+    }
+
+    CSortMemStats_track(CSortMem_Arena, -(i64) arena->used, 0, CSortMemOp_None);
+    arena->head->next = arena->free_list;
+    arena->free_list = arena->first;
+    arena->first = arena->head = arena->bump = NULL;
+    arena->used = 0;
+}
+
+// links a node with at least #min_size bytes at the head, reusing one from the free list if we can
+internal CSortMemArenaNode*
+_arena_take_node(CSortMemArena* arena, u32 min_size) {
+    CSortMemArenaNode* node = arena->free_list;
+    if (node) {
+        arena->free_list = node->next;
+        if (node->mem_size < min_size) {
+            CSortMemStats_track(CSortMem_Arena, 0, (i64) min_size - node->mem_size, CSortMemOp_Alloc);
+            node->mem_size = min_size;
+            node->mem = (void*) DEV_realloc(node->mem, 1, node->mem_size);
+        }
+        node->mem_cursor = (u8*) node->mem;
+        node->mem_free = node->mem_size;
+        node->mem_used = 0;
+    } else {
+        node = (CSortMemArenaNode*) DEV_malloc(1, sizeof(CSortMemArenaNode));
+        CSortMemStats_track(CSortMem_Arena, 0, sizeof(CSortMemArenaNode), CSortMemOp_Alloc);
+        CSortMemArenaNode_init_w_size(node, min_size);
+    }
+
     if (arena->head == NULL) {
         arena->head = node;
         arena->first = node;
@@ -139,12 +286,36 @@ CSortMemArena_alloc(CSortMemArena* arena) {
         arena->head->next = node;
         arena->head = node;
     }
-
-    CSortMemArenaNode_init(node);
     node->next = NULL;
     return node;
 }
 
+CSortMemArenaNode*
+CSortMemArena_alloc(CSortMemArena* arena) {
+    return _arena_take_node(arena, 512);
+}
+
+// #size bytes aligned to 8, valid until the next #CSortMemArena_reset
+void*
+CSortMemArena_push(CSortMemArena* arena, u32 size) {
+    CSortMemArenaNode* node = arena->bump;
+    // a node that's no longer #head isn't touched, it may have been dealloc'd
+    if (! node || node != arena->head || (u64) size + ((-(uintptr_t) node->mem_cursor) & 7) > node->mem_free) {
+        node = _arena_take_node(arena, size > CSortMemArena_chunk_size ? size : CSortMemArena_chunk_size);
+        arena->bump = node;
+        return CSortMemArena_push(arena, size);
+    }
+
+    const u32 pad = (-(uintptr_t) node->mem_cursor) & 7;
+    void* mem = node->mem_cursor + pad;
+    node->mem_cursor += pad + size;
+    node->mem_used += pad + size;
+    node->mem_free -= pad + size;
+    arena->used += pad + size;
+    CSortMemStats_track(CSortMem_Arena, pad + size, 0, CSortMemOp_None);
+    return mem;
+}
+
 void
 CSortMemArena_dealloc(CSortMemArena* arena, CSortMemArenaNode* node) {
     CSortMemArenaNode* prev_node = node->prev;
@@ -160,8 +331,12 @@ CSortMemArena_dealloc(CSortMemArena* arena, CSortMemArenaNode* node) {
     } else {
         next_node->prev = prev_node;
     }
+    if (arena->bump == node) {
+        arena->bump = NULL;
+    }
     CSortMemArenaNode_free(node);
     free(node);
+    CSortMemStats_track(CSortMem_Arena, 0, -(i64) sizeof(CSortMemArenaNode), CSortMemOp_Free);
 }
 
 
@@ -170,6 +345,7 @@ CSortMemArenaCopyCStr(CSortMemArena* arena, char* string, u32 string_size) {
     CSortMemArenaNode* n = CSortMemArena_alloc(arena);
     CSortMemArenaNode_fill(n, (void*) string, string_size);
     CSortMemArenaNode_fill(n, (void*)"\0", 1);
+    arena->used += string_size + 1;
 
     return n;
 }
@@ -290,6 +466,7 @@ string_alloc(String* s, u32 required_length) {
     s->len = s->memory_filled = 0;
     s->memory_size = s->memory_left = required_length + (1<<4);
     s->data = (char*) DEV_malloc(s->memory_size, sizeof(char));
+    CSortMemStats_track(CSortMem_String, 0, s->memory_size, CSortMemOp_Alloc);
 }
 
 internal void
@@ -297,6 +474,7 @@ string_realloc(String* s, u32 required_length) {
     assert(required_length >= s->memory_left);
     s->memory_size += required_length + (1<<6);
     s->data = (char*) DEV_realloc(s->data, s->memory_size, sizeof(char));
+    CSortMemStats_track(CSortMem_String, 0, required_length + (1<<6), CSortMemOp_Alloc);
 }
 
 internal int
@@ -304,6 +482,7 @@ string_fill(String* s, char* string, u32 string_length) {
     if (string_length >= s->memory_left) {
         return -1;
     }
+    CSortMemStats_track(CSortMem_String, string_length + (s->len == 0), 0, CSortMemOp_None);
     memcpy(s->data + s->len, string, string_length);
     s->len += string_length;
     s->memory_filled = s->len + 1;
@@ -319,6 +498,7 @@ string_append(String* s, char* string, u32 string_length) {
         string_realloc(s, string_length);
     }
 
+    CSortMemStats_track(CSortMem_String, string_length + (s->len == 0), 0, CSortMemOp_None);
     memcpy(s->data + s->len, string, string_length);
     s->len += string_length;
     s->memory_filled = s->len + 1;
@@ -336,6 +516,7 @@ string(char* buf, u32 len) {
 
 inline void
 string_free(String* s) {
+    CSortMemStats_track(CSortMem_String, -(i64) (s->len + 1), -(i64) s->memory_size, CSortMemOp_Free);
     free(s->data);
 }
 
@@ -368,42 +549,176 @@ String_View string_toSV(const String* s) {
     };
 }
 
+// drops what #s holds, keeping its memory
+void
+string_clear(String* s) {
+    CSortMemStats_track(CSortMem_String, -(i64) s->len, 0, CSortMemOp_None);
+    s->len = 0;
+    s->memory_filled = 1;
+    s->memory_left = s->memory_size - s->memory_filled;
+    s->data[0] = '\0';
+}
+
+// makes room for #len more chars after what #s holds
+void
+string_reserve(String* s, u32 len) {
+    if (s->memory_left <= len) {
+        string_realloc(s, len + 1);
+        s->memory_left = s->memory_size - s->memory_filled;
+    }
+}
+
+// printf to the end of #s, returns the number of chars appended
+int
+string_appendf(String* s, const char* fmt, ...) {
+    va_list ap;
+    va_start(ap, fmt);
+    const int n = vsnprintf(s->data + s->len, s->memory_left, fmt, ap);
+    va_end(ap);
+    if (n < 0) {
+        return n;
+    }
+
+    if ((u32) n >= s->memory_left) {
+        string_realloc(s, n);
+        s->memory_left = s->memory_size - s->memory_filled;
+        va_start(ap, fmt);
+        vsnprintf(s->data + s->len, s->memory_left, fmt, ap);
+        va_end(ap);
+    }
+
+    CSortMemStats_track(CSortMem_String, n, 0, CSortMemOp_None);
+    s->len += n;
+    s->memory_filled = s->len + 1;
+    s->memory_left = s->memory_size - s->memory_filled;
+    return n;
+}
+
+// reads the rest of #fp into #s, replacing what it held but reusing its memory,
+// returns -1 on a read error
+int
+string_from_file(String* s, FILE* fp) {
+    return string_from_fd(s, fileno(fp));
+}
+
+// reads what's left of #fd into #s, the size fstat gives is only a hint
+int
+string_from_fd(String* s, int fd) {
+    struct stat file_stat;
+    const u32 size_hint = (fstat(fd, &file_stat) == 0 && file_stat.st_size > 0) ? file_stat.st_size : 0;
+    string_clear(s);
+    if (s->memory_left <= size_hint + 1) {
+        string_realloc(s, size_hint + 1);
+        s->memory_left = s->memory_size - s->memory_filled;
+    }
+
+    for (;;) {
+        if (s->memory_left <= 1) {
+            string_realloc(s, s->memory_size);
+            s->memory_left = s->memory_size - s->memory_filled;
+        }
+
+        const ssize_t n = read(fd, s->data + s->len, s->memory_left - 1);
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            return -1;
+        }
+        CSortMemStats_track(CSortMem_String, n, 0, CSortMemOp_None);
+        s->len += n;
+        s->memory_filled = s->len + 1;
+        s->memory_left = s->memory_size - s->memory_filled;
+        s->data[s->len] = '\0';
+
+        if (n == 0) {
+            return 0;
+        }
+    }
+}
+
 
 
 // --------------------------------------------------------------------------------------------
 DynArray
 DynArray_mk(u32 chunk_size) {
     DynArray arr = {0};
-    arr.mem_size = 1 << 4;
     arr.chunk_size = chunk_size;
-    arr.mem = (void*) DEV_malloc(arr.mem_size, arr.chunk_size);
-    arr.mem_cursor = (u8*) arr.mem;
-    arr.mem_free = 1 << 4;
+    arr.mem = NULL;
+    arr.mem_size = DynArray_inline_size / chunk_size;
+    arr.mem_free = arr.mem_size;
     arr.len = 0;
     return arr;
 }
 
+DynArray
+DynArray_mk_w_size(u32 chunk_size, u32 reserve_len) {
+    DynArray arr = DynArray_mk(chunk_size);
+    DynArray_reserve(&arr, reserve_len);
+    return arr;
+}
+
 void
 DynArray_free(DynArray* arr) {
-    free(arr->mem);
+    if (arr->mem) {
+        CSortMemStats_track(CSortMem_DynArray, -(i64) arr->len * arr->chunk_size, -(i64) arr->mem_size * arr->chunk_size, CSortMemOp_Free);
+        free(arr->mem);
+    }
+
+    // back to empty inline storage, so #arr can be reused
+    arr->mem = NULL;
+    arr->len = 0;
+    arr->mem_size = arr->mem_free = (arr->chunk_size) ? DynArray_inline_size / arr->chunk_size : 0;
+}
+
+// moves the elements to a heap block of exactly #new_size elements
+internal void
+_DynArray_realloc(DynArray* arr, u32 new_size) {
+    assert(new_size > arr->mem_size);
+    if (arr->mem) {
+        arr->mem = DEV_realloc(arr->mem, arr->chunk_size, new_size);
+        CSortMemStats_track(CSortMem_DynArray, 0, (i64) (new_size - arr->mem_size) * arr->chunk_size, CSortMemOp_Alloc);
+    } else {
+        arr->mem = DEV_malloc(arr->chunk_size, new_size);
+        memcpy(arr->mem, arr->inline_mem, arr->len * arr->chunk_size);
+        CSortMemStats_track(CSortMem_DynArray, (i64) arr->len * arr->chunk_size, (i64) new_size * arr->chunk_size, CSortMemOp_Alloc);
+    }
+    arr->mem_size = new_size;
+    arr->mem_free = arr->mem_size - arr->len;
+}
+
+void
+DynArray_reserve(DynArray* arr, u32 reserve_len) {
+    if (reserve_len > arr->mem_size) {
+        _DynArray_realloc(arr, reserve_len);
+    }
+}
+
+// drops every element but keeps the storage
+void
+DynArray_clear(DynArray* arr) {
+    if (arr->mem) {
+        CSortMemStats_track(CSortMem_DynArray, -(i64) arr->len * arr->chunk_size, 0, CSortMemOp_None);
+    }
+    arr->len = 0;
+    arr->mem_free = arr->mem_size;
 }
 
 inline void*
 DynArray_get(DynArray* arr, u32 idx) {
-    return (void*) ((u8*) arr->mem + arr->chunk_size * idx);
+    return (void*) ((u8*) DynArray_data(arr) + arr->chunk_size * idx);
 }
 
 void
 DynArray_push(DynArray* arr, void* data) {
     if (arr->len >= arr->mem_size) {
-        arr->mem_size += 1 << 4;
-        arr->mem = (void*) DEV_realloc(arr->mem, arr->chunk_size, arr->mem_size);
+        _DynArray_realloc(arr, (arr->mem_size < 4) ? 8 : arr->mem_size * 2);
     }
 
-    memcpy(arr->mem + arr->chunk_size* arr->len, data, arr->chunk_size);
+    if (arr->mem) {
+        CSortMemStats_track(CSortMem_DynArray, arr->chunk_size, 0, CSortMemOp_None);
+    }
+    memcpy((u8*) DynArray_data(arr) + arr->chunk_size * arr->len, data, arr->chunk_size);
     arr->len += 1;
     arr->mem_free -= 1;
-    arr->mem_cursor += arr->chunk_size;
 }
 
 int
@@ -412,5 +727,22 @@ DynArray_pop(DynArray* arr) {
         return -1;
     }
     arr->len -= 1;
+    arr->mem_free += 1;
+    if (arr->mem) {
+        CSortMemStats_track(CSortMem_DynArray, -(i64) arr->chunk_size, 0, CSortMemOp_None);
+    }
     return 0;
 }
+
+// removes the first #n elements, moving the rest to the front
+void
+DynArray_drop_front(DynArray* arr, u32 n) {
+    assert(n <= arr->len);
+    u8* data = (u8*) DynArray_data(arr);
+    memmove(data, data + arr->chunk_size * n, arr->chunk_size * (arr->len - n));
+    arr->len -= n;
+    arr->mem_free += n;
+    if (arr->mem) {
+        CSortMemStats_track(CSortMem_DynArray, -(i64) n * arr->chunk_size, 0, CSortMemOp_None);
+    }
+}
@@ -5,6 +5,7 @@
 #include <stdlib.h>
 #include <string.h>
 #include <stdint.h>
+#include <stdbool.h>
 
 #define internal static
 #define varPersist static
@@ -60,6 +61,60 @@ extern void DEV_println(FILE* fp, char* fmt, ...);
 
 
 
+// --------------------------------------------------------------------------------------------
+// ~Memory accounting
+//
+// Every allocation done by #CSortMemArena, #DynArray and #String is accounted here,
+// per thread.
+// `requested` is what callers asked to store, `reserved` is what we actually hold
+// from malloc, the difference being slack (eg. 512 byte arena nodes holding 3 byte names).
+enum CSortMemKind {
+    CSortMem_Arena,
+    CSortMem_DynArray,
+    CSortMem_String,
+    CSortMem_COUNT,
+};
+
+typedef struct CSortMemCounters CSortMemCounters;
+struct CSortMemCounters {
+    u64 alloc_calls,              // malloc + realloc
+        free_calls;
+    u64 requested_total,          // cumulative over the run
+        reserved_total;
+    i64 requested,                // currently live
+        reserved;
+    i64 peak_reserved;
+};
+
+typedef struct CSortMemStats CSortMemStats;
+struct CSortMemStats {
+    CSortMemCounters kind[CSortMem_COUNT];
+    i64 live,                     // reserved bytes over all kinds
+        run_peak;
+
+    // per file high-water, relative to #live when the file was started
+    i64 file_base, file_peak;
+    i64 file_peak_max;
+    char file_peak_max_name[256];
+    u64 files;
+};
+
+extern __thread CSortMemStats csort_mem_stats;
+
+enum CSortMemOp {
+    CSortMemOp_None,
+    CSortMemOp_Alloc,             // malloc or realloc
+    CSortMemOp_Free,
+};
+
+extern void CSortMemStats_track(enum CSortMemKind kind, i64 requested, i64 reserved, enum CSortMemOp op);
+extern void CSortMemStats_file_begin(void);
+extern void CSortMemStats_file_end(const char* file_name);
+extern void CSortMemStats_merge(const CSortMemStats* from);
+extern void CSortMemStats_print(FILE* fp);
+
+
+
 // --------------------------------------------------------------------------------------------
 // ~Memory arena node 
 typedef struct CSortMemArenaNode CSortMemArenaNode;
@@ -75,6 +130,7 @@ struct CSortMemArenaNode {
 };
 
 extern void CSortMemArenaNode_init(CSortMemArenaNode* node);
+extern void CSortMemArenaNode_init_w_size(CSortMemArenaNode* node, u32 size);
 extern void CSortMemArenaNode_free(CSortMemArenaNode* node);
 extern void CSortMemArenaNode_fill(CSortMemArenaNode* node, void* data, u32 data_size);
 
@@ -82,14 +138,26 @@ extern void CSortMemArenaNode_fill(CSortMemArenaNode* node, void* data, u32 data
 
 // --------------------------------------------------------------------------------------------
 // ~allocator
+//
+// #CSortMemArena_push bump allocates out of #CSortMemArena_chunk_size nodes, #CSortMemArena_reset
+// then gives back everything at once in O(1) by moving the nodes to #free_list, later
+// allocations reuse them before going to malloc. Only memory from #CSortMemArena_push and
+// #CSortMemArenaCopyCStr is counted in #used, don't reset an arena whose nodes were filled by hand.
+#define CSortMemArena_chunk_size 4096
+
 typedef struct CSortMemArena CSortMemArena;
 struct CSortMemArena {
     CSortMemArenaNode* first;
     CSortMemArenaNode* head;
+    CSortMemArenaNode* bump;                     // node #CSortMemArena_push is filling, if still #head
+    CSortMemArenaNode* free_list;                // singly linked through #next
+    u64 used;
 };
 
 extern CSortMemArena CSortMemArena_mk();
 extern void CSortMemArena_free(CSortMemArena* arena);
+extern void CSortMemArena_reset(CSortMemArena* arena);
+extern void* CSortMemArena_push(CSortMemArena* arena, u32 size);
 extern CSortMemArenaNode* CSortMemArena_alloc(CSortMemArena* arena);
 extern void CSortMemArena_dealloc(CSortMemArena* arena, CSortMemArenaNode* node);
 extern inline CSortMemArenaNode* CSortMemArenaCopyCStr(CSortMemArena* arena, char* string, u32 string_size);
@@ -167,23 +235,42 @@ extern String string_slice(const char* begin, const char* end);
 extern int string_strncmp(const String* s1, const String* s2);
 extern String_View SV_fromString(const String* s);
 extern String_View string_toSV(const String* s);
+extern void string_clear(String* s);
+extern void string_reserve(String* s, u32 len);
+extern int string_appendf(String* s, const char* fmt, ...);
+extern int string_from_file(String* s, FILE* fp);
+extern int string_from_fd(String* s, int fd);
 
 
 
 // --------------------------------------------------------------------------------------------
+// ~DynArray
+//
+// Elements live in #inline_mem until they no longer fit, only then we go to the heap
+// and grow geometrically. #mem is NULL while inline, so a DynArray can still be
+// copied by value, always get to the elements through #DynArray_data or #DynArray_get.
+#define DynArray_inline_size 32
+
 typedef struct DynArray DynArray;
 struct DynArray {
     void* mem;
-    u8*   mem_cursor;
     u32   chunk_size;
     u32   len,
           mem_free,
-          mem_size;
+          mem_size;                              // capacity in elements
+    u64   inline_mem[DynArray_inline_size / sizeof(u64)];
 };
 
+#define DynArray_data(X) ((X)->mem ? (X)->mem : (void*) (X)->inline_mem)
+
 extern DynArray DynArray_mk(u32 chunk_size);
+extern DynArray DynArray_mk_w_size(u32 chunk_size, u32 reserve_len);
 extern void DynArray_free(DynArray* arr);
+extern void DynArray_reserve(DynArray* arr, u32 reserve_len);
+extern void DynArray_clear(DynArray* arr);
 extern void DynArray_push(DynArray* arr, void* data);
+extern int DynArray_pop(DynArray* arr);
+extern void DynArray_drop_front(DynArray* arr, u32 n);
 extern inline void* DynArray_get(DynArray* arr, u32 idx);
 
 
@@ -1,11 +1,15 @@
+#define _GNU_SOURCE
 #include "csort.h"
 
 #include <stdarg.h>
 #include <stdbool.h>
 #include <ctype.h>
 #include <dirent.h>
+#include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
+#include <fcntl.h>
+#include <limits.h>
 
 #ifndef _DIRENT_HAVE_D_TYPE
 #error "Requires _DIRENT_HAVE_D_TYPE, to check if #dirent is a directory."
@@ -29,7 +33,7 @@ void log_error(char* fmt, ...) {
 //
 // --------------------------------------------------------------------------------------------
 typedef_CSortOpt(u64, Int)
-typedef_CSortOpt(char, Str)
+typedef_CSortOpt(char*, Str)
 typedef_CSortOpt(bool, Bool)
 
 internal CSortOptObj*
@@ -57,11 +61,15 @@ CSortOptParse_show_usage(FILE* output_stream, const CSortOptObj* options, u32 op
 }
 
 
+// Anything not starting with '-' which isn't the value of an option is pushed to
+// #positional, or is an error without it
 void
-CSortOptParse(int argc, char* argv[], CSortOptObj* options, u32 options_len, const char* prepend_error_msg) {
-#define error(...)        \
-    eprintln(__VA_ARGS__);\
-    exit(1);
+CSortOptParse(int argc, char* argv[], CSortOptObj* options, u32 options_len, const char* prepend_error_msg, DynArray* positional) {
+#define error(...)            \
+    do {                      \
+        eprintln(__VA_ARGS__);\
+        exit(1);              \
+    } while (0)
 
     u32 arg_counter = 0;
     char* arg = argv[arg_counter];
@@ -87,13 +95,15 @@ CSortOptParse(int argc, char* argv[], CSortOptObj* options, u32 options_len, con
             if (obj->Str) {
                 arg = argv[arg_counter++];
                 if (arg) {
-                    obj->Str = arg;
+                    *obj->Str = arg;
                 } else error("error: '%s': Expected a string, got newline", obj->long_flag);
             }
 
             if (obj->Bool) {
                 *obj->Bool = (*obj->Bool) ? false : true;
             }
+        } else if (positional && arg[0] != '-') {
+            DynArray_push(positional, (void*) &arg);
         } else {
             error("error: '%s': UnKnown thing", arg);
         }
@@ -138,162 +148,829 @@ append_path(const char* path, const char* to_add, char* newpath, u32 len) {
     return snprintf(newpath, newlen, "%s/%s", path, to_add);
 }
 
+// ~Inode set
+#define CSortInodeSet_initial_cap 1024
+
+internal inline u32
+_inode_slot(u64 dev, u64 ino, u32 cap) {
+    u64 h = ino ^ (dev * 0x9e3779b97f4a7c15ull);
+    h ^= h >> 31;
+    h *= 0xbf58476d1ce4e5b9ull;
+    h ^= h >> 29;
+    return (u32) h & (cap - 1);
+}
+
+void
+CSortInodeSet_init(CSortInodeSet* set) {
+    set->cap = CSortInodeSet_initial_cap;
+    set->len = 0;
+    set->keys = (u64*) calloc(set->cap * 2, sizeof(u64));
+}
+
+void
+CSortInodeSet_free(CSortInodeSet* set) {
+    free(set->keys);
+    *set = (CSortInodeSet) {0};
+}
+
+// false if #dev, #ino was in #set already, true if it's new or the set isn't kept
+bool
+CSortInodeSet_add(CSortInodeSet* set, u64 dev, u64 ino) {
+    if (! set->keys) return true;
+
+    // grow at 1/2 full
+    if ((set->len + 1) * 2 > set->cap) {
+        CSortInodeSet bigger = { .cap = set->cap * 2 };
+        bigger.keys = (u64*) calloc(bigger.cap * 2, sizeof(u64));
+        FOR (i, set->cap) {
+            if (set->keys[i * 2 + 1]) CSortInodeSet_add(&bigger, set->keys[i * 2], set->keys[i * 2 + 1]);
+        }
+        free(set->keys);
+        *set = bigger;
+    }
+
+    // inode 0 isn't a file, but keep it distinct from a free slot
+    if (! ino) ino = ~0ull;
+    for (u32 i = _inode_slot(dev, ino, set->cap);; i = (i + 1) & (set->cap - 1)) {
+        u64* key = &set->keys[i * 2];
+        if (! key[1]) {
+            key[0] = dev;
+            key[1] = ino;
+            set->len += 1;
+            return true;
+        }
+        if (key[0] == dev && key[1] == ino) return false;
+    }
+}
+
+
+// ~Config tree
+#define CSortConfigTree_initial_cap 64
+#define csort_config_file ".csortconfig"
+
+internal CSortDirConfig*
+_dir_config_slot(CSortDirConfig* slots, u32 cap, const char* dir, u32 len) {
+    for (u32 i = (u32) CSortPathHash_feed(CSortPathHash_basis, dir, len) & (cap - 1);; i = (i + 1) & (cap - 1)) {
+        CSortDirConfig* slot = &slots[i];
+        if (! slot->dir || (slot->dir_len == len && memcmp(slot->dir, dir, len) == 0)) return slot;
+    }
+}
+
+internal void
+_dir_config_put(CSortConfigTree* tree, const char* dir, u32 len, const CSortConfig* conf) {
+    // grow at 1/2 full
+    if ((tree->len + 1) * 2 > tree->cap) {
+        const u32 cap = tree->cap * 2;
+        CSortDirConfig* slots = (CSortDirConfig*) calloc(cap, sizeof(CSortDirConfig));
+        FOR (i, tree->cap) {
+            const CSortDirConfig* old = &tree->slots[i];
+            if (old->dir) *_dir_config_slot(slots, cap, old->dir, old->dir_len) = *old;
+        }
+        free(tree->slots);
+        tree->slots = slots;
+        tree->cap = cap;
+    }
+
+    CSortDirConfig* slot = _dir_config_slot(tree->slots, tree->cap, dir, len);
+    if (slot->dir) return;
+    *slot = (CSortDirConfig) { .dir = strndup(dir, len), .dir_len = len, .conf = conf };
+    tree->len += 1;
+}
+
+// what the command line set wins over #conf
+internal void
+_dir_config_pin(CSort* csort, CSortConfig* conf) {
+    const CSortConfigTree* tree = &csort->configs;
+    const CSortConfig* run = &csort->conf;
+    conf->cmd_options = run->cmd_options;
+    if (tree->pin_squash) conf->squash_for_duplicate_library = run->squash_for_duplicate_library;
+    if (tree->pin_wrapping) conf->disable_wrapping = run->disable_wrapping;
+    if (tree->pin_wrap_after) conf->wrap_after_n_imports = run->wrap_after_n_imports;
+}
+
+// #parent, or a config of its own if #dir has a .csortconfig other than the run's.
+// #dir_fd is #dir opened, or AT_FDCWD.
+internal const CSortConfig*
+_dir_config(CSort* csort, int dir_fd, const char* dir, const CSortConfig* parent) {
+    CSortConfigTree* tree = &csort->configs;
+    char path[1024];
+    struct stat st;
+    if (! tree->root_dir || append_path(dir, csort_config_file, path, sizeof(path)) < 0 ||
+        fstatat(dir_fd, dir_fd == AT_FDCWD ? path : csort_config_file, &st, 0) < 0 || ! S_ISREG(st.st_mode) ||
+        ((u64) st.st_dev == tree->root_dev && (u64) st.st_ino == tree->root_ino)) {
+        return parent;
+    }
+
+    // owned before it's loaded, so a panic frees it
+    CSortConfig* conf = (CSortConfig*) DEV_malloc(1, sizeof(CSortConfig));
+    DynArray_push(&tree->owned, (void*) &conf);
+    if (CSortConfig_init_w_lua(conf, &csort->arena, path) < 0) {
+        CSort_panic(csort, "error: could not open: %s", path);
+    }
+    if (CSort_load_config_over(csort, conf, parent) < 0) {
+        CSort_panic(csort, "%s: %s", path, csort->error);
+    }
+    lua_close(conf->lua);
+    conf->lua = NULL;
+    _dir_config_pin(csort, conf);
+    return conf;
+}
+
+// #dir is absolute and canonical, everything above it is resolved on the way
+internal const CSortConfig*
+_config_for_real_dir(CSort* csort, char* dir, u32 len) {
+    CSortConfigTree* tree = &csort->configs;
+    const CSortDirConfig* slot = _dir_config_slot(tree->slots, tree->cap, dir, len);
+    if (slot->dir) return slot->conf;
+
+    const CSortConfig* conf = &csort->conf;
+    if (! DEV_strIsEq(dir, tree->root_dir)) {
+        const CSortConfig* parent = tree->defaults;
+        if (len > 1) {
+            u32 parent_len = len - 1;
+            while (parent_len && dir[parent_len] != '/') --parent_len;
+            if (! parent_len) parent_len = 1;
+
+            const char cut = dir[parent_len];
+            dir[parent_len] = '\0';
+            parent = _config_for_real_dir(csort, dir, parent_len);
+            dir[parent_len] = cut;
+        }
+        conf = _dir_config(csort, AT_FDCWD, dir, parent);
+    }
+    _dir_config_put(tree, dir, len, conf);
+    return conf;
+}
+
+// The directory as given is looked up first, a list of files repeats it
+internal const CSortConfig*
+_config_for_dir(CSort* csort, const char* dir, u32 len) {
+    CSortConfigTree* tree = &csort->configs;
+    if (! tree->root_dir || len >= PATH_MAX) return &csort->conf;
+
+    const CSortDirConfig* slot = _dir_config_slot(tree->slots, tree->cap, dir, len);
+    if (slot->dir) return slot->conf;
+
+    char given[PATH_MAX];
+    char real[PATH_MAX];
+    memcpy(given, dir, len);
+    given[len] = '\0';
+    const CSortConfig* conf = realpath(given, real) ? _config_for_real_dir(csort, real, strlen(real)) : &csort->conf;
+    _dir_config_put(tree, dir, len, conf);
+    return conf;
+}
+
+// config of the file at #path, #len bytes, from the directory it's in
+const CSortConfig*
+CSort_config_for_file(CSort* csort, const char* path, u32 len) {
+    u32 dir_len = len;
+    while (dir_len && path[dir_len - 1] != '/') --dir_len;
+    return dir_len ? _config_for_dir(csort, path, dir_len) : _config_for_dir(csort, ".", 1);
+}
+
+// The nearest .csortconfig in the current directory or above it into #path, #size bytes,
+// -1 without one
 int
-CSortPerformOnFileCallback(CSort* csort, const char* input_path, void (callback)(CSort* csort, const char* file_path)) {
-    DIR* dirp = opendir(input_path);
-    if (! dirp) {
-        log_error("opendir: Could not open: %s: %s", input_path, strerror(errno));
-        closedir(dirp);
+CSort_find_config(char* path, u32 size) {
+    if (size <= sizeof(csort_config_file) + 1 || ! getcwd(path, size - sizeof(csort_config_file) - 1)) return -1;
+
+    u32 len = strlen(path);
+    for (;;) {
+        u32 at = len;
+        if (path[at - 1] != '/') path[at++] = '/';
+        memcpy(path + at, csort_config_file, sizeof(csort_config_file));
+        if (access(path, F_OK) == 0) return 0;
+        if (len == 1) return -1;
+
+        while (path[len - 1] != '/') --len;
+        if (len > 1) --len;
+    }
+}
+
+// Looks for .csortconfig files below the directory of #lua_config, the run's, which the
+// ones outside it don't inherit from, and remembers what the command line set. #from_file
+// is #CSort::conf before it did.
+void
+CSort_init_config_tree(CSort* csort, const char* lua_config, const CSortConfig* from_file) {
+    CSortConfigTree* tree = &csort->configs;
+    char root[PATH_MAX] = "/";
+    struct stat st;
+    if (lua_config) {
+        if (! realpath(lua_config, root) || stat(root, &st) < 0) return;
+        tree->root_dev = st.st_dev;
+        tree->root_ino = st.st_ino;
+        char* slash = strrchr(root, '/');
+        slash[slash == root] = '\0';
+    }
+    const CSortConfig* run = &csort->conf;
+    tree->pin_squash = run->squash_for_duplicate_library != from_file->squash_for_duplicate_library;
+    tree->pin_wrapping = run->disable_wrapping != from_file->disable_wrapping;
+    tree->pin_wrap_after = run->wrap_after_n_imports != from_file->wrap_after_n_imports;
+
+    tree->root_dir = strdup(root);
+    tree->owned = DynArray_mk(sizeof(CSortConfig*));
+    tree->cap = CSortConfigTree_initial_cap;
+    tree->slots = (CSortDirConfig*) calloc(tree->cap, sizeof(CSortDirConfig));
+
+    // without a .csortconfig of its own the run's config is the defaults
+    tree->defaults = run;
+    if (lua_config) {
+        CSortConfig* defaults = (CSortConfig*) DEV_malloc(1, sizeof(CSortConfig));
+        *defaults = (CSortConfig) {0};
+        CSortConfig_init(defaults, &csort->arena);
+        DynArray_push(&tree->owned, (void*) &defaults);
+        _dir_config_pin(csort, defaults);
+        tree->defaults = defaults;
+    }
+}
+
+void
+CSortConfigTree_free(CSortConfigTree* tree) {
+    FOR (i, tree->cap) {
+        free(tree->slots[i].dir);
+    }
+    FOR (i, tree->owned.len) {
+        CSortConfig* conf = *(CSortConfig**) DynArray_get(&tree->owned, i);
+        CSortConfig_deinit(conf);
+        free(conf);
+    }
+    free(tree->slots);
+    free(tree->root_dir);
+    DynArray_free(&tree->owned);
+    *tree = (CSortConfigTree) {0};
+}
+
+
+// ~Sharding
+//
+// With `--shard i/N` a file belongs to shard `hash % N + 1`, hashed over its path relative
+// to the root it was found under, so every runner agrees whatever the root is called.
+// Directories keep the hash of their path, files only hash their own name on top.
+
+// FNV-1a of #len bytes at #data, continuing from #hash
+u64
+CSortPathHash_feed(u64 hash, const char* data, u32 len) {
+    FOR (i, len) {
+        hash ^= (u8) data[i];
+        hash *= 0x100000001b3ull;
+    }
+    return hash;
+}
+
+bool
+CSort_in_shard(const CSort* csort, u64 path_hash) {
+    const CSortConfigCmd* cmd = &csort->conf.cmd_options;
+    return ! cmd->shard_count || path_hash % cmd->shard_count == cmd->shard_index;
+}
+
+// `i/N` with 1 <= i <= N, into #CSortConfigCmd::shard_index counting from 0
+int
+CSort_parse_shard(CSort* csort, const char* shard) {
+    CSortConfigCmd* cmd = &csort->conf.cmd_options;
+    u32 index = 0, count = 0;
+    char rest;
+    if (sscanf(shard, "%u/%u%c", &index, &count, &rest) != 2 || ! count || ! index || index > count) {
+        return -1;
+    }
+    cmd->shard_index = index - 1;
+    cmd->shard_count = count;
+    return 0;
+}
+
+// bytes, or KiB, MiB, GiB with a K, M or G suffix, into #CSortConfigCmd::max_memory_bytes
+int
+CSort_parse_max_memory(CSort* csort, const char* size) {
+    char* end = NULL;
+    errno = 0;
+    const unsigned long long n = strtoull(size, &end, 10);
+    if (errno || end == size || ! isdigit((unsigned char) *size)) {
         return -1;
     }
 
+    u32 shift = 0;
+    switch (*end) {
+        case 'k': case 'K': shift = 10; end += 1; break;
+        case 'm': case 'M': shift = 20; end += 1; break;
+        case 'g': case 'G': shift = 30; end += 1; break;
+        default: break;
+    }
+    if (*end != '\0' || ! n || n > (UINT64_MAX >> shift)) {
+        return -1;
+    }
+    csort->conf.cmd_options.max_memory_bytes = (u64) n << shift;
+    return 0;
+}
+
+
+// Whether the file #name in #dir_fd is one we sort, decided from the directory entry before
+// any path is built. The size is only looked up with `--max-file-size`, relative to the
+// open directory. If that fails the file goes through and reading it reports why.
+internal bool
+_wants_file(CSort* csort, const CSortConfig* conf, int dir_fd, const char* name, u32 name_len, u64 dir_hash) {
+    if (! CSortSuffixMatcher_match(&conf->file_ext_matcher, name, name_len)) {
+        return false;
+    }
+    if (! CSort_in_shard(csort, CSortPathHash_feed(dir_hash, name, name_len))) {
+        return false;
+    }
+
+    const u64 max_file_size = csort->conf.cmd_options.max_file_size;
+    struct stat st;
+    if (max_file_size && fstatat(dir_fd, name, &st, 0) == 0 && (u64) st.st_size > max_file_size) {
+        return false;
+    }
+    return true;
+}
+
+typedef struct _DirEntry _DirEntry;
+struct _DirEntry {
+    const char* name;
+    u64 ino;
+    bool is_dir;
+};
+
+internal int
+_compare_entry_names(const void* a, const void* b) {
+    return strcmp(((const _DirEntry*) a)->name, ((const _DirEntry*) b)->name);
+}
+
+// Entries of #dirp by name, so the output doesn't depend on the order of the file system.
+// The names are kept in #names.
+internal void
+_read_dir_sorted(DIR* dirp, String* names, DynArray* entries) {
     struct dirent* d;
     while ((d = readdir(dirp))) {
-        if (! DEV_strIsEq(d->d_name, "..") && ! DEV_strIsEq(d->d_name, ".")) {
-            if (d->d_type == DT_REG) {
-                char newpath[1024];
-                const int newpath_len =  append_path(input_path, d->d_name, newpath, 1024);
-                if (newpath_len < 0) {
-                    log_error("#newpath len exceeded the max len. Skipping file...: %s/%s", input_path, d->d_name);
-                    continue;
-                }
-                callback(csort, newpath);
-            }
-        }
+        if (DEV_strIsEq(d->d_name, "..") || DEV_strIsEq(d->d_name, ".")) continue;
+        if (d->d_type != DT_DIR && d->d_type != DT_REG) continue;
+
+        // an offset until #names is done growing
+        const _DirEntry entry = { .name = (char*) (uintptr_t) names->len, .ino = d->d_ino, .is_dir = (d->d_type == DT_DIR) };
+        string_append(names, d->d_name, strlen(d->d_name) + 1);
+        DynArray_push(entries, (void*) &entry);
     }
-    closedir(dirp);
-    return 0;
+
+    _DirEntry* data = DynArray_data(entries);
+    FOR (i, entries->len) {
+        data[i].name = names->data + (uintptr_t) data[i].name;
+    }
+    qsort(data, entries->len, sizeof(_DirEntry), _compare_entry_names);
 }
 
-int
-CSortPerformOnFileCallbackRecur(CSort* csort, const char* input_path, void (callback)(CSort* csort, const char* input_filepath)) {
+// #name is what #input_path was called in its parent, NULL at the root of the walk,
+// #dir_hash the hash of its path relative to the root, '/' included, #parent_conf the
+// config of the directory above
+internal int
+_perform(CSort* csort, CSortIgnore* ignore, const char* input_path, const char* name, u64 dir_hash, const CSortConfig* parent_conf, bool recursive, void (callback)(CSort* csort, const char* input_filepath, const CSortConfig* conf)) {
+    CSortStats_begin(CSortPhase_Traverse);
+    CSortTrace_begin("scan", input_path);
     DIR* dirp = opendir(input_path);
     if (! dirp) {
         log_error("opendir: Could not open: %s: %s", input_path, strerror(errno));
-        closedir(dirp);
+        CSortTrace_end();
+        CSortStats_end();
         return -1;
     }
 
-    struct dirent* d;
-    while ((d = readdir(dirp))) {
-        if (! DEV_strIsEq(d->d_name, "..") && ! DEV_strIsEq(d->d_name, ".")) {
-            char newpath[1024];
-            int newpath_len =  append_path(input_path, d->d_name, newpath, 1024);
-            if (newpath_len < 0) {
-                log_error("#newpath len exceeded the max len. Skipping file...: %s/%s", input_path, d->d_name);
+    // with more than one root, a directory or file one of them has been through is skipped
+    struct stat dir_stat = {0};
+    if (csort->seen.keys && fstat(dirfd(dirp), &dir_stat) == 0 && ! CSortInodeSet_add(&csort->seen, dir_stat.st_dev, dir_stat.st_ino)) {
+        closedir(dirp);
+        CSortTrace_end();
+        CSortStats_end();
+        return 0;
+    }
+
+    // the root of the walk looks its config up, the directories below only check for their own
+    const CSortConfig* conf = name ? _dir_config(csort, dirfd(dirp), input_path, parent_conf) : _config_for_dir(csort, input_path, strlen(input_path));
+    CSortIgnore_enter(ignore, dirfd(dirp), name);
+    String names = string("", 0);
+    DynArray entries = DynArray_mk(sizeof(_DirEntry));
+    _read_dir_sorted(dirp, &names, &entries);
+
+    FOR (i, entries.len) {
+        const _DirEntry* entry = DynArray_get(&entries, i);
+        const bool is_dir = entry->is_dir;
+        const char* entry_name = entry->name;
+        const u32 entry_name_len = strlen(entry_name);
+
+        // pruned here, before it's ever opened
+        if (is_dir) {
+            if (! recursive) continue;
+            if (CSortIgnore_skip(ignore, entry_name, true)) {
+                CSortStats_count(dirs_pruned, 1);
                 continue;
             }
-
-            if (d->d_type == DT_DIR) {
-                if (! CSortConfigFindStrList(&csort->conf, 1, get_dir_endpoint(newpath, newpath_len))) {
-                    CSortPerformOnFileCallbackRecur(csort, newpath, callback);
-                }
-            } else {
-                if (d->d_type == DT_REG) {
-                    callback(csort, newpath);
-                }
+        } else {
+            CSortStats_count(files_visited, 1);
+            if (! _wants_file(csort, conf, dirfd(dirp), entry_name, entry_name_len, dir_hash) || CSortIgnore_skip(ignore, entry_name, false) ||
+                ! CSortInodeSet_add(&csort->seen, dir_stat.st_dev, entry->ino)) {
+                CSortStats_count(files_skipped, 1);
+                continue;
             }
         }
+
+        char newpath[1024];
+        const int newpath_len = append_path(input_path, entry_name, newpath, 1024);
+        if (newpath_len < 0) {
+            log_error("#newpath len exceeded the max len. Skipping file...: %s/%s", input_path, entry_name);
+            continue;
+        }
+
+        if (is_dir) {
+            const u64 hash = CSortPathHash_feed(CSortPathHash_feed(dir_hash, entry_name, entry_name_len), "/", 1);
+            _perform(csort, ignore, newpath, entry_name, hash, conf, recursive, callback);
+        } else {
+            callback(csort, newpath, conf);
+        }
     }
+
+    DynArray_free(&entries);
+    string_free(&names);
+    CSortIgnore_leave(ignore);
     closedir(dirp);
+    CSortTrace_end();
+    CSortStats_end();
     return 0;
 }
 
+// ~Files from
+//
+// Paths listed in a file instead of found by walking, `git ls-files -z | csort --files-from -`.
+// They're separated by NUL if the first separator is one, by newlines otherwise. The list
+// is read as it comes and every path handed on once complete, directories are never
+// looked at and the files only stat'ed for `--max-file-size` or when there are FILEs too.
+#define CSortFilesFrom_chunk_size (64 * 1024)
+
+internal void
+_handle_listed_path(CSort* csort, char* path, u32 len, void (callback)(CSort* csort, const char* file_path, const CSortConfig* conf)) {
+    if (len && path[len - 1] == '\r') path[--len] = '\0';
+    if (! len) return;
+
+    CSortStats_count(files_visited, 1);
+    const char* name = get_dir_endpoint(path, len);
+    const CSortConfig* conf = CSort_config_for_file(csort, path, len);
+    const u64 max_file_size = csort->conf.cmd_options.max_file_size;
+    const bool need_stat = max_file_size || csort->seen.keys;
+    struct stat st;
+    if (! CSortSuffixMatcher_match(&conf->file_ext_matcher, name, (u32) (path + len - name)) ||
+        ! CSort_in_shard(csort, CSortPathHash_feed(CSortPathHash_basis, path, len)) ||
+        (need_stat && stat(path, &st) == 0 &&
+            ((max_file_size && (u64) st.st_size > max_file_size) || ! CSortInodeSet_add(&csort->seen, st.st_dev, st.st_ino)))) {
+        CSortStats_count(files_skipped, 1);
+        return;
+    }
+
+    CSortStats_end();
+    callback(csort, path, conf);
+    CSortStats_begin(CSortPhase_Traverse);
+}
+
+int
+CSortPerformOnFilesFrom(CSort* csort, FILE* fp, void (callback)(CSort* csort, const char* file_path, const CSortConfig* conf)) {
+    CSortStats_begin(CSortPhase_Traverse);
+    CSortTrace_begin("files-from", NULL);
+    char* chunk = (char*) DEV_malloc(1, CSortFilesFrom_chunk_size);
+    String pending = string("", 0);                     // path cut by the end of a chunk
+    char separator = '\0';
+    bool separator_known = false;
+    int result = 0;
+
+    for (;;) {
+        // read(), not fread(), a pipe hands over what it has instead of waiting to fill the chunk
+        const ssize_t n = read(fileno(fp), chunk, CSortFilesFrom_chunk_size);
+        if (n < 0 && errno == EINTR) continue;
+        if (n < 0) {
+            log_error("files-from: read failed: %s", strerror(errno));
+            result = -1;
+            break;
+        }
+        if (n == 0) break;
+
+        char* begin = chunk;
+        char* end = chunk + n;
+        while (begin < end) {
+            if (! separator_known) {
+                char* p = begin;
+                while (p < end && *p != '\0' && *p != '\n') ++p;
+                if (p == end) break;
+                separator = *p;
+                separator_known = true;
+            }
+
+            char* sep = memchr(begin, separator, end - begin);
+            if (! sep) break;
+            *sep = '\0';
+            if (pending.len) {
+                string_append(&pending, begin, (u32) (sep - begin));
+                _handle_listed_path(csort, pending.data, pending.len, callback);
+                string_clear(&pending);
+            } else {
+                _handle_listed_path(csort, begin, (u32) (sep - begin), callback);
+            }
+            begin = sep + 1;
+        }
+        if (begin < end) string_append(&pending, begin, (u32) (end - begin));
+    }
+
+    // the last path needn't be terminated
+    if (pending.len) {
+        _handle_listed_path(csort, pending.data, pending.len, callback);
+    }
+    string_free(&pending);
+    free(chunk);
+    CSortTrace_end();
+    CSortStats_end();
+    return result;
+}
+
+int
+CSortPerformOnFileCallback(CSort* csort, const char* input_path, void (callback)(CSort* csort, const char* file_path, const CSortConfig* conf)) {
+    CSortIgnore ignore = CSortIgnore_mk(&csort->conf.skip_glob, csort->conf.respect_gitignore);
+    const int result = _perform(csort, &ignore, input_path, NULL, CSortPathHash_basis, NULL, false, callback);
+    CSortIgnore_free(&ignore);
+    return result;
+}
+
+int
+CSortPerformOnFileCallbackRecur(CSort* csort, const char* input_path, void (callback)(CSort* csort, const char* input_filepath, const CSortConfig* conf)) {
+    CSortIgnore ignore = CSortIgnore_mk(&csort->conf.skip_glob, csort->conf.respect_gitignore);
+    const int result = _perform(csort, &ignore, input_path, NULL, CSortPathHash_basis, NULL, true, callback);
+    CSortIgnore_free(&ignore);
+    return result;
+}
+
 // --------------------------------------------------------------------------------------------
 //
 // Module functions 
 // 
 // --------------------------------------------------------------------------------------------
-internal CSortModuleObjNode*
-CSortModuleObjNode_mk(CSortEntity* entity, const String_View* title, const String_View* written_as, enum CSortModuleKind module_kind) {
-    CSortModuleObjNode* module = (CSortModuleObjNode*) DEV_malloc(1, sizeof(CSortModuleObjNode));
-    module->module_kind = module_kind;
-    module->imports = DynArray_mk(sizeof(CSortMemArenaNode*));
-
-    if (! title) {
-        module->title = NULL;
-    } else {
-        module->title = CSortMemArenaCopyCStr(&entity->csort->arena, title->data, title->len);
-    }
+CSortModuleTable
+CSortModuleTable_mk(void) {
+    CSortModuleTable table = {0};
+    table.kinds = DynArray_mk(sizeof(u8));
+    table.titles = DynArray_mk(sizeof(String_View));
+    table.lines = DynArray_mk(sizeof(u32));
+    table.imports_offset = DynArray_mk(sizeof(u32));
+    table.imports_len = DynArray_mk(sizeof(u32));
+    table.imports = DynArray_mk(sizeof(String_View));
+    table.pending = DynArray_mk(sizeof(CSortPendingImport));
+    table.len = 0;
+    return table;
+}
 
-    if (! written_as) {
-        module->written_as = NULL;
-    } else {
-        module->written_as = CSortMemArenaCopyCStr(&entity->csort->arena, written_as->data, written_as->len);
-    }
-    return module;
+// forget every module, but keep the storage around for the next file
+void
+CSortModuleTable_reset(CSortModuleTable* table) {
+    DynArray_clear(&table->kinds);
+    DynArray_clear(&table->titles);
+    DynArray_clear(&table->lines);
+    DynArray_clear(&table->imports_offset);
+    DynArray_clear(&table->imports_len);
+    DynArray_clear(&table->imports);
+    DynArray_clear(&table->pending);
+    table->len = 0;
 }
 
-internal void
-CSortModuleObjNode_free(CSort* csort, CSortModuleObjNode* n) {
-    if (n->module_kind == CSortModuleKind_FROM) {
-        CSortMemArena_dealloc(&csort->arena, n->title);
+void
+CSortModuleTable_free(CSortModuleTable* table) {
+    DynArray_free(&table->kinds);
+    DynArray_free(&table->titles);
+    DynArray_free(&table->lines);
+    DynArray_free(&table->imports_offset);
+    DynArray_free(&table->imports_len);
+    DynArray_free(&table->imports);
+    DynArray_free(&table->pending);
+    table->len = 0;
+}
+
+u32
+CSortModuleTable_add(CSortModuleTable* table, enum CSortModuleKind kind, String_View title, u32 line_in_file) {
+    const u8 kind_u8 = (u8) kind;
+    const u32 zero = 0;
+    DynArray_push(&table->kinds, (void*) &kind_u8);
+    DynArray_push(&table->titles, (void*) &title);
+    DynArray_push(&table->lines, (void*) &line_in_file);
+    DynArray_push(&table->imports_offset, (void*) &zero);
+    DynArray_push(&table->imports_len, (void*) &zero);
+    CSortStats_count(modules, 1);
+    return table->len++;
+}
+
+void
+CSortModuleTable_push_import(CSortModuleTable* table, u32 module, String_View name) {
+    const CSortPendingImport p = { .module = module, .name = name };
+    DynArray_push(&table->pending, (void*) &p);
+    *(u32*) DynArray_get(&table->imports_len, module) += 1;
+}
+
+// groups #pending by module into #imports, keeping parse order within a module
+void
+CSortModuleTable_finalize(CSortModuleTable* table) {
+    u32* offsets = (u32*) DynArray_data(&table->imports_offset);
+    const u32* lens = (const u32*) DynArray_data(&table->imports_len);
+
+    u32 offset = 0;
+    FOR (i, table->len) {
+        offsets[i] = offset;
+        offset += lens[i];
     }
 
-    if (n->written_as) {
-        CSortMemArena_dealloc(&csort->arena, n->title);
+    DynArray_clear(&table->imports);
+    DynArray_reserve(&table->imports, table->pending.len);
+    table->imports.len = table->pending.len;
+    table->imports.mem_free = table->imports.mem_size - table->imports.len;
+
+    // #offsets doubles as a cursor while scattering, rewound afterwards
+    String_View* imports = (String_View*) DynArray_data(&table->imports);
+    const CSortPendingImport* pending = (const CSortPendingImport*) DynArray_data(&table->pending);
+    FOR (i, table->pending.len) {
+        imports[offsets[pending[i].module]++] = pending[i].name;
+    }
+    FOR (i, table->len) {
+        offsets[i] -= lens[i];
     }
-    
-    DynArray_free(&n->imports);
 }
 
 
 // --------------------------------------------------------------------------------------------
-internal void
-CSortEntity_append_module(CSortEntity* entity, CSortModuleObjNode* module_node, u32 line_in_file) {
-    module_node->line_in_file = line_in_file;
-    if (! entity->modules_curr_node) {
-        entity->modules_curr_node = module_node;
-        entity->modules_curr_node->next = NULL;
-        entity->modules_curr_node->prev = NULL;
-        entity->modules = entity->modules_curr_node;
-    } else {
-        module_node->prev = entity->modules_curr_node;
-        module_node->next = NULL;
-        entity->modules_curr_node->next = module_node;
-        entity->modules_curr_node = module_node;
-    }
+CSortWorker
+CSortWorker_mk(void) {
+    return (CSortWorker) {
+        .arena = CSortMemArena_mk(),
+        .modules = CSortModuleTable_mk(),
+        .tokens = DynArray_mk(sizeof(CSortToken)),
+        .statements = DynArray_mk(sizeof(String_View)),
+        .source = string("", 0),
+        .output = string("", 0),
+        .error = {0},
+    };
 }
 
+void
+CSortWorker_reset(CSortWorker* worker) {
+    CSortMemArena_reset(&worker->arena);
+    CSortModuleTable_reset(&worker->modules);
+    DynArray_clear(&worker->tokens);
+    DynArray_clear(&worker->statements);
+}
 
+void
+CSortWorker_free(CSortWorker* worker) {
+    CSortMemArena_free(&worker->arena);
+    CSortModuleTable_free(&worker->modules);
+    DynArray_free(&worker->tokens);
+    DynArray_free(&worker->statements);
+    string_free(&worker->source);
+    string_free(&worker->output);
+}
+
+
+// --------------------------------------------------------------------------------------------
 void
 CSortEntity_deinit(CSortEntity* entity) {
-    for (CSortModuleObjNode* ptr = entity->modules, * tmp = ptr; ptr; tmp = ptr) {
-        ptr = ptr->next;
-        CSortModuleObjNode_free(entity->csort, tmp);
-        free(tmp);
+    CSortWorker_reset(entity->worker);
+}
+
+
+// Names are views into #CSortEntity::source, only a name which doesn't
+// point into it (and so may not outlive the buffer it came from) is copied.
+internal String_View
+CSortEntity_keep_name(CSortEntity* entity, String_View name) {
+    const char* src_begin = SV_begin(entity->source);
+    const char* src_end = SV_end(entity->source);
+    if (SV_len(entity->source) && SV_begin(name) >= src_begin && SV_end(name) <= src_end) {
+        return name;
     }
+
+    char* copy = (char*) CSortMemArena_push(&entity->worker->arena, SV_len(name));
+    memcpy(copy, SV_data(name), SV_len(name));
+    return SV_buff(copy, SV_len(name));
 }
 
 
-// Predicate function for comparing two CSortMemArenaNode
+// value of the digits in [begin, end), 0 if there are none
+internal u64
+_digits_to_u64(const char* begin, const char* end) {
+    u64 n = 0;
+    for (const char* c = begin; c != end && isdigit(*c); ++c) {
+        n = n * 10 + (*c - '0');
+    }
+    return n;
+}
+
+// Predicate function for comparing two names, names with the same prefix
+// are ordered by their numeric suffix (lib2 before lib10).
 int
-_compare_cstr_nodes(const CSortMemArenaNode** n1, const CSortMemArenaNode** n2) {
-    const String_View n1_view = SV((char*) (*n1)->mem);
-    const String_View n2_view = SV((char*) (*n2)->mem);
-    
-    char* digitBegin1 = SV_findFirstNotOfPredRev(n1_view, isdigit);
-    char* digitBegin2 = SV_findFirstNotOfPredRev(n2_view, isdigit);
+_compare_names(const String_View* n1, const String_View* n2) {
+    char* digitBegin1 = SV_findFirstNotOfPredRev(*n1, isdigit);
+    char* digitBegin2 = SV_findFirstNotOfPredRev(*n2, isdigit);
 
     digitBegin1++;
     digitBegin2++;
-    if (DEV_strIsEqN(SV_data(n1_view), digitBegin1 - SV_begin(n1_view),
-                SV_data(n2_view), digitBegin2 - SV_begin(n2_view))) {
-        u64 intN1, intN2;
-        DEV_strToInt(digitBegin1, &intN1, 10);
-        DEV_strToInt(digitBegin2, &intN2, 10);
+    if (DEV_strIsEqN(SV_data(*n1), digitBegin1 - SV_begin(*n1),
+                SV_data(*n2), digitBegin2 - SV_begin(*n2))) {
+        const u64 intN1 = _digits_to_u64(digitBegin1, SV_end(*n1));
+        const u64 intN2 = _digits_to_u64(digitBegin2, SV_end(*n2));
 
         return CSORT_MAX(intN1, intN2);
     }
-    return strncmp((char*) (*n1)->mem, (char*) (*n2)->mem, (*n1)->mem_used); 
+
+    const u32 min_len = SV_len(*n1) < SV_len(*n2) ? SV_len(*n1) : SV_len(*n2);
+    const int cmp = memcmp(SV_data(*n1), SV_data(*n2), min_len);
+    return cmp ? cmp : (int) SV_len(*n1) - (int) SV_len(*n2);
+}
+
+
+// An import with what it's ordered by worked out once, before sorting, from the config's
+// compiled #CSortImportOrder
+typedef struct _SortKey _SortKey;
+struct _SortKey {
+    u32 rank;                                           // unranked for the names of `from x import`
+    String_View key;                                    // #name, lowercased with `case_sensitive = false`
+    String_View name;
+};
+
+internal int
+_compare_sort_keys(const _SortKey* k1, const _SortKey* k2) {
+    if (k1->rank != k2->rank) {
+        return k1->rank < k2->rank ? -1 : 1;
+    }
+    return _compare_names(&k1->key, &k2->key);
 }
 
+internal String_View
+_lowercase(CSortMemArena* arena, String_View name) {
+    char* copy = (char*) CSortMemArena_push(arena, SV_len(name));
+    FOR (i, SV_len(name)) {
+        copy[i] = (char) tolower((unsigned char) SV_data(name)[i]);
+    }
+    return SV_buff(copy, SV_len(name));
+}
 
 internal void
-_sort_imports(CSortModuleObjNode* n) {
-    if (n->imports.len >= 2) {
-        qsort(n->imports.mem, n->imports.len, sizeof(CSortMemArenaNode*), (void*)_compare_cstr_nodes);
+_sort_imports(CSortEntity* entity, u32 module) {
+    CSortModuleTable* table = entity->modules;
+    const CSortImportOrder* order = &entity->conf->import_order;
+    const u32 imports_len = CSortModuleTable_imports_len(table, module);
+    if (imports_len < 2) {
+        return;
     }
+
+    CSortStats_begin(CSortPhase_Sort);
+    String_View* imports = CSortModuleTable_imports(table, module);
+    if (! CSortImportOrder_has_rules(order) && ! order->fold_case) {
+        qsort(imports, imports_len, sizeof(String_View), (void*)_compare_names);
+    } else {
+        // the names of `import a, b` are modules, so the rules rank them too
+        const bool ranked = CSortModuleTable_kind(table, module) == CSortModuleKind_IMPORT;
+        _SortKey* keys = (_SortKey*) CSortMemArena_push(&entity->worker->arena, imports_len * sizeof(_SortKey));
+        FOR (i, imports_len) {
+            keys[i].rank = ranked ? CSortImportOrder_rank(order, SV_data(imports[i]), SV_len(imports[i])) : CSortImportOrder_unranked;
+            keys[i].key = order->fold_case ? _lowercase(&entity->worker->arena, imports[i]) : imports[i];
+            keys[i].name = imports[i];
+        }
+        qsort(keys, imports_len, sizeof(_SortKey), (void*)_compare_sort_keys);
+        FOR (i, imports_len) {
+            imports[i] = keys[i].name;
+        }
+    }
+    CSortStats_end();
+}
+
+internal int
+_compare_u64(const void* a, const void* b) {
+    const u64 x = *(const u64*) a;
+    const u64 y = *(const u64*) b;
+    return (x > y) - (x < y);
+}
+
+// Module ids in the order they're printed, by rank and then as written, NULL when the
+// config has no ordering rules and that's the order of the table already. Imports have
+// to be sorted first, `import a, b` ranks as its first name.
+internal const u32*
+_module_order(CSortEntity* entity) {
+    CSortModuleTable* table = entity->modules;
+    const CSortImportOrder* order = &entity->conf->import_order;
+    if (! CSortImportOrder_has_rules(order)) {
+        return NULL;
+    }
+
+    CSortStats_begin(CSortPhase_Sort);
+    u64* keys = (u64*) CSortMemArena_push(&entity->worker->arena, table->len * sizeof(u64));
+    FOR (i, table->len) {
+        const String_View name = CSortModuleTable_kind(table, i) == CSortModuleKind_FROM
+            ? CSortModuleTable_title(table, i)
+            : CSortModuleTable_imports(table, i)[0];
+        keys[i] = (u64) CSortImportOrder_rank(order, SV_data(name), SV_len(name)) << 32 | i;
+    }
+    qsort(keys, table->len, sizeof(u64), _compare_u64);
+
+    u32* ids = (u32*) CSortMemArena_push(&entity->worker->arena, table->len * sizeof(u32));
+    FOR (i, table->len) {
+        ids[i] = (u32) keys[i];
+    }
+    CSortStats_end();
+    return ids;
 }
 
 
@@ -307,36 +984,83 @@ CSort
 CSort_mk() {
     CSort csort = {0};
     csort.arena = CSortMemArena_mk();
+    csort.worker = CSortWorker_mk();
     return csort;
 }
 
-inline CSortEntity
-CSortEntity_mk(CSort* csort, const char* file_to_sort) {
+// sorts #len bytes at #data, which must outlive the entity
+CSortEntity
+CSortEntity_mk_w_buffer(CSort* csort, CSortWorker* worker, const char* name, char* data, u32 len) {
     CSortEntity entity = {0};
     entity.csort = csort;
-    entity.file_to_sort = file_to_sort;
-    entity.input_file = DEV_fopen(file_to_sort, "r");
+    entity.conf = &csort->conf;
+    entity.worker = worker;
+    entity.file_to_sort = name;
+    entity.source = SV_buff(data, len);
+    entity.status = CSortStatus_Ok;
+    entity.modules = &worker->modules;
+
+    worker->error[0] = '\0';
+    string_clear(&worker->output);
     return entity;
 }
 
+// reads #path into #CSortWorker::source
+enum CSortStatus
+CSortWorker_read_file(CSortWorker* worker, const char* path) {
+    enum CSortStatus status = CSortStatus_Ok;
+    CSortStats_begin(CSortPhase_Read);
+    CSortTrace_begin("read", NULL);
+    FILE* fp = fopen(path, "r");
+    if (! fp || string_from_file(&worker->source, fp) < 0) {
+        snprintf(worker->error, CSort_error_len, "error: could not read: %s: %s", path, strerror(errno));
+        status = CSortStatus_IOError;
+    }
+    if (fp) fclose(fp);
+    CSortTrace_end();
+    CSortStats_end();
+    return status;
+}
 
-inline void
-CSort_init_config(CSort* csort, const char* lua_config) {
+inline CSortEntity
+CSortEntity_mk(CSort* csort, const char* file_to_sort) {
+    CSortWorker* worker = &csort->worker;
+    if (CSortWorker_read_file(worker, file_to_sort) != CSortStatus_Ok) {
+        CSort_panic(csort, "%s", worker->error);
+    }
+    return CSortEntity_mk_w_buffer(csort, worker, file_to_sort, worker->source.data, worker->source.len);
+}
+
+
+// loads the defaults or #lua_config, on failure #CSort::error says why
+int
+CSort_try_init_config(CSort* csort, const char* lua_config) {
     if (! lua_config) {
         CSortConfig_init(&csort->conf, &csort->arena);
-    } else {
-        if (CSortConfig_init_w_lua(&csort->conf, &csort->arena, lua_config) < 0) {
-            // Could possible be a double-free here
-            CSort_panic(csort, "error: could not open: %s", lua_config);
-        }
-        CSort_load_config(csort);
+        return 0;
+    }
+
+    if (CSortConfig_init_w_lua(&csort->conf, &csort->arena, lua_config) < 0) {
+        snprintf(csort->error, CSort_error_len, "error: could not open: %s", lua_config);
+        return -1;
+    }
+    return CSort_load_config(csort);
+}
+
+inline void
+CSort_init_config(CSort* csort, const char* lua_config) {
+    if (CSort_try_init_config(csort, lua_config) < 0) {
+        CSort_panic(csort, "%s", csort->error);
     }
 }
 
 
 inline void
 CSort_deinit(CSort* csort) {
+    CSortInodeSet_free(&csort->seen);
+    CSortConfigTree_free(&csort->configs);
     CSortMemArena_free(&(csort->arena));
+    CSortWorker_free(&csort->worker);
     CSortConfig_deinit(&csort->conf);
 }
 
@@ -349,6 +1073,11 @@ CSort_panic(CSort* csort, const char* msg, ...) {
     vfprintf(stderr, msg, ap);
     va_end(ap);
     putc('\n', stderr);
+    if (csort->on_panic) {
+        void (*on_panic)(CSort*) = csort->on_panic;
+        csort->on_panic = NULL;
+        on_panic(csort);
+    }
     CSort_deinit(csort);
     exit(1);
 }
@@ -356,34 +1085,40 @@ CSort_panic(CSort* csort, const char* msg, ...) {
 
 /**
  *
- * error with token's row, column and message
+ * records an error with token's row, column and message in #CSortWorker::error,
+ * parsing stops at the first one
  *
- * csort:<line_number>:<column>: <error-message>
+ * <line_number>:<column>: <error-message>
  */
-internal inline void
-CSort_panic_tok(CSort* csort, const CSortToken* tok, const char* msg, ...) {
-    fprintf(stderr, "csort:%d:%d: ", tok->line_num, tok->col_offset);
+internal void
+CSortEntity_error_tok(CSortEntity* entity, const CSortLexer* lexer, const CSortToken* tok, const char* msg, ...) {
+    u32 line, col;
+    CSortLexer_position(lexer, *tok, &line, &col);
+    char* error = entity->worker->error;
+    const int n = snprintf(error, CSort_error_len, "%u:%u: ", line, col);
     va_list ap;
     va_start(ap, msg);
-    vfprintf(stderr, msg, ap);
+    vsnprintf(error + n, CSort_error_len - n, msg, ap);
     va_end(ap);
 
-    putc('\n', stderr);
-    CSort_deinit(csort);
-    exit(1);
+    entity->status = CSortStatus_ParseError;
 }
 
 
-// These errors occur at UnExpected Newline or a comment
-internal inline void
-CSortEntity_report_unexpected_errs(CSortEntity* entity, const CSortToken* tok, const char* expected_token_type) {
-#define _unexpected_error(X, ...)\
-    case (X):\
-        CSort_panic_tok(entity->csort, tok, __VA_ARGS__)
-
+// #tok where a #expected_token_type should have been
+internal void
+CSortEntity_error_unexpected(CSortEntity* entity, const CSortLexer* lexer, const CSortToken* tok, const char* expected_token_type) {
     switch (tok->type) {
-        _unexpected_error(CSortTokenNewline, "Expected %s, got newline", expected_token_type);
-        _unexpected_error(CSortTokenComment, "Expected %s, got comment", expected_token_type);
+        case CSortTokenNewline:
+            CSortEntity_error_tok(entity, lexer, tok, "Expected %s, got newline", expected_token_type);
+            break;
+        case CSortTokenEnd:
+            CSortEntity_error_tok(entity, lexer, tok, "Expected %s, got end of file", expected_token_type);
+            break;
+        default: {
+            const String_View text = CSortLexer_text(lexer, *tok);
+            CSortEntity_error_tok(entity, lexer, tok, "Expected %s got '%.*s'", expected_token_type, SV_len(text), SV_data(text));
+        }
     }
 }
 
@@ -394,18 +1129,35 @@ CSortEntity_report_unexpected_errs(CSortEntity* entity, const CSortToken* tok, c
 // Lua Config
 // 
 // --------------------------------------------------------------------------------------------
-internal inline bool
-_optBool(CSort* csort, lua_State* luaCtx, const char* opt) {
+// #inherited is what #value is when #opt isn't set, NULL if it has to be
+internal inline int
+_optBool(CSort* csort, lua_State* luaCtx, const char* opt, bool* value, const bool* inherited) {
     lua_getglobal(luaCtx, opt);
-    CSortAssert(csort, (lua_type(luaCtx, -1) == LUA_TBOOLEAN));
-    return lua_toboolean(luaCtx, -1) ? true : false;
+    if (inherited && lua_type(luaCtx, -1) == LUA_TNIL) {
+        *value = *inherited;
+        return 0;
+    }
+    if (lua_type(luaCtx, -1) != LUA_TBOOLEAN) {
+        snprintf(csort->error, CSort_error_len, "%s, Expected type LUA_TBOOLEAN got %s ???", opt, luaL_typename(luaCtx, -1));
+        return -1;
+    }
+    *value = lua_toboolean(luaCtx, -1) ? true : false;
+    return 0;
 }
 
-internal inline u32
-_optNum(CSort* csort, lua_State* luaCtx, const char* opt) {
+internal inline int
+_optNum(CSort* csort, lua_State* luaCtx, const char* opt, u64* value, const u64* inherited) {
     lua_getglobal(luaCtx, opt);
-    CSortAssert(csort, (lua_type(luaCtx, -1) == LUA_TNUMBER));
-    return lua_tonumber(luaCtx, -1);
+    if (inherited && lua_type(luaCtx, -1) == LUA_TNIL) {
+        *value = *inherited;
+        return 0;
+    }
+    if (lua_type(luaCtx, -1) != LUA_TNUMBER) {
+        snprintf(csort->error, CSort_error_len, "%s, Expected type LUA_TNUMBER got %s ???", opt, luaL_typename(luaCtx, -1));
+        return -1;
+    }
+    *value = lua_tonumber(luaCtx, -1);
+    return 0;
 }
 
 
@@ -416,34 +1168,75 @@ _is_nil(const CSort* csort, const char* opt) {\
     return DEV_bool(lua_type(luaCtx, -1) == LUA_TNIL);
 }
 
-void
+// the list #name into #list, or #parent's copied over when the file doesn't set it,
+// sorted unless the order it's written in is what it means
+internal int
+_optList(CSort* csort, lua_State* lua, const char* name, DynArray* list, const DynArray* parent, bool in_order) {
+    lua_getglobal(lua, name);
+    if (parent && lua_type(lua, -1) == LUA_TNIL) {
+        array_push_from_array(list, parent);
+        return 0;
+    }
+    if ((in_order ? array_push_from_seq(list, lua, name) : array_push_from_str(list, lua, name)) < 0) {
+        snprintf(csort->error, CSort_error_len, "%s, Expected a table of strings got %s ???", name, luaL_typename(lua, -1));
+        return -1;
+    }
+    if (! in_order) {
+        qsort(DynArray_data(list), list->len, sizeof(String), string_strncmp);
+    }
+    return 0;
+}
+
+// what the file doesn't set keeps its default
+int
 CSort_load_config(CSort* csort) {
-    CSortConfig* conf = &csort->conf;
-    lua_State* lua = csort->conf.lua;
+    CSortConfig defaults = {0};
+    CSortConfig_init(&defaults, &csort->arena);
+    const int result = CSort_load_config_over(csort, &csort->conf, &defaults);
+    CSortConfig_deinit(&defaults);
+    return result;
+}
 
-    // load strings in know_standard_library into memory
-    if (array_push_from_str(&conf->know_standard_library, lua, "know_standard_library") < 0) {
-        CSort_panic(csort, "%s, Expected type LUA_TTABLE got %s ???", "know_standard_library", luaL_typename(lua, -1));
-    }
-    qsort(conf->know_standard_library.mem, conf->know_standard_library.len, sizeof(String), string_strncmp);
+// reads the globals of #conf's Lua state into #conf, those it doesn't set come from #parent,
+// or they all have to be set without one
+int
+CSort_load_config_over(CSort* csort, CSortConfig* conf, const CSortConfig* parent) {
+#define _inherited(X) (parent ? &parent->X : NULL)
+    lua_State* lua = conf->lua;
 
-    // load strings in skip_directories into memory
-    if (array_push_from_str(&conf->skip_directories, lua, "skip_directories") < 0) {
-        CSort_panic(csort, "%s, Expected type LUA_TTABLE got %s ???", "skip_directories", luaL_typename(lua, -1));
+    if (_optList(csort, lua, "know_standard_library", &conf->know_standard_library, _inherited(know_standard_library), false) < 0 ||
+        _optList(csort, lua, "skip_directories", &conf->skip_directories, _inherited(skip_directories), false) < 0 ||
+        _optList(csort, lua, "file_exts", &conf->file_exts, _inherited(file_exts), false) < 0) {
+        return -1;
+    }
+    CSortConfig_compile_skip_directories(conf);
+    CSortSuffixMatcher_build(&conf->file_ext_matcher, &conf->file_exts);
+
+    if (_optBool(csort, lua, "squash_for_duplicate_library", &conf->squash_for_duplicate_library, _inherited(squash_for_duplicate_library)) < 0 ||
+        _optBool(csort, lua, "disable_wrapping", &conf->disable_wrapping, _inherited(disable_wrapping)) < 0 ||
+        _optNum(csort, lua, "wrap_after_n_imports", &conf->wrap_after_n_imports, _inherited(wrap_after_n_imports)) < 0 ||
+        _optNum(csort, lua, "import_on_each_wrap", &conf->import_on_each_wrap, _inherited(import_on_each_wrap)) < 0 ||
+        _optNum(csort, lua, "wrap_after_col", &conf->wrap_after_col, _inherited(wrap_after_col)) < 0) {
+        return -1;
     }
-    qsort(conf->skip_directories.mem, conf->skip_directories.len, sizeof(String), string_strncmp);
 
-    // load strings in #file_exts into memory
-    if (array_push_from_str(&conf->file_exts, lua, "file_exts") < 0) {
-        CSort_panic(csort, "%s, Expected type LUA_TTABLE got %s ???", "skip_directories", luaL_typename(lua, -1));
+    // optional, configs from before it existed are still valid
+    const bool no_gitignore = false;
+    if (_optBool(csort, lua, "respect_gitignore", &conf->respect_gitignore, parent ? &parent->respect_gitignore : &no_gitignore) < 0) {
+        return -1;
     }
-    qsort(conf->file_exts.mem, conf->file_exts.len, sizeof(String), string_strncmp);
 
-    conf->squash_for_duplicate_library = _optBool(csort, lua, "squash_for_duplicate_library");
-    conf->disable_wrapping = _optBool(csort, lua, "disable_wrapping");
-    conf->wrap_after_n_imports = _optNum(csort, lua, "wrap_after_n_imports");
-    conf->import_on_each_wrap = _optNum(csort, lua, "import_on_each_wrap");
-    conf->wrap_after_col = _optNum(csort, lua, "wrap_after_col");
+    // ordering rules, optional as well, compiled to ranks here so sorting never needs Lua
+    const DynArray no_rules = DynArray_mk(sizeof(String));
+    const bool case_sensitive = true;
+    if (_optList(csort, lua, "force_to_top", &conf->force_to_top, parent ? &parent->force_to_top : &no_rules, true) < 0 ||
+        _optList(csort, lua, "force_to_bottom", &conf->force_to_bottom, parent ? &parent->force_to_bottom : &no_rules, true) < 0 ||
+        _optBool(csort, lua, "case_sensitive", &conf->case_sensitive, parent ? &parent->case_sensitive : &case_sensitive) < 0) {
+        return -1;
+    }
+    CSortImportOrder_build(&conf->import_order, &conf->force_to_top, &conf->force_to_bottom, conf->case_sensitive);
+    return 0;
+#undef _inherited
 }
 
 
@@ -463,112 +1256,386 @@ CSort_gettokentype(const String_View* tok_view) {
 }
 
 
-internal inline String_View
-CSort_inc_buff(const String_View* prev_buff, const CSortToken* tok) {
-    return SV_buff(SV_end(tok->tok_view) + tok->next_tok_offset, prev_buff->len - SV_len(tok->tok_view) - tok->next_tok_offset);
+CSortLexer
+CSortLexer_mk(CSortMemArena* arena, DynArray* tokens) {
+    return (CSortLexer) {
+        .state = CSortLex_Blank,
+        .line = 1,
+        .col = 0,
+        .arena = arena,
+        .tokens = tokens,
+        .stmt_end = tokens->len,
+    };
 }
 
 
-internal CSortToken
-CSort_nexttoken(const _ParseInfo* p) {
-#define _col_offset(X) ((X) - static_buf)
-    varPersist String_View tok_view = {0};
-    varPersist enum CSortTokenType tok_type;
-    char* tok_begin = SV_begin(p->buf_view);
-    char* tok_end = SV_end(p->buf_view);
-    const char* static_buf = p->buf;
+internal inline bool
+_is_name_char(char c) {
+    switch (c) {
+        case ' ': case '\t': case '\r': case '\f': case '\n':
+        case ',': case ';': case '#': case '\\': case '"': case '\'':
+        case '(': case ')': case '[': case ']': case '{': case '}':
+            return false;
+    }
+    return true;
+}
 
-    tok_begin = str_findFirstNotOf(tok_begin, tok_end, ' ');
+// appends #len bytes of #text to #CSortLexer::spill, returns where they are in it
+internal u32
+_lexer_spill(CSortLexer* lx, const char* text, u32 len) {
+    if (lx->spill_len + len > lx->spill_cap) {
+        u32 cap = lx->spill_cap ? lx->spill_cap * 2 : CSortLexer_spill_size;
+        while (cap < lx->spill_len + len) {
+            cap *= 2;
+        }
+        char* spill = (char*) CSortMemArena_push(lx->arena, cap);
+        if (lx->spill_len) {
+            memcpy(spill, lx->spill, lx->spill_len);
+        }
+        lx->spill = spill;
+        lx->spill_cap = cap;
+    }
+    if (len) {
+        memcpy(lx->spill + lx->spill_len, text, len);
+    }
+    lx->spill_len += len;
+    return lx->spill_len - len;
+}
 
-    for (char* c = tok_begin; c != tok_end; ++c) {
-        switch (*c) {
-            case ' ': {
-                tok_view = SV_slice(tok_begin, c);
-                char* new_c = str_findFirstNotOf(c, tok_end, ' ');
-                tok_type = CSort_gettokentype(&tok_view);
-                if (tok_type == CSortTokenFrom) {
-                    if (tok_begin == static_buf) {
-                        return CSortToken_mk(tok_view, tok_type, new_c - c, p->line_counter, _col_offset(c));
-                    }
-                } else if (tok_type == CSortTokenImport) {
-                    // TODO(emf): check if the previous token type we parsed was `from` or its at start of buffer
-                    return CSortToken_mk(tok_view, tok_type, new_c - c, p->line_counter, _col_offset(c));
-                } else {
-                    return CSortToken_mk(tok_view, tok_type, new_c - c, p->line_counter, _col_offset(c));
-                }
+// #begin doesn't continue #CSortLexer::base, which is only valid until this call
+internal void
+_lexer_rebase(CSortLexer* lx, char* begin) {
+    if (lx->base) {
+        CSortToken* toks = (CSortToken*) DynArray_data(lx->tokens);
+        FOR (i, lx->tokens->len) {
+            if (! toks[i].spilled) {
+                toks[i].at = _lexer_spill(lx, lx->base + toks[i].at, toks[i].len);
+                toks[i].spilled = true;
             }
-            break;
+        }
+        // last, so it's at the end of the spill and the rest of the name can follow it
+        if (lx->state == CSortLex_Name && ! lx->carry_spilled) {
+            lx->carry = _lexer_spill(lx, lx->base + lx->carry, lx->base_len - lx->carry);
+            lx->carry_spilled = true;
+        }
+    }
+    lx->base = begin;
+    lx->base_len = 0;
+    lx->base_line = lx->line;
+    lx->base_col = lx->col;
+    lx->line_seen = lx->line;
+    lx->line_seen_at = 0;
+}
+
+internal inline void
+_lexer_push(CSortLexer* lx, u32 at, u32 len, enum CSortTokenType type, bool spilled) {
+    CSortToken tok = CSortToken_mk(at, len, type, spilled);
+    DynArray_push(lx->tokens, (void*) &tok);
+}
+
+internal void
+_lexer_push_name(CSortLexer* lx, u32 at, u32 len, bool spilled) {
+    if (len > CSortToken_max_len) {
+        _lexer_push(lx, at, CSortToken_max_len, CSortTokenString, spilled);
+        return;
+    }
 
-            case ',': {
-                if (c == tok_begin) {
-                    tok_view = SV_buff(c, 1);
-                    return CSortToken_mk(tok_view, CSortTokenComma, 0, p->line_counter, _col_offset(c));
+    const String_View name = CSortLexer_text(lx, CSortToken_mk(at, len, CSortTokenIdentifier, spilled));
+    enum CSortTokenType type = CSort_gettokentype(&name);
+    // `from` only starts a statement at the beginning of an unindented line
+    if (type == CSortTokenFrom && (lx->name_col != 0 || lx->bracket_depth != 0)) {
+        type = CSortTokenIdentifier;
+    }
+    _lexer_push(lx, at, len, type, spilled);
+}
+
+internal void
+_lexer_end_name(CSortLexer* lx, char* begin, char* end) {
+    if (lx->carry_spilled) {
+        _lexer_spill(lx, begin, end - begin);
+        _lexer_push_name(lx, lx->carry, lx->spill_len - lx->carry, true);
+        lx->carry_spilled = false;
+    } else _lexer_push_name(lx, begin - lx->base, end - begin, false);
+}
+
+// #end is the '\n' or ';' ending the statement, NULL at the end of input
+internal inline void
+_lexer_end_statement(CSortLexer* lx, char* end) {
+    if (lx->tokens->len != lx->stmt_end) {
+        if (end) {
+            _lexer_push(lx, end - lx->base, 1, CSortTokenNewline, false);
+        } else _lexer_push(lx, lx->base_len, 0, CSortTokenNewline, false);
+        lx->stmt_end = lx->tokens->len;
+    }
+}
+
+
+void
+CSortLexer_feed(CSortLexer* lx, String_View chunk) {
+    if (! SV_len(chunk)) {
+        return;
+    }
+
+    char* c = SV_begin(chunk);
+    char* end = SV_end(chunk);
+    const u32 tokens_before = lx->tokens->len;
+
+    if (! lx->base || c != lx->base + lx->base_len) {
+        _lexer_rebase(lx, c);
+    }
+    // a name cut by the end of the last chunk goes on from where it started
+    char* name_begin = (lx->state == CSortLex_Name && ! lx->carry_spilled) ? lx->base + lx->carry : c;
+
+    for (; c != end; ++c) {
+        const char ch = *c;
+_redo:
+        switch (lx->state) {
+            case CSortLex_Name:
+                if (_is_name_char(ch)) break;
+                _lexer_end_name(lx, name_begin, c);
+                lx->state = CSortLex_Blank;
+                goto _redo;
+
+            case CSortLex_Blank:
+                switch (ch) {
+                    case ' ': case '\t': case '\r': case '\f':
+                        break;
+                    case '\n':
+                        if (lx->bracket_depth == 0) _lexer_end_statement(lx, c);
+                        break;
+                    case ';':
+                        _lexer_end_statement(lx, c);
+                        break;
+                    case '#':
+                        lx->state = CSortLex_Comment;
+                        break;
+                    case '\\':
+                        lx->state = CSortLex_Backslash;
+                        break;
+                    case ',':
+                        _lexer_push(lx, c - lx->base, 1, CSortTokenComma, false);
+                        break;
+                    case '(':
+                        _lexer_push(lx, c - lx->base, 1, CSortTokenLParen, false);
+                        lx->bracket_depth += 1;
+                        break;
+                    case ')':
+                        _lexer_push(lx, c - lx->base, 1, CSortTokenRParen, false);
+                        if (lx->bracket_depth) lx->bracket_depth -= 1;
+                        break;
+                    case '[': case '{':
+                        lx->bracket_depth += 1;
+                        break;
+                    case ']': case '}':
+                        if (lx->bracket_depth) lx->bracket_depth -= 1;
+                        break;
+                    case '"': case '\'':
+                        lx->quote = ch;
+                        lx->state = CSortLex_Quote1;
+                        break;
+                    default:
+                        lx->state = CSortLex_Name;
+                        name_begin = c;
+                        lx->name_col = lx->col;
                 }
-                tok_view = SV_slice(tok_begin, c);
-                tok_type = CSort_gettokentype(&tok_view);
-                return CSortToken_mk(tok_view, tok_type, 0, p->line_counter, _col_offset(c));
-            }
-            break;
+                break;
 
-            case '#':
-                tok_view = SV_buff(c, 1);
-                return CSortToken_mk(tok_view, CSortTokenComment, 0, p->line_counter, _col_offset(c));
+            case CSortLex_Comment:
+                if (ch == '\n') {
+                    lx->state = CSortLex_Blank;
+                    goto _redo;
+                }
+                break;
+
+            // a backslash joins the next line, unless it isn't the last thing on the line
+            case CSortLex_Backslash:
+                if (ch == '\n') {
+                    lx->state = CSortLex_Blank;
+                } else if (ch != '\r' && ch != ' ' && ch != '\t') {
+                    lx->state = CSortLex_Blank;
+                    goto _redo;
+                }
+                break;
+
+            case CSortLex_Quote1:
+                if (ch == lx->quote) {
+                    lx->state = CSortLex_Quote2;
+                } else {
+                    lx->state = CSortLex_String;
+                    goto _redo;
+                }
+                break;
+
+            case CSortLex_Quote2:
+                lx->state = (ch == lx->quote) ? CSortLex_Triple : CSortLex_Blank;
+                if (lx->state == CSortLex_Blank) goto _redo;
+                break;
+
+            case CSortLex_String:
+                if (ch == '\\') {
+                    lx->state = CSortLex_StringEscape;
+                } else if (ch == lx->quote) {
+                    lx->state = CSortLex_Blank;
+                } else if (ch == '\n') {
+                    // unterminated, don't let it eat the rest of the file
+                    lx->state = CSortLex_Blank;
+                    goto _redo;
+                }
+                break;
+
+            case CSortLex_StringEscape:
+                lx->state = CSortLex_String;
+                break;
 
-            case '\n': {
-                tok_view = SV_slice(tok_begin, c);
-                if (c == tok_begin) {
-                    return CSortToken_mk(tok_view, CSortTokenNewline, 0, p->line_counter, _col_offset(c));
+            case CSortLex_Triple:
+                if (ch == '\\') {
+                    lx->state = CSortLex_TripleEscape;
+                } else if (ch == lx->quote) {
+                    lx->state = CSortLex_TripleQuote1;
                 }
-                tok_type = CSort_gettokentype(&tok_view);
-                return CSortToken_mk(tok_view, tok_type, 0, p->line_counter, _col_offset(c));
-           }
+                break;
+
+            case CSortLex_TripleQuote1:
+            case CSortLex_TripleQuote2:
+                if (ch == lx->quote) {
+                    lx->state = (lx->state == CSortLex_TripleQuote1) ? CSortLex_TripleQuote2 : CSortLex_Blank;
+                } else {
+                    lx->state = CSortLex_Triple;
+                    goto _redo;
+                }
+                break;
+
+            case CSortLex_TripleEscape:
+                lx->state = CSortLex_Triple;
+                break;
         }
+
+        if (ch == '\n') {
+            lx->line += 1;
+            lx->col = 0;
+            CSortStats_count(lines_read, 1);
+        } else lx->col += 1;
     }
 
-    return CSortToken_mk(tok_view, CSortTokenNewline, 0, p->line_counter, _col_offset(tok_begin));
+    lx->base_len += SV_len(chunk);
+    if (lx->state == CSortLex_Name) {
+        if (lx->carry_spilled) {
+            _lexer_spill(lx, name_begin, end - name_begin);
+        } else lx->carry = name_begin - lx->base;
+    }
+    CSortStats_count(tokens, lx->tokens->len - tokens_before);
 }
 
 
-internal CSortModuleObjNode*
-CSortEntity_find_module(const CSortEntity* entity, const String_View* tok_view) {
-    for (CSortModuleObjNode* ptr = entity->modules; ptr; ptr = ptr->next) {
-        if (ptr->module_kind == CSortModuleKind_FROM) {
-            if (SV_isEqRaw(*tok_view, (char*) ptr->title->mem)) {
-                return ptr;
-            }
-        }
+// ends the last statement at the end of input
+void
+CSortLexer_finish(CSortLexer* lx) {
+    const u32 tokens_before = lx->tokens->len;
+    if (lx->state == CSortLex_Name) {
+        if (lx->carry_spilled) {
+            _lexer_push_name(lx, lx->carry, lx->spill_len - lx->carry, true);
+        } else _lexer_push_name(lx, lx->carry, lx->base_len - lx->carry, false);
+        lx->carry_spilled = false;
     }
-    return NULL;
+    if (lx->col != 0) {
+        CSortStats_count(lines_read, 1);
+    }
+
+    lx->state = CSortLex_Blank;
+    lx->bracket_depth = 0;
+    _lexer_end_statement(lx, NULL);
+    CSortStats_count(tokens, lx->tokens->len - tokens_before);
 }
 
 
-internal CSortModuleObjNode*
-_search_for_imports(const CSortEntity* entity, const String_View* tok_view) {
-    for (CSortModuleObjNode* ptr = entity->modules; ptr; ptr = ptr->next) {
-        if (ptr->module_kind == CSortModuleKind_IMPORT) {
-            for (u32 i = 0; i < ptr->imports.len; ++i) {
-                CSortMemArenaNode** str_node = (CSortMemArenaNode**) DynArray_get(&ptr->imports, i);
-                if (SV_isEqRaw(*tok_view, (char*) (*str_node)->mem)) {
-                    return ptr;
-                }
-            }
+// forgets the tokens of the whole statements, keeping one still in progress
+void
+CSortLexer_drop_statements(CSortLexer* lx) {
+    DynArray_drop_front(lx->tokens, lx->stmt_end);
+    lx->stmt_end = 0;
+}
+
+
+// line and column #tok starts at, counted from the start of #CSortLexer::base
+void
+CSortLexer_position(const CSortLexer* lx, CSortToken tok, u32* line, u32* col) {
+    *line = lx->base_line;
+    *col = lx->base_col;
+    if (tok.spilled) {
+        return;
+    }
+    FOR (i, tok.at) {
+        if (lx->base[i] == '\n') {
+            *line += 1;
+            *col = 0;
+        } else *col += 1;
+    }
+}
+
+
+// line #tok starts on, counting on from the last token asked about, which the parser's
+// tokens always come after
+u32
+CSortLexer_line(CSortLexer* lx, CSortToken tok) {
+    if (tok.spilled) {
+        return lx->base_line;
+    }
+    if (tok.at < lx->line_seen_at) {
+        lx->line_seen = lx->base_line;
+        lx->line_seen_at = 0;
+    }
+    const char* c = lx->base + lx->line_seen_at;
+    const char* end = lx->base + tok.at;
+    while ((c = (const char*) memchr(c, '\n', end - c))) {
+        lx->line_seen += 1;
+        c += 1;
+    }
+    lx->line_seen_at = tok.at;
+    return lx->line_seen;
+}
+
+
+#define CSortModule_none ((u32) -1)
+
+// finds the `from` module titled #tok_view
+internal u32
+CSortEntity_find_module(CSortEntity* entity, const String_View* tok_view) {
+    CSortModuleTable* table = entity->modules;
+    const u8* kinds = (const u8*) DynArray_data(&table->kinds);
+    const String_View* titles = (const String_View*) DynArray_data(&table->titles);
+    FOR (i, table->len) {
+        if (kinds[i] == CSortModuleKind_FROM && SV_isEq(*tok_view, titles[i])) {
+            return i;
         }
     }
+    return CSortModule_none;
+}
 
-    return NULL;
+
+// finds the plain `import` module which already imports #tok_view
+internal u32
+_search_for_imports(CSortEntity* entity, const String_View* tok_view) {
+    CSortModuleTable* table = entity->modules;
+    const u8* kinds = (const u8*) DynArray_data(&table->kinds);
+    const CSortPendingImport* pending = (const CSortPendingImport*) DynArray_data(&table->pending);
+    FOR (i, table->pending.len) {
+        if (kinds[pending[i].module] == CSortModuleKind_IMPORT && SV_isEq(*tok_view, pending[i].name)) {
+            return pending[i].module;
+        }
+    }
+    return CSortModule_none;
 }
 
 
 internal bool
-_search_import_from_statement(CSortModuleObjNode* n, const String_View* tok_view) {
-    CSortMemArenaNode** str_node;
-    for (u32 i = 0; i < n->imports.len; ++i) {
-        str_node = (CSortMemArenaNode**) DynArray_get(&n->imports, i);
-        if (SV_isEqRaw(*tok_view, (char*) (*str_node)->mem)) {
+_search_import_from_statement(CSortEntity* entity, u32 module, const String_View* tok_view) {
+    const CSortModuleTable* table = entity->modules;
+    const CSortPendingImport* pending = (const CSortPendingImport*) DynArray_data(&table->pending);
+    FOR (i, table->pending.len) {
+        if (pending[i].module == module && SV_isEq(*tok_view, pending[i].name)) {
             return true;
         }
     }
-
     return false;
 }
 
@@ -579,154 +1646,237 @@ _search_import_from_statement(CSortModuleObjNode* n, const String_View* tok_view
 // Parse functions
 // 
 // --------------------------------------------------------------------------------------------
-// fills the buffer with newline and updates the `line_counter`
-internal int
-_getline(_ParseInfo* p) {
-    bzero(p->buf, 512);
-    if (! fgets(p->buf, 512, p->entity->input_file)) {
-        return -1;
-    }
-    p->line_counter += 1;
-    return 0;
-}
-
-
+// next token of the statements being parsed, #CSortTokenEnd after the last one
 internal inline const CSortToken*
 _update_token(_ParseInfo* p) {
-    *(p->tok) = CSort_nexttoken(p);
-    if (p->tok->type == CSortTokenNewline || p->tok->type == CSortTokenComment || p->tok->type == CSortTokenStart) {
-        if (_getline(p) < 0) {
-            *(p->tok) = CSortToken_mk(p->tok->tok_view, CSortTokenEnd, 0, 0, 0);
-        } else {
-            p->buf_view = SV(p->buf);
-        }
-    } else {
-        p->buf_view = CSort_inc_buff(&p->buf_view, p->tok);
+    if (p->next < p->tokens_len) {
+        return &p->tokens[p->next++];
     }
-
-    return p->tok;
+    return &p->end_tok;
 }
 
 
 internal void
-_push_import(CSortEntity* entity, CSortModuleObjNode* n, const String_View* tok_view) {
-    CSortMemArenaNode* s = CSortMemArenaCopyCStr(&entity->csort->arena, tok_view->data, tok_view->len);
-    DynArray_push(&n->imports, (void*)&s);
+_push_import(CSortEntity* entity, u32 module, const String_View* tok_view) {
+    CSortModuleTable_push_import(entity->modules, module, CSortEntity_keep_name(entity, *tok_view));
+    CSortStats_count(imports, 1);
 }
 
 
 // parses import statement with with check for duplicate modules
-internal CSortModuleObjNode*
-_parse_import_statement_with_duplicate_check(CSortEntity* entity, _ParseInfo* parse_info, bool* is_already_kept) {
+internal void
+_parse_import_statement_with_duplicate_check(CSortEntity* entity, _ParseInfo* parse_info) {
     const CSortToken* tok;;
-    CSortModuleObjNode* _import = NULL;
-    *is_already_kept = true;
+    u32 _import = CSortModule_none;
 
     do {
         tok =_update_token(parse_info);
         if (tok->type != CSortTokenIdentifier) {
-            CSortEntity_report_unexpected_errs(entity, tok, "module");
-            CSort_panic_tok(entity->csort, tok, "Expected module got '%*.s'", SV_len(tok->tok_view), SV_data(tok->tok_view));
+            CSortEntity_error_unexpected(entity, parse_info->lexer, tok, "module");
+            return;
         }
 
-        _import = _search_for_imports(entity, &tok->tok_view);
-        if (! _import) {
-            *is_already_kept = false;
-            _import = CSortModuleObjNode_mk(entity, NULL, NULL, CSortModuleKind_IMPORT);
-            _push_import(entity, _import, &tok->tok_view);
+        const String_View name = CSortLexer_text(parse_info->lexer, *tok);
+        _import = _search_for_imports(entity, &name);
+        if (_import == CSortModule_none) {
+            const u32 line = CSortLexer_line(parse_info->lexer, *tok);
+            _import = CSortModuleTable_add(entity->modules, CSortModuleKind_IMPORT, SV_buff(NULL, 0), line);
+            _push_import(entity, _import, &name);
 
             tok =_update_token(parse_info);
             if (tok->type == CSortTokenComma) {
                 goto _push_more_imports;
             } else goto _return;
         }
+        CSortStats_count(duplicates_squashed, 1);
     } while (tok = _update_token(parse_info), tok->type == CSortTokenComma || tok->type == CSortTokenIdentifier);
         
 _return:
-    return _import;
+    return;
 
 _push_more_imports:
     do {
         tok = _update_token(parse_info);
         if (tok->type != CSortTokenIdentifier) {
-            CSort_panic_tok(entity->csort, tok, "Expected module got '%*.s'", SV_len(tok->tok_view), SV_data(tok->tok_view));
+            CSortEntity_error_unexpected(entity, parse_info->lexer, tok, "module");
+            return;
         }
 
-        _push_import(entity, _import, &tok->tok_view);
+        const String_View name = CSortLexer_text(parse_info->lexer, *tok);
+        _push_import(entity, _import, &name);
         tok = _update_token(parse_info);
     } while (tok->type == CSortTokenComma || tok->type == CSortTokenIdentifier);
-
-    return _import;
 }
 
 
-// parses import statement
+// parses import statement, the imports may be wrapped in parentheses
 internal void
-_parse_import_after_from(CSortEntity* entity, _ParseInfo* parse_info, CSortModuleObjNode* n) {
+_parse_import_after_from(CSortEntity* entity, _ParseInfo* parse_info, u32 module) {
     const CSortToken* tok;
+    const bool wrapped = parse_info->next < parse_info->tokens_len &&
+                         parse_info->tokens[parse_info->next].type == CSortTokenLParen;
+    if (wrapped) {
+        _update_token(parse_info);
+    }
+
     do {
         tok = _update_token(parse_info);
+        if (wrapped && tok->type == CSortTokenRParen) {
+            break;                                      // trailing comma
+        }
         if (tok->type != CSortTokenIdentifier) {
-            CSortEntity_report_unexpected_errs(entity, tok, "module");
-            CSort_panic_tok(entity->csort, tok, "Expected module got '%*.s'", SV_len(tok->tok_view), SV_data(tok->tok_view));
+            CSortEntity_error_unexpected(entity, parse_info->lexer, tok, "module");
+            return;
         }
 
-        if (! _search_import_from_statement(n, &tok->tok_view)) {
-            _push_import(entity, n, &tok->tok_view);
-        }
+        const String_View name = CSortLexer_text(parse_info->lexer, *tok);
+        if (! _search_import_from_statement(entity, module, &name)) {
+            _push_import(entity, module, &name);
+        } else CSortStats_count(duplicates_squashed, 1);
         tok = _update_token(parse_info);
     } while (tok->type == CSortTokenComma || tok->type == CSortTokenIdentifier);
+
+    if (wrapped && tok->type != CSortTokenRParen) {
+        CSortEntity_error_unexpected(entity, parse_info->lexer, tok, "')'");
+    }
 }
 
 
 
 // --------------------------------------------------------------------------------------------
-void
-CSortEntity_sort(CSortEntity* entity) {
-    varPersist const CSortToken* tok;
+// Remembers the source text of the import statement starting at token #stmt_begin, from the
+// start of its first line through its newline, to tell if sorting would change anything.
+internal void
+_push_statement_text(CSortEntity* entity, const _ParseInfo* p, u32 stmt_begin) {
+    char* begin = SV_begin(CSortLexer_text(p->lexer, p->tokens[stmt_begin]));
+    while (begin != SV_begin(entity->source) && begin[-1] != '\n') {
+        begin -= 1;
+    }
 
-    CSort* csort = entity->csort;
-    CSortToken initial_tok = CSortToken_mk_initial();
-    _ParseInfo parse_info = _ParseInfo_mk(entity, &initial_tok);
+    u32 i = stmt_begin;
+    while (i < p->tokens_len && p->tokens[i].type != CSortTokenNewline) {
+        i += 1;
+    }
+    char* end = (i < p->tokens_len && p->tokens[i].len) ? SV_end(CSortLexer_text(p->lexer, p->tokens[i])) : SV_end(entity->source);
+
+    const String_View text = SV_slice(begin, end);
+    DynArray_push(&entity->worker->statements, (void*) &text);
+}
+
+
+// parses the statements #lexer has completed so far
+internal void
+CSortEntity_parse_statements(CSortEntity* entity, CSortLexer* lexer) {
+    const CSortToken* tok;
+
+    _ParseInfo parse_info = _ParseInfo_mk(entity, lexer);
+
+    CSortStats_begin(CSortPhase_Parse);
+    while (entity->status == CSortStatus_Ok && (tok = _update_token(&parse_info), tok->type != CSortTokenEnd)) {
+        // a streamed file has no source to keep the text of
+        if ((tok->type == CSortTokenImport || tok->type == CSortTokenFrom) && SV_len(entity->source)) {
+            _push_statement_text(entity, &parse_info, parse_info.next - 1);
+        }
 
-    while (tok = _update_token(&parse_info), tok->type != CSortTokenEnd) {
         if (tok->type == CSortTokenImport) {
-            bool is_already_kept;
-            CSortModuleObjNode* _import = _parse_import_statement_with_duplicate_check(entity, &parse_info, &is_already_kept);
-            if (! is_already_kept) {
-                CSortEntity_append_module(entity, _import, parse_info.line_counter);
-            }
+            _parse_import_statement_with_duplicate_check(entity, &parse_info);
         } else if (tok->type == CSortTokenFrom) {
             tok = _update_token(&parse_info);
 
             if (tok->type != CSortTokenIdentifier) {
-                CSortEntity_report_unexpected_errs(entity, tok, "module");
-                CSort_panic_tok(entity->csort, tok, "Expected module got '%.*s'", SV_len(tok->tok_view), SV_data(tok->tok_view));
+                CSortEntity_error_unexpected(entity, lexer, tok, "module");
             } else {
-                bool is_already_kept = false;
-                CSortModuleObjNode* _from_import;
-                if (csort->conf.squash_for_duplicate_library) {
-                    _from_import = CSortEntity_find_module(entity, &tok->tok_view);
-                    if (! _from_import) {
-                        _from_import = CSortModuleObjNode_mk(entity, &tok->tok_view, NULL, CSortModuleKind_FROM);
-                        is_already_kept = false;
-                    } else is_already_kept = true;
-                } else {
-                    _from_import = CSortModuleObjNode_mk(entity, &tok->tok_view, NULL, CSortModuleKind_FROM);
+                const String_View name = CSortLexer_text(lexer, *tok);
+                u32 _from_import = CSortModule_none;
+                if (entity->conf->squash_for_duplicate_library) {
+                    _from_import = CSortEntity_find_module(entity, &name);
+                    if (_from_import != CSortModule_none) {
+                        CSortStats_count(duplicates_squashed, 1);
+                    }
+                }
+                if (_from_import == CSortModule_none) {
+                    const String_View title = CSortEntity_keep_name(entity, name);
+                    _from_import = CSortModuleTable_add(entity->modules, CSortModuleKind_FROM, title, CSortLexer_line(lexer, *tok));
                 }
 
                 tok = _update_token(&parse_info);
                 if (tok->type != CSortTokenImport) {
-                    CSort_panic_tok(entity->csort, tok, "Expected import statement got '%.*s'", SV_len(tok->tok_view), SV_data(tok->tok_view));
-                }
-
-                _parse_import_after_from(entity, &parse_info, _from_import);
-                if (! is_already_kept) {
-                    CSortEntity_append_module(entity, _from_import, parse_info.line_counter);
-                }
+                    CSortEntity_error_unexpected(entity, lexer, tok, "import statement");
+                } else _parse_import_after_from(entity, &parse_info, _from_import);
             }
         }
     }
+    CSortStats_end();
+    CSortLexer_drop_statements(lexer);
+}
+
+
+internal inline void
+_sort_chunk(CSortEntity* entity, CSortLexer* lexer, char* chunk, u32 chunk_len) {
+    CSortStats_begin(CSortPhase_Tokenize);
+    CSortLexer_feed(lexer, SV_buff(chunk, chunk_len));
+    CSortStats_end();
+    CSortEntity_parse_statements(entity, lexer);
+}
+
+internal void
+_sort_finish(CSortEntity* entity, CSortLexer* lexer) {
+    CSortLexer_finish(lexer);
+    CSortEntity_parse_statements(entity, lexer);
+    CSortModuleTable_finalize(entity->modules);
+}
+
+void
+CSortEntity_sort(CSortEntity* entity) {
+    CSortLexer lexer = CSortLexer_mk(&entity->worker->arena, &entity->worker->tokens);
+    char* source_end = SV_end(entity->source);
+
+    CSortTrace_begin("parse", NULL);
+    for (char* chunk = SV_begin(entity->source); chunk != source_end && entity->status == CSortStatus_Ok; ) {
+        const u32 chunk_len = (source_end - chunk < CSortLexer_chunk_size) ? source_end - chunk : CSortLexer_chunk_size;
+        _sort_chunk(entity, &lexer, chunk, chunk_len);
+        chunk += chunk_len;
+    }
+    _sort_finish(entity, &lexer);
+    CSortTrace_end();
+}
+
+
+// Sorts the file open as #fd without ever holding all of it, for an #entity made without
+// a source. It's read a chunk at a time into #CSortWorker::source, into either half in
+// turn, so the chunk before stays valid for the lexer, and the names the modules keep are
+// copied into the arena as they're parsed. The halves are a byte apart, so no chunk
+// continues the one before and the lexer moves what's left of it out before the next read.
+void
+CSortEntity_sort_fd(CSortEntity* entity, int fd) {
+    CSortWorker* worker = entity->worker;
+    String* buffer = &worker->source;
+    string_clear(buffer);
+    string_reserve(buffer, 2 * CSortLexer_chunk_size + 1);
+    CSortLexer lexer = CSortLexer_mk(&worker->arena, &worker->tokens);
+
+    CSortTrace_begin("parse", NULL);
+    u32 half = 0;
+    while (entity->status == CSortStatus_Ok) {
+        char* chunk = buffer->data + half * (CSortLexer_chunk_size + 1);
+        CSortStats_begin(CSortPhase_Read);
+        const ssize_t n = read(fd, chunk, CSortLexer_chunk_size);
+        CSortStats_end();
+        if (n < 0 && errno == EINTR) {
+            continue;
+        }
+        if (n < 0) {
+            snprintf(worker->error, CSort_error_len, "error: could not read: %s: %s", entity->file_to_sort, strerror(errno));
+            entity->status = CSortStatus_IOError;
+        }
+        if (n <= 0) {
+            break;
+        }
+        _sort_chunk(entity, &lexer, chunk, n);
+        half ^= 1;
+    }
+    _sort_finish(entity, &lexer);
+    CSortTrace_end();
 }
 
 
@@ -737,43 +1887,39 @@ CSortEntity_sort(CSortEntity* entity) {
 //
 // --------------------------------------------------------------------------------------------
 
-#define get_imports_start_line(X) ((X)->modules->line_in_file - 1)
-#define _buffer_whitespace(X, Y) fprintf((X), "%*c", (Y), ' ')
-#define _buffer_newline(X, Y) (fputs("\n", (X)), _buffer_whitespace(X, Y))
+#define get_imports_start_line(X) (*(u32*) DynArray_get(&(X)->modules->lines, 0) - 1)
+#define _buffer_whitespace(X, Y) string_appendf((X), "%*c", (Y), ' ')
+#define _buffer_newline(X, Y) (string_append((X), "\n", 1), _buffer_whitespace(X, Y))
+
+#define _print_name(X, FMT, Y) string_appendf((X), (FMT), SV_len(Y), SV_data(Y))
 
 internal void
-nowrap_imports(FILE* fp, CSortModuleObjNode* module) {
-    CSortMemArenaNode** str_node;
-    for (u32 i = 0; i < module->imports.len - 1; ++i) {
-        str_node = (CSortMemArenaNode**) DynArray_get(&module->imports, i);
-        fprintf(fp, "%s, ", (char*) (*str_node)->mem);
+nowrap_imports(String* out, const String_View* imports, u32 imports_len) {
+    for (u32 i = 0; i < imports_len - 1; ++i) {
+        _print_name(out, "%.*s, ", imports[i]);
     }
 
-    str_node = (CSortMemArenaNode**) DynArray_get(&module->imports, module->imports.len - 1);
-    fprintf(fp, "%s", (char*) (*str_node)->mem);
-    fputc('\n', fp);
+    _print_name(out, "%.*s", imports[imports_len - 1]);
+    string_append(out, "\n", 1);
     return;
 }
 
 
 internal void
-wrap_imports(FILE* fp, const CSortConfig* conf, CSortModuleObjNode* m, const u32* import_offset) {
+wrap_imports(String* out, const CSortConfig* conf, const String_View* imports, u32 imports_len, const u32* import_offset) {
     u32 count = 0;
-    CSortMemArenaNode** str_node;
 
-    fputc('(', fp);
+    string_append(out, "(", 1);
     for (; count < conf->wrap_after_n_imports; ++count) {
-        str_node = (CSortMemArenaNode**) DynArray_get(&m->imports, count);
-        fprintf(fp, "%s, ", (char*) (*str_node)->mem);
+        _print_name(out, "%.*s, ", imports[count]);
     }
 
-    u32 remaining = m->imports.len - count;
+    u32 remaining = imports_len - count;
     assert(conf->import_on_each_wrap != 0);
     while (remaining > conf->import_on_each_wrap) {
-        _buffer_newline(fp, *import_offset);
+        _buffer_newline(out, *import_offset);
         FOR (i, conf->import_on_each_wrap) {
-            str_node = (CSortMemArenaNode**) DynArray_get(&m->imports, count + i);
-            fprintf(fp, "%s, ", (char*) (*str_node)->mem);
+            _print_name(out, "%.*s, ", imports[count + i]);
         }
 
         remaining -= conf->import_on_each_wrap;
@@ -781,49 +1927,102 @@ wrap_imports(FILE* fp, const CSortConfig* conf, CSortModuleObjNode* m, const u32
     }
 
     // print remaining imports which weren't wrapped
-    _buffer_newline(fp, *import_offset);
-    for (; count < m->imports.len - 1; ++count) {
-        str_node = (CSortMemArenaNode**) DynArray_get(&m->imports, count);
-        fprintf(fp, "%s, ", (char*) (*str_node)->mem);
+    _buffer_newline(out, *import_offset);
+    for (; count < imports_len - 1; ++count) {
+        _print_name(out, "%.*s, ", imports[count]);
     }
-    str_node = (CSortMemArenaNode**) DynArray_get(&m->imports, m->imports.len - 1);
-    fprintf(fp, "%s)", (char*) (*str_node)->mem);
-    fputc('\n', fp);
+    _print_name(out, "%.*s)", imports[imports_len - 1]);
+    string_append(out, "\n", 1);
 }
 
 
-// prints processed/formatted imports
+// appends the sorted and formatted imports of #entity to #out
 void
-CSortEntity_do(CSortEntity* entity) {
-    CSortEntity_sort(entity);
-    CSort* csort = entity->csort;
-    FILE* output_file = stdout;
-    if (csort->conf.cmd_options.show_after_sort) {
-        output_file = stdout;
-    } else {
-        return;
+CSortEntity_emit(CSortEntity* entity, String* out) {
+    CSortModuleTable* table = entity->modules;
+    CSortTrace_begin("sort", NULL);
+    FOR (i, table->len) {
+        _sort_imports(entity, i);
     }
+    const u32* module_order = _module_order(entity);
+    CSortTrace_end();
 
-    const CSortConfig* conf = &csort->conf;
-    CSortMemArenaNode** str_node;
+    CSortStats_begin(CSortPhase_Emit);
+    CSortTrace_begin("emit", NULL);
+    const CSortConfig* conf = entity->conf;
 
-    for (CSortModuleObjNode* ptr = entity->modules, * module = ptr; ptr; module = ptr) {
-        ptr = ptr->next;
+    FOR (n, table->len) {
+        const u32 i = module_order ? module_order[n] : n;
         u32 import_offset = -3;                // Get offset little bit where the import keywords start!
-
-        if (module->module_kind == CSortModuleKind_FROM) {
-            import_offset += fprintf(output_file, "from %s import ", (char*) module->title->mem);
-        } else if (module->module_kind == CSortModuleKind_IMPORT) {
-            import_offset += fprintf(output_file, "import ");
+        const enum CSortModuleKind kind = CSortModuleTable_kind(table, i);
+        const String_View* imports = CSortModuleTable_imports(table, i);
+        const u32 imports_len = CSortModuleTable_imports_len(table, i);
+
+        if (kind == CSortModuleKind_FROM) {
+            import_offset += _print_name(out, "from %.*s import ", CSortModuleTable_title(table, i));
+        } else if (kind == CSortModuleKind_IMPORT) {
+            import_offset += string_appendf(out, "import ");
         }
 
-        _sort_imports(module);
         if (! conf->disable_wrapping) {
-            if (conf->wrap_after_n_imports && module->imports.len > conf->wrap_after_n_imports) {
-                wrap_imports(output_file, conf, module, &import_offset);
-            } else nowrap_imports(output_file, module);
+            if (conf->wrap_after_n_imports && imports_len > conf->wrap_after_n_imports) {
+                wrap_imports(out, conf, imports, imports_len, &import_offset);
+            } else nowrap_imports(out, imports, imports_len);
         } else {
-            nowrap_imports(output_file, module);
+            nowrap_imports(out, imports, imports_len);
+        }
+    }
+    CSortTrace_end();
+    CSortStats_end();
+}
+
+
+// true if the import statements of #entity, as written, are already #sorted
+bool
+CSortEntity_is_sorted(const CSortEntity* entity, const String* sorted) {
+    const String_View* texts = (const String_View*) DynArray_data(&entity->worker->statements);
+    u32 offset = 0;
+    FOR (i, entity->worker->statements.len) {
+        if (offset + SV_len(texts[i]) > sorted->len ||
+            memcmp(sorted->data + offset, SV_data(texts[i]), SV_len(texts[i])) != 0) {
+            return false;
         }
+        offset += SV_len(texts[i]);
+    }
+    return offset == sorted->len;
+}
+
+
+// Sorts #len bytes at #data into #CSortWorker::output, if #is_sorted isn't NULL it's
+// set to whether the imports were sorted already. Used by whoever has their own workers.
+enum CSortStatus
+CSortWorker_sort(CSortWorker* worker, CSort* csort, const char* name, char* data, u32 len, bool* is_sorted) {
+    CSortEntity entity = CSortEntity_mk_w_buffer(csort, worker, name, data, len);
+    CSortEntity_sort(&entity);
+    const enum CSortStatus status = entity.status;
+    if (status == CSortStatus_Ok) {
+        CSortEntity_emit(&entity, &worker->output);
+        if (is_sorted) *is_sorted = CSortEntity_is_sorted(&entity, &worker->output);
+    }
+    CSortEntity_deinit(&entity);
+    return status;
+}
+
+
+// parses #entity, or the file open as #fd when it's streamed (#fd >= 0), and, with `--show`,
+// formats its imports into #CSortWorker::output
+enum CSortStatus
+CSortEntity_do(CSortEntity* entity, int fd) {
+    if (fd >= 0) {
+        CSortEntity_sort_fd(entity, fd);
+    } else CSortEntity_sort(entity);
+    if (entity->status != CSortStatus_Ok) {
+        return entity->status;
+    }
+
+    CSortStats_count(files_processed, 1);
+    if (entity->csort->conf.cmd_options.show_after_sort) {
+        CSortEntity_emit(entity, &entity->worker->output);
     }
+    return CSortStatus_Ok;
 }
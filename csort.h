@@ -3,6 +3,8 @@
 
 #include "core.h"
 #include "config.h"
+#include "stats.h"
+#include "trace.h"
 
 #include "external/lua/lua.h"
 #include "external/lua/lualib.h"
@@ -20,7 +22,7 @@
 typedef struct CSortOptObj CSortOptObj;
 struct CSortOptObj {
     char* short_flag, *long_flag, *about;
-    char* Str;
+    char** Str;
     u64* Int;
     bool* Bool;
 };
@@ -30,7 +32,7 @@ struct CSortOptObj {
 #define declare_CSortOpt()\
 extern CSortOptObj CSortOptInt(CSort* csort, u64* data_ptr, const char* long_flag, const char* short_flag, const char* about);\
 extern CSortOptObj CSortOptBool(CSort* csort, bool* data_ptr, const char* long_flag, const char* short_flag, const char* about);\
-extern CSortOptObj CSortOptStr(CSort* csort, char* data_ptr, const char* long_flag, const char* short_flag, const char* about)\
+extern CSortOptObj CSortOptStr(CSort* csort, char** data_ptr, const char* long_flag, const char* short_flag, const char* about)\
 
 #define typedef_CSortOpt(dataType, T)                                                                            \
 CSortOptObj                                                                                                      \
@@ -47,7 +49,7 @@ CSortOpt##T(CSort* csort, dataType* data_ptr, const char* long_flag, const char*
 }
 
 void CSortOptParse_show_usage(FILE* output_stream, const CSortOptObj* options, u32 options_len);
-void CSortOptParse(int argc, char* argv[], CSortOptObj* options, u32 options_len, const char* prepend_error_msg);
+void CSortOptParse(int argc, char* argv[], CSortOptObj* options, u32 options_len, const char* prepend_error_msg, DynArray* positional);
 
 
 
@@ -64,58 +66,184 @@ enum CSortModuleKind {
 
 
 // --------------------------------------------------------------------------------------------
-typedef struct CSortModuleObjNode CSortModuleObjNode;
-struct CSortModuleObjNode {
-    CSortMemArenaNode*   title;                         // In case of import via from
-    CSortMemArenaNode*   written_as;
+// Modules of a file, as parallel arrays indexed by module id (in the order they were first seen).
+//
+// While parsing, imports are appended to #pending as (module id, name) pairs,
+// #CSortModuleTable_finalize then groups them by module into #imports so that
+// module `i` owns imports[imports_offset[i] .. imports_offset[i] + imports_len[i]).
+typedef struct CSortPendingImport CSortPendingImport;
+struct CSortPendingImport {
+    u32 module;
+    String_View name;
+};
+
+typedef struct CSortModuleTable CSortModuleTable;
+struct CSortModuleTable {
+    DynArray kinds;                                     // u8, enum CSortModuleKind
+    DynArray titles;                                    // String_View, empty for `import x`
+    DynArray lines;                                     // u32, line the module was first seen on
+    DynArray imports_offset;                            // u32
+    DynArray imports_len;                               // u32
+
+    DynArray imports;                                   // String_View, grouped by module
+    DynArray pending;                                   // CSortPendingImport, in parse order
+    u32 len;
+};
+
+extern CSortModuleTable CSortModuleTable_mk(void);
+extern void CSortModuleTable_reset(CSortModuleTable* table);
+extern void CSortModuleTable_free(CSortModuleTable* table);
+extern u32 CSortModuleTable_add(CSortModuleTable* table, enum CSortModuleKind kind, String_View title, u32 line_in_file);
+extern void CSortModuleTable_push_import(CSortModuleTable* table, u32 module, String_View name);
+extern void CSortModuleTable_finalize(CSortModuleTable* table);
+
+#define CSortModuleTable_kind(T, I) ((enum CSortModuleKind) *(u8*) DynArray_get(&(T)->kinds, (I)))
+#define CSortModuleTable_title(T, I) (*(String_View*) DynArray_get(&(T)->titles, (I)))
+#define CSortModuleTable_imports(T, I) ((String_View*) DynArray_get(&(T)->imports, *(u32*) DynArray_get(&(T)->imports_offset, (I))))
+#define CSortModuleTable_imports_len(T, I) (*(u32*) DynArray_get(&(T)->imports_len, (I)))
 
-    DynArray             imports;
-    enum CSortModuleKind module_kind;
-    
-    CSortModuleObjNode*  prev;
-    CSortModuleObjNode*  next;
-    u32 line_in_file;
+int _compare_names(const String_View* n1, const String_View* n2);
+
+
+
+// --------------------------------------------------------------------------------------------
+// Errors which don't end the process, #CSortWorker::error says what happened
+enum CSortStatus {
+    CSortStatus_Ok = 0,
+    CSortStatus_ParseError,
+    CSortStatus_ConfigError,
+    CSortStatus_IOError,
+    CSortStatus_BufferTooSmall,
+    CSortStatus_InvalidArgument,
 };
 
-int _compare_cstr_nodes(const CSortMemArenaNode** n1, const CSortMemArenaNode** n2);
+#define CSort_error_len 256
+
+// --------------------------------------------------------------------------------------------
+// Scratch memory of whoever is sorting a file, reset after every file instead
+// of freed, so a directory run is bounded by its largest file, not by the tree.
+typedef struct CSortWorker CSortWorker;
+struct CSortWorker {
+    CSortMemArena arena;
+    CSortModuleTable modules;
+    DynArray tokens;                                    // CSortToken, statements not parsed yet
+    DynArray statements;                                // String_View, source text of each import statement
+    String source;                                      // file being sorted, when read from disk, or two chunks of it
+    String output;                                      // sorted imports
+    char error[CSort_error_len];                        // message of the last failed file
+};
+
+extern CSortWorker CSortWorker_mk(void);
+extern void CSortWorker_reset(CSortWorker* worker);
+extern void CSortWorker_free(CSortWorker* worker);
+extern enum CSortStatus CSortWorker_read_file(CSortWorker* worker, const char* path);
+
+
+// --------------------------------------------------------------------------------------------
+// Files and directories a run has been through, by device and inode, so overlapping roots
+// and links to the same place are sorted once. Open addressing, inode 0 marks a free slot.
+typedef struct CSortInodeSet CSortInodeSet;
+struct CSortInodeSet {
+    u64* keys;                                          // device, inode pairs, NULL until #CSortInodeSet_init
+    u32 len, cap;                                       // in pairs, #cap a power of two
+};
+
+extern void CSortInodeSet_init(CSortInodeSet* set);
+extern void CSortInodeSet_free(CSortInodeSet* set);
+extern bool CSortInodeSet_add(CSortInodeSet* set, u64 dev, u64 ino);
+
+
+// --------------------------------------------------------------------------------------------
+// ~Config tree
+//
+// A file is sorted with the config of the nearest .csortconfig above it, loaded on top of
+// the one of the directory above that, up to the config of the run, or up to the built-in
+// defaults for what isn't below the run's .csortconfig. Every directory is
+// resolved once: walks hand theirs down to what's below, other paths are looked up by their
+// directory. Directories without a .csortconfig share their parent's.
+typedef struct CSortDirConfig CSortDirConfig;
+struct CSortDirConfig {
+    char* dir;                                          // NULL for a free slot
+    u32 dir_len;
+    const CSortConfig* conf;
+};
 
+typedef struct CSortConfigTree CSortConfigTree;
+struct CSortConfigTree {
+    CSortDirConfig* slots;                              // open addressing by #CSortPathHash of #dir
+    u32 len, cap;                                       // #cap a power of two
+    DynArray owned;                                     // CSortConfig*, one per .csortconfig loaded
+    char* root_dir;                                     // absolute, where the run's .csortconfig is, NULL if every file gets #CSort::conf
+    const CSortConfig* defaults;                        // the built-in ones, what's outside #root_dir starts from
+    u64 root_dev, root_ino;                             // the run's .csortconfig, 0 without one
+    bool pin_squash, pin_wrapping, pin_wrap_after;      // given on the command line, win over the files
+};
 
 
 // --------------------------------------------------------------------------------------------
 typedef struct CSort CSort;
 struct CSort {
-    CSortMemArena arena;
-    CSortConfig conf;
+    CSortMemArena arena;                                // lives as long as the run
+    CSortConfig conf;                                   // of the run, from the nearest .csortconfig above the current directory
+    CSortConfigTree configs;                            // of the directories below, on top of #conf
+    CSortWorker worker;
+    CSortInodeSet seen;                                 // only kept with more than one root
+    char error[CSort_error_len];                        // why loading the config failed
+    void (*on_panic)(CSort* csort);                     // stops whatever still reads the run before it's freed
 };
 
 CSort CSort_mk();
 extern inline void CSort_init_config(CSort* csort, const char* lua_config);
+extern int CSort_try_init_config(CSort* csort, const char* lua_config);
 extern inline void CSort_deinit(CSort* csort);
 extern inline void CSort_panic(CSort* csort, const char* msg, ...);
-extern void CSort_load_config(CSort* csort);
+extern int CSort_load_config(CSort* csort);
+extern int CSort_load_config_over(CSort* csort, CSortConfig* conf, const CSortConfig* parent);
+
+extern int CSort_find_config(char* path, u32 size);
+extern void CSort_init_config_tree(CSort* csort, const char* lua_config, const CSortConfig* from_file);
+extern const CSortConfig* CSort_config_for_file(CSort* csort, const char* path, u32 len);
+extern void CSortConfigTree_free(CSortConfigTree* tree);
 
 
 // --------------------------------------------------------------------------------------------
 typedef struct CSortEntity CSortEntity;
 struct CSortEntity {
     CSort* csort;
-    FILE* input_file;
+    const CSortConfig* conf;                            // #CSort::conf unless the file's directory has its own
+    CSortWorker* worker;
     const char* file_to_sort;
+    String_View source;                                 // the whole file, names in #modules are views into it, empty when streamed
+    enum CSortStatus status;
 
-    CSortModuleObjNode* modules_curr_node, * modules;
+    CSortModuleTable* modules;                          // #worker's, valid until #CSortEntity_deinit
 };
 
 extern inline CSortEntity CSortEntity_mk(CSort* csort, const char* file_to_sort);
-extern void CSortEntity_do(CSortEntity* entity);
+extern CSortEntity CSortEntity_mk_w_buffer(CSort* csort, CSortWorker* worker, const char* name, char* data, u32 len);
+extern enum CSortStatus CSortEntity_do(CSortEntity* entity, int fd);
+extern void CSortEntity_sort(CSortEntity* entity);
+extern void CSortEntity_sort_fd(CSortEntity* entity, int fd);
+extern void CSortEntity_emit(CSortEntity* entity, String* out);
+extern bool CSortEntity_is_sorted(const CSortEntity* entity, const String* sorted);
 extern void CSortEntity_free(CSortEntity* entity);
 extern void CSortEntity_deinit(CSortEntity* entity);
+extern enum CSortStatus CSortWorker_sort(CSortWorker* worker, CSort* csort, const char* name, char* data, u32 len, bool* is_sorted);
 
 
 // --------------------------------------------------------------------------------------------
 int CSortGetExtension(const String_View sv, String_View* ext);
 int append_path(const char* path, const char* to_add, char* newpath, u32 len);
-int CSortPerformOnFileCallback(CSort* csort, const char* input_path, void (callback)(CSort* csort, const char* file_path));
-int CSortPerformOnFileCallbackRecur(CSort* csort, const char* input_path, void (callback)(CSort* csort, const char* input_filepath));
+int CSortPerformOnFileCallback(CSort* csort, const char* input_path, void (callback)(CSort* csort, const char* file_path, const CSortConfig* conf));
+int CSortPerformOnFileCallbackRecur(CSort* csort, const char* input_path, void (callback)(CSort* csort, const char* input_filepath, const CSortConfig* conf));
+
+int CSortPerformOnFilesFrom(CSort* csort, FILE* fp, void (callback)(CSort* csort, const char* file_path, const CSortConfig* conf));
+
+#define CSortPathHash_basis 0xcbf29ce484222325ull
+u64 CSortPathHash_feed(u64 hash, const char* data, u32 len);
+bool CSort_in_shard(const CSort* csort, u64 path_hash);
+int CSort_parse_shard(CSort* csort, const char* shard);
+int CSort_parse_max_memory(CSort* csort, const char* size);
 
 // Declare CSortOpt functions defined by @macro(typedef_CSortOpt)
 declare_CSortOpt();
@@ -134,42 +262,103 @@ enum CSortTokenType {
     CSortTokenSpace,
     CSortTokenIdentifier,
     CSortTokenString,
-    CSortTokenNewline,
-    CSortTokenStart,
+    CSortTokenNewline,                                  // end of a statement
     CSortTokenEnd,
-    CSortTokenComment,
+    CSortTokenLParen,
+    CSortTokenRParen,
 };
 
+// Where the token's text is in the lexer's input, see #CSortLexer_text, eight to a cache
+// line so the parser walks the import header without pulling in the source around it.
+// Lines and columns are counted back from the offset only when they're asked for.
 typedef struct CSortToken CSortToken;
 struct CSortToken {
-    String_View tok_view;
-    enum CSortTokenType type;
-
-    u32 next_tok_offset;
-    u32 line_num;
-    u32 col_offset;
+    u32 at;                                             // offset in #CSortLexer::base, or #spill
+    u32 len : 24;
+    u32 type : 7;                                       // enum CSortTokenType
+    u32 spilled : 1;
 };
 
+#define CSortToken_max_len ((1u << 24) - 1)
+
 internal inline CSortToken
-CSortToken_mk(const String_View tok_view, enum CSortTokenType type, u32 next_tok_offset, u32 line_num, u32 col_offset) {
+CSortToken_mk(u32 at, u32 len, enum CSortTokenType type, bool spilled) {
     return (CSortToken) {
-        .tok_view = tok_view,
+        .at = at,
+        .len = len,
         .type = type,
-        .next_tok_offset = next_tok_offset,
-        .line_num = line_num,
-        .col_offset = col_offset,
+        .spilled = spilled,
     };
 }
 
-internal inline CSortToken
-CSortToken_mk_initial() {
-    return (CSortToken) {
-        .tok_view = {0},
-        .type = CSortTokenStart,
-        .next_tok_offset = 0,
-        .line_num = 0,
-        .col_offset = 0,
-    };
+
+
+// --------------------------------------------------------------------------------------------
+// ~Lexer
+//
+// Resumable, #CSortLexer_feed takes the input in chunks of any size and carries what
+// it was in the middle of (a string, a comment, open brackets, a name) over to the
+// next chunk. A newline only ends a statement outside of brackets and when it isn't
+// escaped by a backslash, so wrapped `from x import (a,\n b)` is one statement.
+//
+// Tokens are offsets into #base, the chunks fed since the last one that didn't start
+// right where the one before it ended, so a buffer fed in slices is never copied. A chunk
+// must stay valid until the next call, when one doesn't continue #base, the text of the
+// tokens still in #tokens and of a name cut by the last chunk is moved to #spill, which
+// grows in #arena. Tokens moved there take the position of the chunk that moved them.
+//
+// A name too long for a token is cut and typed as a string, which the parser won't take.
+#define CSortLexer_chunk_size (64 * 1024)
+#define CSortLexer_spill_size 1024
+
+enum CSortLexState {
+    CSortLex_Blank,
+    CSortLex_Name,
+    CSortLex_Comment,
+    CSortLex_Backslash,
+    CSortLex_Quote1,                                    // one quote, a string or the start of `"""`
+    CSortLex_Quote2,                                    // two quotes, empty string or the start of `"""`
+    CSortLex_String,
+    CSortLex_StringEscape,
+    CSortLex_Triple,
+    CSortLex_TripleQuote1,
+    CSortLex_TripleQuote2,
+    CSortLex_TripleEscape,
+};
+
+typedef struct CSortLexer CSortLexer;
+struct CSortLexer {
+    enum CSortLexState state;
+    char quote;
+    u32  bracket_depth;
+    u32  line, col;
+
+    u32  carry;                                         // start of the name the last chunk ended in
+    bool carry_spilled;                                 // #carry is in #spill, which it ends, else in #base
+    u32  name_col;
+
+    char* base;
+    u32  base_len;
+    u32  base_line, base_col;                           // where #base starts in the input
+    char* spill;
+    u32  spill_len, spill_cap;
+    u32  line_seen, line_seen_at;                       // #CSortLexer_line's cursor, in #base
+
+    CSortMemArena* arena;
+    DynArray* tokens;                                   // CSortToken
+    u32 stmt_end;                                       // tokens before it form whole statements
+};
+
+extern CSortLexer CSortLexer_mk(CSortMemArena* arena, DynArray* tokens);
+extern void CSortLexer_feed(CSortLexer* lexer, String_View chunk);
+extern void CSortLexer_finish(CSortLexer* lexer);
+extern void CSortLexer_drop_statements(CSortLexer* lexer);
+extern void CSortLexer_position(const CSortLexer* lexer, CSortToken tok, u32* line, u32* col);
+extern u32 CSortLexer_line(CSortLexer* lexer, CSortToken tok);
+
+internal inline String_View
+CSortLexer_text(const CSortLexer* lexer, CSortToken tok) {
+    return SV_buff((tok.spilled ? lexer->spill : lexer->base) + tok.at, tok.len);
 }
 
 
@@ -177,23 +366,25 @@ CSortToken_mk_initial() {
 // --------------------------------------------------------------------------------------------
 typedef struct _ParseInfo _ParseInfo;
 struct _ParseInfo {
-    CSortEntity*         entity;
-    CSortToken*    tok;
-    enum CSortTokenType prev_tok_type;
-    char           buf[512];
-    String_View    buf_view;
-    u32            line_counter;
+    CSortEntity*      entity;
+    CSortLexer*       lexer;
+    const CSortToken* tokens;
+    u32               tokens_len;
+    u32               next;
+    CSortToken        end_tok;
 };
 
 
+// parses the whole statements #lexer has, tokens past them are left for the next chunk
 internal inline _ParseInfo
-_ParseInfo_mk(CSortEntity* entity, CSortToken* tok) {
+_ParseInfo_mk(CSortEntity* entity, CSortLexer* lexer) {
     _ParseInfo p = {0};
     p.entity = entity;
-    p.prev_tok_type = CSortTokenStart;
-    p.tok = tok;
-    p.buf_view = SV_buff(p.buf, 0);
-    p.line_counter = 0;
+    p.lexer = lexer;
+    p.tokens = (const CSortToken*) DynArray_data(lexer->tokens);
+    p.tokens_len = lexer->stmt_end;
+    p.next = 0;
+    p.end_tok = CSortToken_mk(lexer->base_len, 0, CSortTokenEnd, false);
     return p;
 }
 
@@ -0,0 +1,281 @@
+#include "csortlib.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+typedef struct CSortBatchWorker CSortBatchWorker;
+struct CSortBatchWorker {
+    CSortWorker worker;
+    i64 held;                                           // bytes #worker keeps between items
+};
+
+struct CSortCtx {
+    CSort csort;
+    DynArray batch_workers;                             // CSortBatchWorker*, kept across batches
+};
+
+
+// --------------------------------------------------------------------------------------------
+// loads #lua_config, or the built-in defaults when NULL, on failure NULL and why in #error
+CSortCtx*
+csort_ctx_new(const char* lua_config, enum CSortStatus* status, char* error) {
+    CSortCtx* ctx = (CSortCtx*) DEV_malloc(1, sizeof(CSortCtx));
+    ctx->csort = CSort_mk();
+    ctx->batch_workers = DynArray_mk(sizeof(CSortBatchWorker*));
+    if (error) error[0] = '\0';
+    if (CSort_try_init_config(&ctx->csort, lua_config) < 0) {
+        if (status) *status = CSortStatus_ConfigError;
+        if (error) memcpy(error, ctx->csort.error, CSort_error_len);
+        csort_ctx_free(ctx);
+        return NULL;
+    }
+
+    if (status) *status = CSortStatus_Ok;
+    return ctx;
+}
+
+void
+csort_ctx_free(CSortCtx* ctx) {
+    if (! ctx) {
+        return;
+    }
+    FOR (i, ctx->batch_workers.len) {
+        CSortBatchWorker* bw = *(CSortBatchWorker**) DynArray_get(&ctx->batch_workers, i);
+        CSortWorker_free(&bw->worker);
+        free(bw);
+    }
+    DynArray_free(&ctx->batch_workers);
+    CSort_deinit(&ctx->csort);
+    free(ctx);
+}
+
+const char*
+csort_ctx_error(const CSortCtx* ctx) {
+    return ctx->csort.worker.error[0] ? ctx->csort.worker.error : ctx->csort.error;
+}
+
+const char*
+csort_status_str(enum CSortStatus status) {
+    switch (status) {
+        case CSortStatus_Ok:              return "ok";
+        case CSortStatus_ParseError:      return "parse error";
+        case CSortStatus_ConfigError:     return "config error";
+        case CSortStatus_IOError:         return "io error";
+        case CSortStatus_BufferTooSmall:  return "buffer too small";
+        case CSortStatus_InvalidArgument: return "invalid argument";
+    }
+    return "unknown";
+}
+
+
+// --------------------------------------------------------------------------------------------
+int
+csort_sort_buffer(CSortCtx* ctx, const char* in, size_t in_len, char** out, size_t* out_len, enum CSortStatus* status) {
+#define _return_status(X) do { if (status) *status = (X); return ((X) == CSortStatus_Ok) ? 0 : -1; } while (0)
+    if (! ctx || (! in && in_len) || in_len > UINT32_MAX || ! out || ! out_len) {
+        _return_status(CSortStatus_InvalidArgument);
+    }
+
+    CSortWorker* worker = &ctx->csort.worker;
+    const enum CSortStatus sorted = CSortWorker_sort(worker, &ctx->csort, "<buffer>", (char*) in, (u32) in_len, NULL);
+    if (sorted != CSortStatus_Ok) {
+        _return_status(sorted);
+    }
+
+    const String* result = &worker->output;
+    if (*out == NULL) {
+        *out = result->data;
+    } else if (*out_len < (size_t) result->len + 1) {
+        snprintf(worker->error, CSort_error_len, "output needs %u bytes, got %zu", result->len + 1, *out_len);
+        *out_len = result->len + 1;
+        _return_status(CSortStatus_BufferTooSmall);
+    } else {
+        memcpy(*out, result->data, result->len + 1);
+    }
+    *out_len = result->len;
+    _return_status(CSortStatus_Ok);
+#undef _return_status
+}
+
+// 1 if the imports of #in are sorted already, 0 if sorting would change them, -1 on errors
+int
+csort_check_buffer(CSortCtx* ctx, const char* in, size_t in_len, enum CSortStatus* status) {
+    enum CSortStatus checked = CSortStatus_InvalidArgument;
+    bool is_sorted = false;
+    if (ctx && (in || ! in_len) && in_len <= UINT32_MAX) {
+        checked = CSortWorker_sort(&ctx->csort.worker, &ctx->csort, "<buffer>", (char*) in, (u32) in_len, &is_sorted);
+    }
+
+    if (status) *status = checked;
+    return (checked != CSortStatus_Ok) ? -1 : is_sorted;
+}
+
+
+// --------------------------------------------------------------------------------------------
+// ~Batch
+//
+// Threads take items in order under #lock, which also guards the memory budget: #used is what
+// every worker holds plus the estimate of each item in flight, corrected to what the worker
+// really holds once the item is done. Held memory is measured as the change of the thread's
+// #csort_mem_stats around the item, so a worker can move between threads across batches.
+#define CSortBatch_bytes_per_input_byte 8
+
+typedef struct CSortBatchRun CSortBatchRun;
+struct CSortBatchRun {
+    CSortCtx* ctx;
+    CSortBatchItem* items;
+    size_t items_len;
+    size_t next;
+
+    i64 max_memory;                                     // 0 for no cap
+    i64 worker_cap;                                     // a worker holding more gives it back
+    i64 used;
+    u32 in_flight;
+    pthread_mutex_t lock;
+    pthread_cond_t budget;
+};
+
+typedef struct CSortBatchThread CSortBatchThread;
+struct CSortBatchThread {
+    pthread_t thread;
+    CSortBatchRun* run;
+    CSortBatchWorker* worker;
+};
+
+// scratch memory sorting #in_len bytes is expected to take
+internal i64
+_batch_estimate(size_t in_len) {
+    return (i64) in_len * CSortBatch_bytes_per_input_byte + CSortMemArena_chunk_size;
+}
+
+internal void
+_batch_sort_item(CSortCtx* ctx, CSortWorker* worker, CSortBatchItem* item) {
+    item->out = NULL;
+    item->out_len = 0;
+    item->error[0] = '\0';
+    if ((! item->in && item->in_len) || item->in_len > UINT32_MAX) {
+        item->status = CSortStatus_InvalidArgument;
+        snprintf(item->error, CSort_error_len, "invalid input buffer");
+        return;
+    }
+
+    item->status = CSortWorker_sort(worker, &ctx->csort, "<buffer>", (char*) item->in, (u32) item->in_len, NULL);
+    if (item->status != CSortStatus_Ok) {
+        memcpy(item->error, worker->error, CSort_error_len);
+        return;
+    }
+
+    // results aren't worker memory, they outlive the batch
+    item->out = malloc((size_t) worker->output.len + 1);
+    if (! item->out) {
+        item->status = CSortStatus_IOError;
+        snprintf(item->error, CSort_error_len, "out of memory");
+        return;
+    }
+    memcpy(item->out, worker->output.data, worker->output.len);
+    item->out[worker->output.len] = '\0';
+    item->out_len = worker->output.len;
+}
+
+internal void*
+_batch_thread(void* arg) {
+    CSortBatchThread* self = arg;
+    CSortBatchRun* run = self->run;
+    CSortBatchWorker* bw = self->worker;
+
+    pthread_mutex_lock(&run->lock);
+    while (run->next < run->items_len) {
+        CSortBatchItem* item = &run->items[run->next++];
+        const i64 estimate = _batch_estimate(item->in_len);
+        while (run->max_memory && run->in_flight && run->used + estimate > run->max_memory) {
+            pthread_cond_wait(&run->budget, &run->lock);
+        }
+        run->used += estimate;
+        run->in_flight += 1;
+        pthread_mutex_unlock(&run->lock);
+
+        const i64 live = csort_mem_stats.live;
+        _batch_sort_item(run->ctx, &bw->worker, item);
+        CSortWorker_reset(&bw->worker);
+        if (run->max_memory && bw->held + (csort_mem_stats.live - live) > run->worker_cap) {
+            CSortWorker_free(&bw->worker);
+            bw->worker = CSortWorker_mk();
+        }
+        const i64 held = bw->held + (csort_mem_stats.live - live);
+
+        pthread_mutex_lock(&run->lock);
+        run->used += held - bw->held - estimate;
+        run->in_flight -= 1;
+        bw->held = held;
+        pthread_cond_broadcast(&run->budget);
+    }
+    pthread_mutex_unlock(&run->lock);
+    return NULL;
+}
+
+long
+csort_sort_batch(CSortCtx* ctx, CSortBatchItem* items, size_t items_len, const CSortBatchOpts* opts, enum CSortStatus* status) {
+    if (! ctx || (! items && items_len)) {
+        if (status) *status = CSortStatus_InvalidArgument;
+        return -1;
+    }
+
+    const CSortBatchOpts defaults = {0};
+    if (! opts) opts = &defaults;
+    size_t jobs = opts->jobs ? opts->jobs : (size_t) sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs > items_len) jobs = items_len;
+    if (jobs < 1) jobs = 1;
+
+    CSortBatchRun run = {0};
+    run.ctx = ctx;
+    run.items = items;
+    run.items_len = items_len;
+    run.max_memory = (i64) opts->max_memory;
+    run.worker_cap = run.max_memory / (i64) jobs;
+    pthread_mutex_init(&run.lock, NULL);
+    pthread_cond_init(&run.budget, NULL);
+
+    CSortBatchThread* threads = (CSortBatchThread*) DEV_malloc(sizeof(CSortBatchThread), jobs);
+    while (ctx->batch_workers.len < jobs) {
+        const i64 live = csort_mem_stats.live;
+        CSortBatchWorker* bw = (CSortBatchWorker*) DEV_malloc(sizeof(CSortBatchWorker), 1);
+        bw->worker = CSortWorker_mk();
+        bw->held = csort_mem_stats.live - live;
+        DynArray_push(&ctx->batch_workers, &bw);
+    }
+    FOR (i, jobs) {
+        threads[i].run = &run;
+        threads[i].worker = *(CSortBatchWorker**) DynArray_get(&ctx->batch_workers, i);
+        run.used += threads[i].worker->held;
+    }
+
+    // the calling thread is the first job, fewer threads if we can't spawn them all
+    size_t spawned = 1;
+    while (spawned < jobs && pthread_create(&threads[spawned].thread, NULL, _batch_thread, &threads[spawned]) == 0) {
+        ++spawned;
+    }
+    _batch_thread(&threads[0]);
+    for (size_t i = 1; i < spawned; ++i) {
+        pthread_join(threads[i].thread, NULL);
+    }
+
+    free(threads);
+    pthread_cond_destroy(&run.budget);
+    pthread_mutex_destroy(&run.lock);
+
+    long failed = 0;
+    for (size_t i = 0; i < items_len; ++i) {
+        failed += (items[i].status != CSortStatus_Ok);
+    }
+    if (status) *status = CSortStatus_Ok;
+    return failed;
+}
+
+void
+csort_batch_free(CSortBatchItem* items, size_t items_len) {
+    for (size_t i = 0; i < items_len; ++i) {
+        free(items[i].out);
+        items[i].out = NULL;
+        items[i].out_len = 0;
+    }
+}
@@ -0,0 +1,73 @@
+#ifndef __CSORTLIB_H__
+#define __CSORTLIB_H__
+
+#include "csort.h"
+
+#include <stddef.h>
+
+// --------------------------------------------------------------------------------------------
+//
+// Embedding API, sorts the imports of Python sources held in memory
+//
+// A #CSortCtx holds a loaded config and the scratch memory of one worker, it can sort
+// any number of buffers but only from one thread at a time. Nothing here exits the
+// process or touches stdout, failures come back as a #CSortStatus and
+// #csort_ctx_error says what went wrong. A context that can't be made says it in the
+// #CSort_error_len bytes passed to #csort_ctx_new, when they aren't NULL.
+//
+// The output is what `csort FILE --show` prints: the sorted and formatted imports.
+//
+// --------------------------------------------------------------------------------------------
+typedef struct CSortCtx CSortCtx;
+
+extern CSortCtx* csort_ctx_new(const char* lua_config, enum CSortStatus* status, char* error);
+extern void csort_ctx_free(CSortCtx* ctx);
+extern const char* csort_ctx_error(const CSortCtx* ctx);
+extern const char* csort_status_str(enum CSortStatus status);
+
+// Sorts #in_len bytes at #in.
+//
+// With *#out NULL, *#out is set to memory owned by #ctx, valid until its next call. Otherwise
+// the result is copied to *#out, which holds *#out_len bytes. Either way *#out_len is
+// set to the length of the result, which is also NUL terminated. If it doesn't fit this
+// fails with #CSortStatus_BufferTooSmall and *#out_len is set to the size needed.
+extern int csort_sort_buffer(CSortCtx* ctx, const char* in, size_t in_len, char** out, size_t* out_len, enum CSortStatus* status);
+
+// 1 if the import statements of #in are written exactly as #csort_sort_buffer would
+// write them, 0 if sorting would change them, -1 on errors.
+extern int csort_check_buffer(CSortCtx* ctx, const char* in, size_t in_len, enum CSortStatus* status);
+
+
+// --------------------------------------------------------------------------------------------
+// ~Batch
+//
+// Sorts many buffers in one call on #CSortBatchOpts::jobs threads, each with a worker of its
+// own which #ctx keeps for the next batch. Results land in the items they came from.
+//
+// #CSortBatchOpts::max_memory caps what the workers hold, scratch memory kept between items
+// plus an estimate of the items being sorted. Threads wait for memory to be given back
+// before starting an item which wouldn't fit, an item larger than the cap is sorted alone.
+// The results handed back aren't counted.
+typedef struct CSortBatchItem CSortBatchItem;
+struct CSortBatchItem {
+    const char* in;                                     // set by the caller
+    size_t in_len;
+
+    char* out;                                          // NUL terminated, freed by #csort_batch_free
+    size_t out_len;
+    enum CSortStatus status;
+    char error[CSort_error_len];
+};
+
+typedef struct CSortBatchOpts CSortBatchOpts;
+struct CSortBatchOpts {
+    u32 jobs;                                           // 0 for a thread per cpu
+    size_t max_memory;                                  // bytes, 0 for no cap
+};
+
+// Number of items which failed, each says why in its #CSortBatchItem::status, or -1 when
+// the batch didn't run, with *#status saying why. #opts may be NULL for the defaults.
+extern long csort_sort_batch(CSortCtx* ctx, CSortBatchItem* items, size_t items_len, const CSortBatchOpts* opts, enum CSortStatus* status);
+extern void csort_batch_free(CSortBatchItem* items, size_t items_len);
+
+#endif
@@ -0,0 +1,437 @@
+#define _GNU_SOURCE
+#include "ignore.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+
+
+// --------------------------------------------------------------------------------------------
+//
+// Glob set
+//
+// --------------------------------------------------------------------------------------------
+CSortGlobSet
+CSortGlobSet_mk(void) {
+    CSortGlobSet set = {0};
+    set.steps = DynArray_mk(sizeof(CSortGlobStep));
+    set.classes = DynArray_mk(sizeof(u64) * 4);
+    set.patterns = DynArray_mk(sizeof(CSortGlobPattern));
+    set.starts = DynArray_mk(sizeof(u32));
+    return set;
+}
+
+void
+CSortGlobSet_free(CSortGlobSet* set) {
+    DynArray_free(&set->steps);
+    DynArray_free(&set->classes);
+    DynArray_free(&set->patterns);
+    DynArray_free(&set->starts);
+    set->words = 0;
+}
+
+internal void
+_glob_push(CSortGlobSet* set, enum CSortGlobOp op, u8 byte, u32 arg) {
+    const CSortGlobStep step = { .op = (u8) op, .byte = byte, .arg = arg };
+    DynArray_push(&set->steps, (void*) &step);
+}
+
+// parses the class starting after '[' at #p, NULL if it's never closed
+internal const char*
+_glob_class(const char* p, const char* end, u64 class[4]) {
+    DEV_memzero(class, sizeof(u64) * 4);
+    bool negate = false;
+    if (p < end && (*p == '!' || *p == '^')) {
+        negate = true;
+        ++p;
+    }
+
+    // a ']' right after the '[' is part of the class
+    for (bool first = true; p < end && (first || *p != ']'); first = false) {
+        u8 lo = (u8) *p++;
+        if (lo == '\\' && p < end) lo = (u8) *p++;
+        u8 hi = lo;
+        if (p + 1 < end && *p == '-' && p[1] != ']') {
+            hi = (u8) p[1];
+            p += 2;
+            if (hi == '\\' && p < end) hi = (u8) *p++;
+        }
+        for (u32 c = lo; c <= hi; ++c) {
+            class[c >> 6] |= 1ull << (c & 63);
+        }
+    }
+    if (p >= end) return NULL;
+
+    if (negate) FOR (i, 4) class[i] = ~class[i];
+    class['/' >> 6] &= ~(1ull << ('/' & 63));
+    return p + 1;
+}
+
+// Adds #pattern, in .gitignore syntax, -1 if nothing is left of it
+int
+CSortGlobSet_add(CSortGlobSet* set, const char* pattern, u32 len, bool dir_only) {
+    const char* p = pattern;
+    const char* end = pattern + len;
+    CSortGlobPattern glob = { .dir_only = dir_only };
+
+    if (p < end && *p == '!') {
+        glob.negate = true;
+        ++p;
+    }
+    if (end > p && end[-1] == '/') {
+        glob.dir_only = true;
+        --end;
+    }
+    if (p == end) return -1;
+
+    const bool anchored = (str_find((char*) p, (char*) end, '/') != end);
+    if (*p == '/') ++p;
+    const char* body = p;
+
+    const u32 start = set->steps.len;
+    DynArray_push(&set->starts, (void*) &start);
+    if (! anchored) _glob_push(set, CSortGlobOp_AnyDirs, 0, 0);
+
+    while (p < end) {
+        const bool segment_start = (p == body || p[-1] == '/');
+        if (p + 1 < end && p[0] == '*' && p[1] == '*' && segment_start && (p + 2 == end || p[2] == '/')) {
+            if (p + 2 == end) {
+                _glob_push(set, CSortGlobOp_AnyPath, 0, 0);
+                p += 2;
+            } else {
+                _glob_push(set, CSortGlobOp_AnyDirs, 0, 0);
+                p += 3;
+            }
+            continue;
+        }
+
+        switch (*p) {
+            case '*': {
+                while (p < end && *p == '*') ++p;
+                _glob_push(set, CSortGlobOp_Star, 0, 0);
+            } break;
+
+            case '?': {
+                _glob_push(set, CSortGlobOp_Any, 0, 0);
+                ++p;
+            } break;
+
+            case '[': {
+                u64 class[4];
+                const char* after = _glob_class(p + 1, end, class);
+                if (after) {
+                    _glob_push(set, CSortGlobOp_Class, 0, set->classes.len);
+                    DynArray_push(&set->classes, class);
+                    p = after;
+                } else {
+                    _glob_push(set, CSortGlobOp_Byte, '[', 0);
+                    ++p;
+                }
+            } break;
+
+            case '\\': {
+                if (p + 1 < end) ++p;
+                _glob_push(set, CSortGlobOp_Byte, (u8) *p, 0);
+                ++p;
+            } break;
+
+            default: {
+                _glob_push(set, CSortGlobOp_Byte, (u8) *p, 0);
+                ++p;
+            } break;
+        }
+    }
+
+    glob.match_step = set->steps.len;
+    _glob_push(set, CSortGlobOp_Match, 0, set->patterns.len);
+    DynArray_push(&set->patterns, (void*) &glob);
+    set->words = (set->steps.len + 63) / 64;
+    return 0;
+}
+
+// Adds every pattern of a .gitignore
+void
+CSortGlobSet_add_gitignore(CSortGlobSet* set, const char* text, u32 len) {
+    const char* end = text + len;
+    for (const char* line = text; line < end;) {
+        const char* eol = str_find((char*) line, (char*) end, '\n');
+        const char* last = eol;
+        if (last > line && last[-1] == '\r') --last;
+        // trailing spaces don't count, unless escaped
+        while (last > line && last[-1] == ' ' && ! (last - 1 > line && last[-2] == '\\')) --last;
+
+        if (last > line && *line != '#') {
+            const bool escaped = (*line == '\\' && last - line > 1 && (line[1] == '#' || line[1] == '!'));
+            CSortGlobSet_add(set, line + escaped, (u32) (last - line - escaped), false);
+        }
+        line = (eol < end) ? eol + 1 : end;
+    }
+}
+
+
+// ~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~~
+// ~Matching
+//
+// A step that can match nothing also brings in the next one when it's added. Staying
+// in `**/` doesn't, it only moves on after a '/', so `a/**/b` doesn't match `a/xb`.
+#define _bit_test(S, I) ((S)[(I) >> 6] & (1ull << ((I) & 63)))
+#define _bit_set(S, I) ((S)[(I) >> 6] |= (1ull << ((I) & 63)))
+
+internal void
+_glob_add(const CSortGlobSet* set, u64* state, u32 i) {
+    const CSortGlobStep* steps = DynArray_data(&set->steps);
+    for (;;) {
+        if (_bit_test(state, i)) return;
+        _bit_set(state, i);
+        const u8 op = steps[i].op;
+        if (op != CSortGlobOp_Star && op != CSortGlobOp_AnyDirs && op != CSortGlobOp_AnyPath) return;
+        ++i;
+    }
+}
+
+void
+CSortGlobSet_start(const CSortGlobSet* set, u64* state) {
+    DEV_memzero(state, sizeof(u64) * set->words);
+    FOR (i, set->starts.len) {
+        _glob_add(set, state, *(u32*) DynArray_get((DynArray*) &set->starts, i));
+    }
+}
+
+void
+CSortGlobSet_feed(const CSortGlobSet* set, u64* state, const char* s, u32 len) {
+    const CSortGlobStep* steps = DynArray_data(&set->steps);
+    const u64* classes = DynArray_data(&set->classes);
+    u64 next[set->words ? set->words : 1];
+
+    FOR (k, len) {
+        const u8 c = (u8) s[k];
+        DEV_memzero(next, sizeof(u64) * set->words);
+        bool alive = false;
+        FOR (w, set->words) {
+            for (u64 bits = state[w]; bits; bits &= bits - 1) {
+                const u32 i = w * 64 + __builtin_ctzll(bits);
+                const CSortGlobStep* step = &steps[i];
+                switch (step->op) {
+                    case CSortGlobOp_Byte:
+                        if (c == step->byte) _glob_add(set, next, i + 1);
+                        break;
+                    case CSortGlobOp_Any:
+                        if (c != '/') _glob_add(set, next, i + 1);
+                        break;
+                    case CSortGlobOp_Class:
+                        if (classes[step->arg * 4 + (c >> 6)] & (1ull << (c & 63))) _glob_add(set, next, i + 1);
+                        break;
+                    case CSortGlobOp_Star:
+                        if (c != '/') _glob_add(set, next, i);
+                        break;
+                    case CSortGlobOp_AnyDirs:
+                        if (c == '/') _glob_add(set, next, i + 1);
+                        break;
+                    case CSortGlobOp_AnyPath:
+                        _glob_add(set, next, i);
+                        break;
+                }
+            }
+        }
+        // staying in `**/` last, added earlier it would stop #_glob_add bringing in what follows
+        FOR (w, set->words) {
+            for (u64 bits = state[w]; bits; bits &= bits - 1) {
+                const u32 i = w * 64 + __builtin_ctzll(bits);
+                if (steps[i].op == CSortGlobOp_AnyDirs) _bit_set(next, i);
+            }
+        }
+        FOR (w, set->words) {
+            state[w] = next[w];
+            alive |= (next[w] != 0);
+        }
+        if (! alive) return;
+    }
+}
+
+// 1 ignored, 0 kept by a negated pattern, -1 if no pattern matched. The last one matching wins.
+int
+CSortGlobSet_decide(const CSortGlobSet* set, const u64* state, bool is_dir) {
+    const CSortGlobPattern* patterns = DynArray_data(&set->patterns);
+    for (u32 i = set->patterns.len; i-- > 0;) {
+        if (_bit_test(state, patterns[i].match_step) && (is_dir || ! patterns[i].dir_only)) {
+            return patterns[i].negate ? 0 : 1;
+        }
+    }
+    return -1;
+}
+
+bool
+CSortGlobSet_is_ignored(const CSortGlobSet* set, const char* path, bool is_dir) {
+    u64 state[set->words ? set->words : 1];
+    CSortGlobSet_start(set, state);
+    CSortGlobSet_feed(set, state, path, strlen(path));
+    return CSortGlobSet_decide(set, state, is_dir) == 1;
+}
+
+#undef _bit_test
+#undef _bit_set
+
+
+
+// --------------------------------------------------------------------------------------------
+//
+// Ignore layers
+//
+// --------------------------------------------------------------------------------------------
+#define CSortIgnore_gitignore_max (1u << 20)
+
+CSortIgnore
+CSortIgnore_mk(const CSortGlobSet* root_set, bool gitignore) {
+    CSortIgnore ignore = {0};
+    ignore.layers = DynArray_mk(sizeof(CSortIgnoreLayer));
+    ignore.frames = DynArray_mk(sizeof(CSortIgnoreFrame));
+    ignore.gitignore = gitignore;
+    if (root_set) {
+        const CSortIgnoreLayer layer = { .set = root_set };
+        DynArray_push(&ignore.layers, (void*) &layer);
+    }
+    return ignore;
+}
+
+void
+CSortIgnore_free(CSortIgnore* ignore) {
+    while (ignore->frames.len) {
+        CSortIgnore_leave(ignore);
+    }
+    DynArray_free(&ignore->layers);
+    DynArray_free(&ignore->frames);
+    free(ignore->scratch);
+    ignore->scratch = NULL;
+}
+
+internal u32
+_ignore_words(CSortIgnore* ignore, u32 layers_len) {
+    u32 words = 0;
+    FOR (i, layers_len) {
+        words += ((CSortIgnoreLayer*) DynArray_get(&ignore->layers, i))->set->words;
+    }
+    return words;
+}
+
+// compiles the .gitignore in #dir_fd, NULL if there is none
+internal CSortGlobSet*
+_ignore_read_gitignore(int dir_fd) {
+    const int fd = openat(dir_fd, ".gitignore", O_RDONLY);
+    if (fd < 0) return NULL;
+
+    FILE* fp = fdopen(fd, "r");
+    if (! fp) {
+        close(fd);
+        return NULL;
+    }
+    String text = string("", 0);
+    const int read = string_from_file(&text, fp);
+    fclose(fp);
+
+    CSortGlobSet* set = NULL;
+    if (read == 0 && text.len <= CSortIgnore_gitignore_max) {
+        set = (CSortGlobSet*) DEV_malloc(sizeof(CSortGlobSet), 1);
+        *set = CSortGlobSet_mk();
+        CSortGlobSet_add_gitignore(set, text.data, text.len);
+        if (! set->patterns.len) {
+            CSortGlobSet_free(set);
+            free(set);
+            set = NULL;
+        }
+    }
+    string_free(&text);
+    return set;
+}
+
+// Walks into the directory #name of the current one, already open as #dir_fd, #name is
+// NULL for the root of the walk
+void
+CSortIgnore_enter(CSortIgnore* ignore, int dir_fd, const char* name) {
+    const CSortIgnoreFrame* parent = ignore->frames.len
+        ? (CSortIgnoreFrame*) DynArray_get(&ignore->frames, ignore->frames.len - 1) : NULL;
+
+    CSortIgnoreFrame frame = {0};
+    frame.layers_len = parent ? parent->layers_len : ignore->layers.len;
+
+    CSortGlobSet* gitignore = ignore->gitignore ? _ignore_read_gitignore(dir_fd) : NULL;
+    if (gitignore) {
+        const CSortIgnoreLayer layer = { .set = gitignore, .owned = gitignore, .depth = ignore->frames.len };
+        DynArray_push(&ignore->layers, (void*) &layer);
+    }
+    const u32 layers_len = frame.layers_len + (gitignore ? 1 : 0);
+
+    const u32 words = _ignore_words(ignore, layers_len);
+    frame.states = (u64*) DEV_malloc(sizeof(u64), words ? words : 1);
+    u64* state = frame.states;
+    const u64* parent_state = parent ? parent->states : NULL;
+    FOR (i, layers_len) {
+        const CSortGlobSet* set = ((CSortIgnoreLayer*) DynArray_get(&ignore->layers, i))->set;
+        if (parent && i < frame.layers_len) {
+            memcpy(state, parent_state, sizeof(u64) * set->words);
+            CSortGlobSet_feed(set, state, name, strlen(name));
+            CSortGlobSet_feed(set, state, "/", 1);
+            parent_state += set->words;
+        } else {
+            CSortGlobSet_start(set, state);
+        }
+        state += set->words;
+    }
+    frame.layers_len = layers_len;
+    DynArray_push(&ignore->frames, (void*) &frame);
+
+    if (words > ignore->scratch_words) {
+        ignore->scratch = (u64*) DEV_realloc(ignore->scratch, sizeof(u64), words);
+        ignore->scratch_words = words;
+    }
+}
+
+void
+CSortIgnore_leave(CSortIgnore* ignore) {
+    CSortIgnoreFrame* frame = (CSortIgnoreFrame*) DynArray_get(&ignore->frames, ignore->frames.len - 1);
+    free(frame->states);
+    DynArray_pop(&ignore->frames);
+
+    // the .gitignore of the directory we're leaving
+    while (ignore->layers.len) {
+        CSortIgnoreLayer* layer = (CSortIgnoreLayer*) DynArray_get(&ignore->layers, ignore->layers.len - 1);
+        if (! layer->owned || layer->depth < ignore->frames.len) break;
+        CSortGlobSet_free(layer->owned);
+        free(layer->owned);
+        DynArray_pop(&ignore->layers);
+    }
+}
+
+// #name fed to layer #i of #frame, whose state starts #offset u64s into the frame
+internal int
+_ignore_decide(CSortIgnore* ignore, const CSortIgnoreFrame* frame, u32 i, u32 offset, const char* name, u32 name_len, bool is_dir) {
+    const CSortGlobSet* set = ((CSortIgnoreLayer*) DynArray_get(&ignore->layers, i))->set;
+    memcpy(ignore->scratch, frame->states + offset, sizeof(u64) * set->words);
+    CSortGlobSet_feed(set, ignore->scratch, name, name_len);
+    return CSortGlobSet_decide(set, ignore->scratch, is_dir);
+}
+
+// Whether #name in the current directory is skipped. The configured patterns can only
+// skip, after them the deepest .gitignore with a matching pattern decides.
+bool
+CSortIgnore_skip(CSortIgnore* ignore, const char* name, bool is_dir) {
+    if (! ignore->frames.len) return false;
+    const CSortIgnoreFrame* frame = (CSortIgnoreFrame*) DynArray_get(&ignore->frames, ignore->frames.len - 1);
+    const u32 name_len = strlen(name);
+
+    u32 offsets[frame->layers_len ? frame->layers_len : 1];
+    u32 offset = 0;
+    FOR (i, frame->layers_len) {
+        offsets[i] = offset;
+        offset += ((CSortIgnoreLayer*) DynArray_get(&ignore->layers, i))->set->words;
+    }
+
+    u32 first_gitignore = 0;
+    if (frame->layers_len && ! ((CSortIgnoreLayer*) DynArray_get(&ignore->layers, 0))->owned) {
+        if (_ignore_decide(ignore, frame, 0, offsets[0], name, name_len, is_dir) == 1) return true;
+        first_gitignore = 1;
+    }
+    for (u32 i = frame->layers_len; i-- > first_gitignore;) {
+        const int decided = _ignore_decide(ignore, frame, i, offsets[i], name, name_len, is_dir);
+        if (decided >= 0) return decided == 1;
+    }
+    return false;
+}
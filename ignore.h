@@ -0,0 +1,101 @@
+#ifndef __IGNORE_H__
+#define __IGNORE_H__
+
+#include "core.h"
+
+// --------------------------------------------------------------------------------------------
+//
+// Glob patterns, with .gitignore syntax
+//
+// Every pattern of a set is compiled into one NFA, a list of #CSortGlobStep, and all
+// of them are matched at once by keeping the set of live steps as a bitset while
+// feeding a path byte by byte. A state can be kept and fed more bytes later, the
+// traversal keeps one per directory and only feeds it the names in that directory.
+//
+//   `*` `?` `[a-z]` `[!a-z]` never match '/', `**/` matches any number of directories,
+//   a trailing `/**` everything below. `!` negates, a trailing '/' only matches
+//   directories. Patterns without a '/' match at any depth, others are anchored
+//   to the directory of the set.
+//
+// --------------------------------------------------------------------------------------------
+enum CSortGlobOp {
+    CSortGlobOp_Byte,
+    CSortGlobOp_Any,                                    // ?
+    CSortGlobOp_Class,                                  // [...]
+    CSortGlobOp_Star,                                   // *, a run without '/'
+    CSortGlobOp_AnyDirs,                                // **/, zero or more whole directories
+    CSortGlobOp_AnyPath,                                // trailing /**, anything
+    CSortGlobOp_Match,                                  // end of pattern
+};
+
+typedef struct CSortGlobStep CSortGlobStep;
+struct CSortGlobStep {
+    u8  op;
+    u8  byte;
+    u32 arg;                                            // class index, or pattern index on a match
+};
+
+typedef struct CSortGlobPattern CSortGlobPattern;
+struct CSortGlobPattern {
+    u32 match_step;
+    bool negate,
+         dir_only;
+};
+
+typedef struct CSortGlobSet CSortGlobSet;
+struct CSortGlobSet {
+    DynArray steps;                                     // CSortGlobStep
+    DynArray classes;                                   // u64[4], bit per byte
+    DynArray patterns;                                  // CSortGlobPattern
+    DynArray starts;                                    // u32, first step of every pattern
+    u32 words;                                          // u64s in a state
+};
+
+extern CSortGlobSet CSortGlobSet_mk(void);
+extern void CSortGlobSet_free(CSortGlobSet* set);
+extern int CSortGlobSet_add(CSortGlobSet* set, const char* pattern, u32 len, bool dir_only);
+extern void CSortGlobSet_add_gitignore(CSortGlobSet* set, const char* text, u32 len);
+
+// States are #CSortGlobSet::words u64s, only valid with the set they came from
+extern void CSortGlobSet_start(const CSortGlobSet* set, u64* state);
+extern void CSortGlobSet_feed(const CSortGlobSet* set, u64* state, const char* s, u32 len);
+extern int CSortGlobSet_decide(const CSortGlobSet* set, const u64* state, bool is_dir);
+extern bool CSortGlobSet_is_ignored(const CSortGlobSet* set, const char* path, bool is_dir);
+
+
+// --------------------------------------------------------------------------------------------
+// ~Ignore
+//
+// Layers of sets deciding what the traversal skips: the configured ones anchored at the
+// root of the walk, then a set per .gitignore, deepest first. Every layer keeps the state
+// reached at the directory being walked, entries only feed their own name from there.
+// #CSortIgnore_enter compiles the directory's .gitignore once, #CSortIgnore_leave drops it.
+typedef struct CSortIgnoreLayer CSortIgnoreLayer;
+struct CSortIgnoreLayer {
+    const CSortGlobSet* set;
+    CSortGlobSet* owned;                                // a .gitignore, freed with the layer
+    u32 depth;                                          // directory the layer was found in
+};
+
+typedef struct CSortIgnoreFrame CSortIgnoreFrame;
+struct CSortIgnoreFrame {
+    u32 layers_len;                                     // layers above this directory
+    u64* states;                                        // one state per layer, back to back
+};
+
+typedef struct CSortIgnore CSortIgnore;
+struct CSortIgnore {
+    DynArray layers;                                    // CSortIgnoreLayer
+    DynArray frames;                                    // CSortIgnoreFrame, one per open directory
+    bool gitignore;                                     // read .gitignore files
+    u64* scratch;
+    u32 scratch_words;
+};
+
+extern CSortIgnore CSortIgnore_mk(const CSortGlobSet* root_set, bool gitignore);
+extern void CSortIgnore_free(CSortIgnore* ignore);
+extern void CSortIgnore_enter(CSortIgnore* ignore, int dir_fd, const char* name);
+extern void CSortIgnore_leave(CSortIgnore* ignore);
+extern bool CSortIgnore_skip(CSortIgnore* ignore, const char* name, bool is_dir);
+
+#endif
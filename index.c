@@ -0,0 +1,553 @@
+#define _GNU_SOURCE
+#include "index.h"
+
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+
+#define CSortIndex_align 8
+
+// --------------------------------------------------------------------------------------------
+//
+// Reading
+//
+// --------------------------------------------------------------------------------------------
+internal bool
+_section_ok(const CSortIndex* index, u32 at, u32 len, u32 item_size, u32 align) {
+    return at % align == 0 && (u64) at + (u64) len * item_size <= index->size;
+}
+
+// maps #path, -1 with errno set if it can't be read or isn't an index
+int
+CSortIndex_open(CSortIndex* index, const char* path) {
+    *index = (CSortIndex) {0};
+    const int fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return -1;
+    }
+    struct stat st;
+    if (fstat(fd, &st) < 0) {
+        close(fd);
+        return -1;
+    }
+    if ((u64) st.st_size < sizeof(CSortIndexHeader)) {
+        close(fd);
+        errno = EINVAL;
+        return -1;
+    }
+    void* data = mmap(NULL, (size_t) st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return -1;
+    }
+
+    index->data = data;
+    index->size = (size_t) st.st_size;
+    const CSortIndexHeader* h = (const CSortIndexHeader*) data;
+    if (memcmp(h->magic, CSortIndex_magic, sizeof(h->magic)) != 0 || h->version != CSortIndex_version ||
+        ! _section_ok(index, h->modules_at, h->modules_len, sizeof(CSortIndexModule), 4) ||
+        ! _section_ok(index, h->files_at, h->files_len, sizeof(CSortIndexFile), 8) ||
+        ! _section_ok(index, h->importers_at, h->importers_len, sizeof(u32), 4) ||
+        ! _section_ok(index, h->imports_at, h->imports_len, sizeof(u32), 4) ||
+        ! _section_ok(index, h->strings_at, h->strings_len, 1, 1) ||
+        (h->strings_len && index->data[h->strings_at + h->strings_len - 1] != '\0')) {
+        CSortIndex_close(index);
+        errno = EINVAL;
+        return -1;
+    }
+
+    index->header = h;
+    index->modules = (const CSortIndexModule*) (index->data + h->modules_at);
+    index->files = (const CSortIndexFile*) (index->data + h->files_at);
+    index->importers = (const u32*) (index->data + h->importers_at);
+    index->imports = (const u32*) (index->data + h->imports_at);
+    index->strings = (const char*) (index->data + h->strings_at);
+    return 0;
+}
+
+void
+CSortIndex_close(CSortIndex* index) {
+    if (index->data) munmap((void*) index->data, index->size);
+    *index = (CSortIndex) {0};
+}
+
+// the name of #len bytes against #other, NUL terminated
+internal int
+_compare_name(const char* name, u32 len, const char* other, u32 other_len) {
+    const int c = memcmp(name, other, len < other_len ? len : other_len);
+    if (c) return c;
+    return (len > other_len) - (len < other_len);
+}
+
+// first module not before #name
+u32
+CSortIndex_lower_bound(const CSortIndex* index, const char* name, u32 len) {
+    u32 lo = 0, hi = index->header ? index->header->modules_len : 0;
+    while (lo < hi) {
+        const u32 mid = lo + (hi - lo) / 2;
+        const CSortIndexModule* m = &index->modules[mid];
+        if (_compare_name(index->strings + m->name, m->name_len, name, len) < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return lo;
+}
+
+u32
+CSortIndex_find_module(const CSortIndex* index, const char* name, u32 len) {
+    const u32 m = CSortIndex_lower_bound(index, name, len);
+    if (m < index->header->modules_len &&
+        _compare_name(CSortIndex_module_name(index, m), index->modules[m].name_len, name, len) == 0) {
+        return m;
+    }
+    return CSortIndex_none;
+}
+
+u32
+CSortIndex_find_file(const CSortIndex* index, const char* path, u32 len) {
+    if (! index->header) return CSortIndex_none;
+    u32 lo = 0, hi = index->header->files_len;
+    while (lo < hi) {
+        const u32 mid = lo + (hi - lo) / 2;
+        const CSortIndexFile* f = &index->files[mid];
+        const int c = _compare_name(index->strings + f->path, f->path_len, path, len);
+        if (c == 0) return mid;
+        if (c < 0) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    return CSortIndex_none;
+}
+
+
+// --------------------------------------------------------------------------------------------
+//
+// Building
+//
+// --------------------------------------------------------------------------------------------
+typedef struct _IndexEntry _IndexEntry;
+struct _IndexEntry {
+    char* path;
+    u32 path_len;
+    const CSortConfig* conf;                            // of the directory it's in
+    i64 mtime_ns;
+    u64 size;
+    String modules;                                     // NUL terminated names, one after the other
+    u32 modules_len;
+    bool parse;                                         // changed since the last index
+    bool failed;                                        // left out, so the next build tries again
+};
+
+typedef struct _IndexBuild _IndexBuild;
+struct _IndexBuild {
+    CSort* csort;
+    const CSortIndex* last;                             // no #CSortIndex::data without one
+    DynArray entries;                                   // _IndexEntry, in the order the walk found them
+    CSortIndexStats* stats;
+
+    u32 next;                                           // first entry no thread has taken
+    pthread_mutex_t lock;
+};
+
+// the walk's callback has nothing else to find the build by
+varGlobal _IndexBuild* _walking = NULL;
+
+internal i64
+_mtime_ns(const struct stat* st) {
+    return (i64) st->st_mtim.tv_sec * 1000000000 + st->st_mtim.tv_nsec;
+}
+
+// Files whose mtime and size match the last index keep the names it has for them
+internal void
+_index_found(CSort* csort, const char* path, const CSortConfig* conf) {
+    _IndexBuild* build = _walking;
+    struct stat st;
+    if (stat(path, &st) < 0) {
+        log_error("index: stat failed: %s: %s", path, strerror(errno));
+        return;
+    }
+
+    _IndexEntry entry = {0};
+    entry.path_len = strlen(path);
+    entry.path = strndup(path, entry.path_len);
+    entry.conf = conf;
+    entry.mtime_ns = _mtime_ns(&st);
+    entry.size = (u64) st.st_size;
+    entry.modules = string("", 0);
+
+    const CSortIndex* last = build->last;
+    const u32 f = CSortIndex_find_file(last, path, entry.path_len);
+    if (f != CSortIndex_none && last->files[f].mtime_ns == entry.mtime_ns && last->files[f].size == entry.size) {
+        const CSortIndexFile* file = &last->files[f];
+        FOR (i, file->imports_len) {
+            const u32 m = last->imports[file->imports_at + i];
+            string_append(&entry.modules, (char*) CSortIndex_module_name(last, m), last->modules[m].name_len + 1);
+        }
+        entry.modules_len = file->imports_len;
+        build->stats->reused += 1;
+    } else {
+        entry.parse = true;
+    }
+    DynArray_push(&build->entries, (void*) &entry);
+}
+
+// #name is a view into #source right after an `as`, the parser keeps the alias of
+// `import a as b` as if it was imported too
+internal bool
+_is_alias(String_View source, String_View name) {
+    const char* p = name.data;
+    if (p < SV_begin(source) || p > SV_end(source)) return false;
+    while (p > SV_begin(source) && (p[-1] == ' ' || p[-1] == '\t' || p[-1] == '\\' || p[-1] == '\n')) --p;
+    return p - SV_begin(source) >= 3 && p[-1] == 's' && p[-2] == 'a' && (p[-3] == ' ' || p[-3] == '\t');
+}
+
+// names of the modules in #table into #out, #source is what it was parsed from
+internal u32
+_collect_modules(CSortModuleTable* table, String_View source, String* out) {
+    u32 count = 0;
+    FOR (m, table->len) {
+        if (CSortModuleTable_kind(table, m) == CSortModuleKind_FROM) {
+            const String_View title = CSortModuleTable_title(table, m);
+            string_append(out, title.data, title.len);
+            string_append(out, "", 1);
+            count += 1;
+            continue;
+        }
+
+        const String_View* names = CSortModuleTable_imports(table, m);
+        FOR (i, CSortModuleTable_imports_len(table, m)) {
+            if (_is_alias(source, names[i])) continue;
+            string_append(out, names[i].data, names[i].len);
+            string_append(out, "", 1);
+            count += 1;
+        }
+    }
+    return count;
+}
+
+internal bool
+_index_parse(CSort* csort, CSortWorker* worker, _IndexEntry* entry) {
+    enum CSortStatus status = CSortWorker_read_file(worker, entry->path);
+    if (status == CSortStatus_Ok) {
+        CSortEntity entity = CSortEntity_mk_w_buffer(csort, worker, entry->path, worker->source.data, worker->source.len);
+        entity.conf = entry->conf;
+        CSortEntity_sort(&entity);
+        status = entity.status;
+        if (status == CSortStatus_Ok) {
+            entry->modules_len = _collect_modules(entity.modules, entity.source, &entry->modules);
+        }
+        CSortEntity_deinit(&entity);
+    }
+
+    if (status != CSortStatus_Ok) {
+        eprintln("csort: %s: %s", entry->path, worker->error);
+        entry->failed = true;
+    }
+    return status == CSortStatus_Ok;
+}
+
+internal void*
+_index_thread(void* arg) {
+    _IndexBuild* build = arg;
+    CSortWorker worker = CSortWorker_mk();
+
+    pthread_mutex_lock(&build->lock);
+    while (build->next < build->entries.len) {
+        _IndexEntry* entry = (_IndexEntry*) DynArray_get(&build->entries, build->next++);
+        if (! entry->parse) continue;
+        pthread_mutex_unlock(&build->lock);
+
+        const bool ok = _index_parse(build->csort, &worker, entry);
+        CSortWorker_reset(&worker);
+
+        pthread_mutex_lock(&build->lock);
+        build->stats->parsed += ok;
+        build->stats->failed += ! ok;
+    }
+    pthread_mutex_unlock(&build->lock);
+    CSortWorker_free(&worker);
+    return NULL;
+}
+
+internal int
+_compare_entry_paths(const void* a, const void* b) {
+    const _IndexEntry* e1 = a;
+    const _IndexEntry* e2 = b;
+    return _compare_name(e1->path, e1->path_len, e2->path, e2->path_len);
+}
+
+internal int
+_compare_u32(const void* a, const void* b) {
+    const u32 x = *(const u32*) a;
+    const u32 y = *(const u32*) b;
+    return (x > y) - (x < y);
+}
+
+// ~Interning, module names to ids in the order they're first seen
+typedef struct _NameTable _NameTable;
+struct _NameTable {
+    u32* slots;                                         // id + 1, 0 for a free slot
+    u32 cap;                                            // a power of two
+    DynArray names;                                     // String_View, into the entries
+};
+
+internal u32*
+_name_slot(_NameTable* table, String_View name) {
+    const String_View* names = DynArray_data(&table->names);
+    for (u32 i = (u32) CSortPathHash_feed(CSortPathHash_basis, name.data, name.len) & (table->cap - 1);; i = (i + 1) & (table->cap - 1)) {
+        const u32 slot = table->slots[i];
+        if (! slot || SV_isEq(names[slot - 1], name)) return &table->slots[i];
+    }
+}
+
+internal u32
+_intern(_NameTable* table, String_View name) {
+    // grow at 1/2 full
+    if ((table->names.len + 1) * 2 > table->cap) {
+        free(table->slots);
+        table->cap *= 2;
+        table->slots = (u32*) calloc(table->cap, sizeof(u32));
+        const String_View* names = DynArray_data(&table->names);
+        FOR (i, table->names.len) {
+            *_name_slot(table, names[i]) = i + 1;
+        }
+    }
+
+    u32* slot = _name_slot(table, name);
+    if (! *slot) {
+        DynArray_push(&table->names, (void*) &name);
+        *slot = table->names.len;
+    }
+    return *slot - 1;
+}
+
+varGlobal const String_View* _sorting_names = NULL;
+
+internal int
+_compare_ids_by_name(const void* a, const void* b) {
+    const String_View* n1 = &_sorting_names[*(const u32*) a];
+    const String_View* n2 = &_sorting_names[*(const u32*) b];
+    return _compare_name(n1->data, n1->len, n2->data, n2->len);
+}
+
+internal void
+_write_section(FILE* fp, u64* at, const void* data, u64 size) {
+    const char zeros[CSortIndex_align] = {0};
+    const u64 pad = (CSortIndex_align - *at % CSortIndex_align) % CSortIndex_align;
+    fwrite(zeros, 1, pad, fp);
+    if (size) fwrite(data, 1, size, fp);
+    *at += pad + size;
+}
+
+// Sections out of the entries, in #out.tmp renamed over #out once it's all there
+internal int
+_index_write(_IndexBuild* build, const char* out) {
+    // failed files are dropped, the rest are sorted by path, their ids
+    _IndexEntry* entries = DynArray_data(&build->entries);
+    u32 files_len = 0;
+    FOR (i, build->entries.len) {
+        if (! entries[i].failed) {
+            entries[files_len++] = entries[i];
+        } else {
+            string_free(&entries[i].modules);
+            free(entries[i].path);
+        }
+    }
+    build->entries.len = files_len;
+    qsort(entries, files_len, sizeof(_IndexEntry), _compare_entry_paths);
+
+    // module ids by first sight, then renumbered by name
+    _NameTable table = { .cap = 1024 };
+    table.slots = (u32*) calloc(table.cap, sizeof(u32));
+    table.names = DynArray_mk(sizeof(String_View));
+    DynArray imports = DynArray_mk(sizeof(u32));
+    CSortIndexFile* files = (CSortIndexFile*) calloc(files_len ? files_len : 1, sizeof(CSortIndexFile));
+    FOR (f, files_len) {
+        const _IndexEntry* entry = &entries[f];
+        files[f].imports_at = imports.len;
+        const char* name = entry->modules.data;
+        FOR (i, entry->modules_len) {
+            const u32 name_len = strlen(name);
+            const u32 id = _intern(&table, SV_buff((char*) name, name_len));
+            DynArray_push(&imports, (void*) &id);
+            name += name_len + 1;
+        }
+    }
+
+    const u32 modules_len = table.names.len;
+    const String_View* names = DynArray_data(&table.names);
+    u32* order = (u32*) calloc(modules_len ? modules_len : 1, sizeof(u32));
+    u32* rank = (u32*) calloc(modules_len ? modules_len : 1, sizeof(u32));
+    FOR (m, modules_len) order[m] = m;
+    _sorting_names = names;
+    qsort(order, modules_len, sizeof(u32), _compare_ids_by_name);
+    FOR (m, modules_len) rank[order[m]] = m;
+
+    // every file's modules ascending and once, compacted in place
+    u32* ids = DynArray_data(&imports);
+    u32 imports_len = 0;
+    FOR (f, files_len) {
+        const u32 begin = files[f].imports_at;
+        const u32 end = (f + 1 < files_len) ? files[f + 1].imports_at : imports.len;
+        for (u32 i = begin; i < end; ++i) ids[i] = rank[ids[i]];
+        qsort(ids + begin, end - begin, sizeof(u32), _compare_u32);
+
+        files[f].imports_at = imports_len;
+        for (u32 i = begin; i < end; ++i) {
+            if (i == begin || ids[i] != ids[i - 1]) ids[imports_len++] = ids[i];
+        }
+        files[f].imports_len = imports_len - files[f].imports_at;
+    }
+
+    // importers of a module, by counting, ascending since files are visited in order
+    CSortIndexModule* modules = (CSortIndexModule*) calloc(modules_len ? modules_len : 1, sizeof(CSortIndexModule));
+    FOR (i, imports_len) modules[ids[i]].importers_len += 1;
+    u32 importers_len = 0;
+    FOR (m, modules_len) {
+        modules[m].importers_at = importers_len;
+        importers_len += modules[m].importers_len;
+        modules[m].importers_len = 0;
+    }
+    u32* importers = (u32*) calloc(importers_len ? importers_len : 1, sizeof(u32));
+    FOR (f, files_len) {
+        FOR (i, files[f].imports_len) {
+            CSortIndexModule* module = &modules[ids[files[f].imports_at + i]];
+            importers[module->importers_at + module->importers_len++] = f;
+        }
+    }
+
+    // names, then paths
+    String strings = string("", 0);
+    FOR (m, modules_len) {
+        const String_View* name = &names[order[m]];
+        modules[m].name = strings.len;
+        modules[m].name_len = name->len;
+        string_append(&strings, name->data, name->len);
+        string_append(&strings, "", 1);
+    }
+    FOR (f, files_len) {
+        files[f].path = strings.len;
+        files[f].path_len = entries[f].path_len;
+        files[f].mtime_ns = entries[f].mtime_ns;
+        files[f].size = entries[f].size;
+        string_append(&strings, entries[f].path, entries[f].path_len + 1);
+    }
+
+    CSortIndexHeader header = {0};
+    memcpy(header.magic, CSortIndex_magic, sizeof(header.magic));
+    header.version = CSortIndex_version;
+    header.modules_len = modules_len;
+    header.files_len = files_len;
+    header.importers_len = importers_len;
+    header.imports_len = imports_len;
+    header.strings_len = strings.len;
+
+    int result = 0;
+    char tmp[1024];
+    snprintf(tmp, sizeof(tmp), "%s.tmp", out);
+    FILE* fp = fopen(tmp, "wb");
+    if (! fp) {
+        log_error("index: Could not open: %s: %s", tmp, strerror(errno));
+        result = -1;
+    } else {
+        // the header twice, the second time with the offsets found writing the sections
+        u64 at = 0;
+        _write_section(fp, &at, &header, sizeof(header));
+        header.modules_at = (at + CSortIndex_align - 1) / CSortIndex_align * CSortIndex_align;
+        _write_section(fp, &at, modules, (u64) modules_len * sizeof(CSortIndexModule));
+        header.files_at = (at + CSortIndex_align - 1) / CSortIndex_align * CSortIndex_align;
+        _write_section(fp, &at, files, (u64) files_len * sizeof(CSortIndexFile));
+        header.importers_at = (at + CSortIndex_align - 1) / CSortIndex_align * CSortIndex_align;
+        _write_section(fp, &at, importers, (u64) importers_len * sizeof(u32));
+        header.imports_at = (at + CSortIndex_align - 1) / CSortIndex_align * CSortIndex_align;
+        _write_section(fp, &at, ids, (u64) imports_len * sizeof(u32));
+        header.strings_at = (at + CSortIndex_align - 1) / CSortIndex_align * CSortIndex_align;
+        _write_section(fp, &at, strings.data, strings.len);
+
+        if (at > UINT32_MAX) {
+            log_error("index: %s would be over 4GiB", out);
+            result = -1;
+        }
+        rewind(fp);
+        fwrite(&header, 1, sizeof(header), fp);
+        if (ferror(fp) | fclose(fp)) {
+            log_error("index: Could not write: %s: %s", tmp, strerror(errno));
+            result = -1;
+        }
+        if (result == 0 && rename(tmp, out) < 0) {
+            log_error("index: Could not rename %s to %s: %s", tmp, out, strerror(errno));
+            result = -1;
+        }
+        if (result < 0) unlink(tmp);
+    }
+
+    build->stats->files = files_len;
+    build->stats->modules = modules_len;
+    string_free(&strings);
+    free(importers);
+    free(modules);
+    free(rank);
+    free(order);
+    free(files);
+    DynArray_free(&imports);
+    DynArray_free(&table.names);
+    free(table.slots);
+    return result;
+}
+
+int
+CSortIndex_build(CSort* csort, const char* root, const char* out, u32 jobs, CSortIndexStats* stats) {
+    *stats = (CSortIndexStats) {0};
+    CSortIndex last = {0};
+    CSortIndex_open(&last, out);
+
+    _IndexBuild build = {0};
+    build.csort = csort;
+    build.last = &last;
+    build.entries = DynArray_mk(sizeof(_IndexEntry));
+    build.stats = stats;
+    pthread_mutex_init(&build.lock, NULL);
+
+    _walking = &build;
+    int result = CSortPerformOnFileCallbackRecur(csort, root, _index_found);
+    _walking = NULL;
+
+    if (result == 0) {
+        u32 changed = 0;
+        FOR (i, build.entries.len) {
+            changed += ((_IndexEntry*) DynArray_get(&build.entries, i))->parse;
+        }
+
+        // the calling thread is the first job, fewer threads if we can't spawn them all
+        if (! jobs) jobs = (u32) sysconf(_SC_NPROCESSORS_ONLN);
+        if (jobs > changed) jobs = changed;
+        if (jobs < 1) jobs = 1;
+        pthread_t* threads = (pthread_t*) DEV_malloc(sizeof(pthread_t), jobs);
+        u32 spawned = 1;
+        while (spawned < jobs && pthread_create(&threads[spawned], NULL, _index_thread, &build) == 0) {
+            ++spawned;
+        }
+        _index_thread(&build);
+        for (u32 i = 1; i < spawned; ++i) {
+            pthread_join(threads[i], NULL);
+        }
+        free(threads);
+        result = _index_write(&build, out);
+    }
+
+    FOR (i, build.entries.len) {
+        _IndexEntry* entry = (_IndexEntry*) DynArray_get(&build.entries, i);
+        string_free(&entry->modules);
+        free(entry->path);
+    }
+    DynArray_free(&build.entries);
+    pthread_mutex_destroy(&build.lock);
+    CSortIndex_close(&last);
+    return result;
+}
@@ -0,0 +1,86 @@
+#ifndef __INDEX_H__
+#define __INDEX_H__
+
+#include "csort.h"
+
+// --------------------------------------------------------------------------------------------
+//
+// Import index, `csort index ROOT -o imports.idx`
+//
+// Which modules every file imports and which files import every module, in a file made to be
+// mmap'ed and read in place. After the header come the sections, found by their offset:
+//
+//   modules        CSortIndexModule, by name, a name is found by binary search
+//   files          CSortIndexFile, by path, with the mtime and size they were parsed at
+//   importers      u32 file ids, ascending, a module's are [importers_at, + importers_len)
+//   imports        u32 module ids, ascending, a file's are [imports_at, + imports_len)
+//   strings        NUL terminated names and paths, the records point into it
+//
+// A module is what follows `from`, or any of the names of `import a, b.c`, as written, so
+// relative ones keep their dots. Paths are kept as the walk found them. Building over an
+// existing index only parses the files whose mtime or size changed since.
+//
+// --------------------------------------------------------------------------------------------
+#define CSortIndex_magic "CSORTIDX"
+#define CSortIndex_version 1
+#define CSortIndex_none ((u32) -1)
+
+typedef struct CSortIndexHeader CSortIndexHeader;
+struct CSortIndexHeader {
+    char magic[8];
+    u32 version;
+    u32 modules_len, files_len, importers_len, imports_len, strings_len;
+    u32 modules_at, files_at, importers_at, imports_at, strings_at;     // bytes from the start
+};
+
+typedef struct CSortIndexModule CSortIndexModule;
+struct CSortIndexModule {
+    u32 name, name_len;                                 // into the strings
+    u32 importers_at, importers_len;
+};
+
+typedef struct CSortIndexFile CSortIndexFile;
+struct CSortIndexFile {
+    i64 mtime_ns;
+    u64 size;
+    u32 path, path_len;                                 // into the strings
+    u32 imports_at, imports_len;
+};
+
+// An index mapped read only, its sections checked to be in bounds once when opened
+typedef struct CSortIndex CSortIndex;
+struct CSortIndex {
+    const u8* data;
+    size_t size;
+    const CSortIndexHeader* header;
+    const CSortIndexModule* modules;
+    const CSortIndexFile* files;
+    const u32* importers;
+    const u32* imports;
+    const char* strings;
+};
+
+#define CSortIndex_module_name(I, M) ((I)->strings + (I)->modules[(M)].name)
+#define CSortIndex_file_path(I, F) ((I)->strings + (I)->files[(F)].path)
+
+extern int CSortIndex_open(CSortIndex* index, const char* path);
+extern void CSortIndex_close(CSortIndex* index);
+extern u32 CSortIndex_find_module(const CSortIndex* index, const char* name, u32 len);
+extern u32 CSortIndex_find_file(const CSortIndex* index, const char* path, u32 len);
+extern u32 CSortIndex_lower_bound(const CSortIndex* index, const char* name, u32 len);
+
+
+// --------------------------------------------------------------------------------------------
+// ~Build
+//
+// Walks #root as `-r` does, with the same config, and parses what changed on #jobs threads,
+// each with a worker of its own. The index is written next to #out and renamed over it.
+typedef struct CSortIndexStats CSortIndexStats;
+struct CSortIndexStats {
+    u32 files, parsed, reused, failed;
+    u32 modules;
+};
+
+extern int CSortIndex_build(CSort* csort, const char* root, const char* out, u32 jobs, CSortIndexStats* stats);
+
+#endif
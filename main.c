@@ -1,18 +1,24 @@
+#define _GNU_SOURCE
 #include <stdio.h>
 #include <stdlib.h>
+#include <limits.h>
 #include "core.h"
 #include "csort.h"
+#include "index.h"
+#include "pipeline.h"
 
 #include <fcntl.h>
 #include <unistd.h>
 #include <sys/types.h>
 #include <sys/stat.h>
 
-#define csort_config_usr ".csortconfig"
+#define csort_usage "usage: csort [FILE..] [options..]\n       csort index ROOT [options..]\n       csort query INDEX [MODULE..] [options..]"
 
+// the nearest .csortconfig in the current directory or above it, NULL without one
 internal inline const char*
 _config_file_to_load(void) {
-    return DEV_bool(access(csort_config_usr, F_OK) < 0) ? NULL : csort_config_usr;
+    varPersist char path[PATH_MAX];
+    return DEV_bool(CSort_find_config(path, sizeof(path)) < 0) ? NULL : path;
 }
 
 // Make cmdline options attach to #CSortConfigCmd struct
@@ -20,89 +26,394 @@ _config_file_to_load(void) {
 internal CSortOptObj*
 CSort_update_config_via_cmd(CSort* csort, u32* options_len) {
     CSortMemArenaNode* mem = CSortMemArena_alloc(&csort->arena);
-    *options_len = 5;
     CSortOptObj options[] = {
         CSortOptBool(csort, &csort->conf.cmd_options.show_after_sort, "--show", "-s", "show changes after sanitizing"),
         CSortOptBool(csort, &csort->conf.cmd_options.recursive_apply, "--recur", "-r", "recursively iterates the whole directory, vaild if supplied path is a directory"),
         CSortOptBool(csort, &csort->conf.disable_wrapping, "--disable-wrapping", "-dw", "disable wrapping for duplicate librarys"),
         CSortOptBool(csort, &csort->conf.squash_for_duplicate_library, "--no-squash-duplicates", "-sd", "disable squashing duplicate librarys"),
-        CSortOptInt(csort, &csort->conf.wrap_after_n_imports, "--wrap-after", "-wa", "starts wrapping imports after n, imports")
+        CSortOptInt(csort, &csort->conf.wrap_after_n_imports, "--wrap-after", "-wa", "starts wrapping imports after n, imports"),
+        CSortOptBool(csort, &csort->conf.cmd_options.print_stats, "--stats", "-st", "print per-phase timings and counters to stderr at exit"),
+        CSortOptStr(csort, &csort->conf.cmd_options.trace_file, "--trace", "-tr", "write chrome trace events (chrome://tracing, perfetto) of the run to this file"),
+        CSortOptBool(csort, &csort->conf.cmd_options.print_mem_stats, "--mem-stats", "-ms", "print allocation counts and peak memory per file and per run to stderr at exit"),
+        CSortOptBool(csort, &csort->conf.respect_gitignore, "--gitignore", "-gi", "also skip what .gitignore files in the tree ignore, while walking directories"),
+        CSortOptStr(csort, &csort->conf.cmd_options.files_from, "--files-from", "-ff", "sort the files listed in this file, or stdin for '-', separated by NUL or newlines"),
+        CSortOptStr(csort, &csort->conf.cmd_options.shard, "--shard", "-sh", "i/N, only sort the files of the i-th of N shards (1 <= i <= N), split by a hash of their path"),
+        CSortOptInt(csort, &csort->conf.cmd_options.max_file_size, "--max-file-size", "-mf", "skip files larger than this many bytes, unless named on the command line"),
+        CSortOptStr(csort, &csort->conf.cmd_options.max_memory, "--max-memory", "-mm", "SIZE[K|M|G], hold back the walk while the files in flight would need more, large files are sorted one at a time"),
+        CSortOptBool(csort, &csort->conf.cmd_options.perf_counters, "--perf-counters", "-pc", "add cycles, instructions, branch and cache misses per phase, from perf_event_open, to --stats"),
     };
+    *options_len = sizeof(options) / sizeof(options[0]);
 
     CSortMemArenaNode_fill(mem, options, sizeof(options));
     return (CSortOptObj*) mem->mem;
 }
 
-// check if #filepath is a directory.
+// check if #filepath is a directory, #file_stat is what stat says about it
 internal int
-is_directory(CSort* csort, const char* filepath, bool* success) {
-    struct stat file_stat;
-    if (stat(filepath, &file_stat) < 0) {
+is_directory(CSort* csort, const char* filepath, bool* success, struct stat* file_stat) {
+    if (stat(filepath, file_stat) < 0) {
         log_error("is_directory: stat failed: %s: %s", filepath, strerror(errno));
         return -1;
     } 
-    *success = ((file_stat.st_mode & S_IFMT) == S_IFDIR) ? true : false;
+    *success = ((file_stat->st_mode & S_IFMT) == S_IFDIR) ? true : false;
+    return 0;
+}
+
+// files on their way from the walk to stdout, see pipeline.h
+varGlobal CSortPipeline pipeline;
+
+// prints what's already queued and ends the run
+internal void
+CSortExit(CSort* csort) {
+    CSortPipeline_finish(&pipeline);
+    CSort_deinit(csort);
+    exit(1);
+}
+
+internal void
+CSortDrainPipeline(CSort* csort) {
+    CSortPipeline_finish(&pipeline);
+}
+
+// Queues #input_filepath to be sorted with #conf and printed, under a #header with its path,
+// a file that can't be read or parsed is reported and the run goes on
+internal void
+CSortSortFile(CSort* csort, const char* input_filepath, const CSortConfig* conf, bool header) {
+    CSortPipeline_add(&pipeline, input_filepath, conf, header);
+}
+
+// This function is a callback, the traversal only calls it for #CSortConfig::file_exts,
+// with the config of the directory it's in.
+internal void
+CSortHandlePyFile(CSort* csort, const char* input_filepath, const CSortConfig* conf) {
+    CSortSortFile(csort, input_filepath, conf, true);
+}
+
+// Sorts a FILE argument, every file below it if it's a directory. Files named by
+// themselves aren't filtered by extension, they're printed without a header
+// when they're all there is to sort.
+internal void
+CSortSortRoot(CSort* csort, const char* input_filepath, bool alone) {
+    bool success = false;
+    struct stat file_stat;
+    if (is_directory(csort, input_filepath, &success, &file_stat) < 0) {
+        log_error("csort: Couldn't check if %s is a directory.", input_filepath);
+        CSortExit(csort);
+    }
+
+    if (! success) {
+        CSortStats_count(files_visited, 1);
+        // hashed over the path as given, its root is itself
+        if (! CSort_in_shard(csort, CSortPathHash_feed(CSortPathHash_basis, input_filepath, strlen(input_filepath))) ||
+            ! CSortInodeSet_add(&csort->seen, file_stat.st_dev, file_stat.st_ino)) {
+            CSortStats_count(files_skipped, 1);
+        } else {
+            const CSortConfig* conf = CSort_config_for_file(csort, input_filepath, strlen(input_filepath));
+            CSortSortFile(csort, input_filepath, conf, ! alone);
+        }
+    } else {
+        if (csort->conf.cmd_options.recursive_apply) {
+            CSortPerformOnFileCallbackRecur(csort, input_filepath, CSortHandlePyFile);
+        } else {
+            CSortPerformOnFileCallback(csort, input_filepath, CSortHandlePyFile);
+        }
+    }
+}
+
+
+// --------------------------------------------------------------------------------------------
+// ~Index
+//
+// `csort index ROOT` writes which modules every file below ROOT imports, `csort query INDEX`
+// reads it back without parsing anything.
+#define csort_index_usage "usage: csort index ROOT [options..]"
+#define csort_query_usage "usage: csort query INDEX [MODULE..] [options..]"
+
+internal int
+CSortIndexCmd(CSort* csort, int argc, char* argv[]) {
+    char* out = "imports.idx";
+    u64 jobs = 0;
+    CSortOptObj options[] = {
+        CSortOptStr(csort, &out, "--output", "-o", "write the index to this file, files it has and which haven't changed aren't parsed again"),
+        CSortOptInt(csort, &jobs, "--jobs", "-j", "parse on this many threads, one per cpu by default"),
+    };
+    const u32 options_len = sizeof(options) / sizeof(options[0]);
+
+    DynArray roots = DynArray_mk(sizeof(char*));
+    CSortOptParse(argc - 1, &argv[1], options, options_len, csort_index_usage, &roots);
+    if (roots.len != 1) {
+        eprintln(csort_index_usage);
+        CSortOptParse_show_usage(stderr, options, options_len);
+        DynArray_free(&roots);
+        return 1;
+    }
+
+    CSortIndexStats stats;
+    const int result = CSortIndex_build(csort, *(char**) DynArray_get(&roots, 0), out, (u32) jobs, &stats);
+    DynArray_free(&roots);
+    if (result < 0) {
+        return 1;
+    }
+    eprintln("csort: %s: %u files, %u modules, %u parsed, %u unchanged, %u failed",
+             out, stats.files, stats.modules, stats.parsed, stats.reused, stats.failed);
     return 0;
 }
 
-// Make entity for #input_filepath
-// This function is a callback.
+internal int
+_compare_file_ids(const void* a, const void* b) {
+    const u32 x = *(const u32*) a;
+    const u32 y = *(const u32*) b;
+    return (x > y) - (x < y);
+}
+
+// files importing #name, or with #prefix any module below it too, once each
+internal void
+_query_importers(const CSortIndex* index, const char* name, bool prefix) {
+    const u32 len = strlen(name);
+    DynArray found = DynArray_mk(sizeof(u32));
+    for (u32 m = CSortIndex_lower_bound(index, name, len); m < index->header->modules_len; ++m) {
+        const CSortIndexModule* module = &index->modules[m];
+        const char* module_name = CSortIndex_module_name(index, m);
+        const bool exact = module->name_len == len && memcmp(module_name, name, len) == 0;
+        const bool below = prefix && module->name_len > len && memcmp(module_name, name, len) == 0 && module_name[len] == '.';
+        if (! exact && ! below) break;
+        FOR (i, module->importers_len) {
+            DynArray_push(&found, (void*) &index->importers[module->importers_at + i]);
+        }
+        if (! prefix) break;
+    }
+
+    // file ids are in path order
+    u32* ids = DynArray_data(&found);
+    qsort(ids, found.len, sizeof(u32), _compare_file_ids);
+    FOR (i, found.len) {
+        if (i && ids[i] == ids[i - 1]) continue;
+        println("%s", CSortIndex_file_path(index, ids[i]));
+    }
+    DynArray_free(&found);
+}
+
+internal void
+_query_imports(const CSortIndex* index, const char* path) {
+    const u32 f = CSortIndex_find_file(index, path, strlen(path));
+    if (f == CSortIndex_none) {
+        log_error("csort: Not in the index: %s", path);
+        return;
+    }
+    FOR (i, index->files[f].imports_len) {
+        println("%s", CSortIndex_module_name(index, index->imports[index->files[f].imports_at + i]));
+    }
+}
+
+typedef struct _TopPackage _TopPackage;
+struct _TopPackage {
+    u32 files;
+    u32 module;                                         // first module of the package
+    u32 name_len;
+};
+
+internal int
+_compare_top_packages(const void* a, const void* b) {
+    const _TopPackage* p1 = a;
+    const _TopPackage* p2 = b;
+    if (p1->files != p2->files) return (p1->files < p2->files) - (p1->files > p2->files);
+    return (p1->module > p2->module) - (p1->module < p2->module);
+}
+
+internal bool
+_is_standard_library(const CSortConfig* conf, const char* name, u32 len) {
+    FOR (i, conf->know_standard_library.len) {
+        const String* lib = (const String*) DynArray_get((DynArray*) &conf->know_standard_library, i);
+        if (lib->len == len && memcmp(lib->data, name, len) == 0) return true;
+    }
+    return false;
+}
+
+// The #top packages most files import, by the first part of the module name. Relative
+// imports and the standard library don't count. Modules are by name, so those of a
+// package come one after the other.
 internal void
-CSortHandlePyFile(CSort* csort, const char* input_filepath) {
-    const String_View input_file_sv = SV(input_filepath);
-    String_View input_file_ext = {0};
-    if (CSortGetExtension(input_file_sv, &input_file_ext) == 0 &&
-        CSortConfigFindStrList(&csort->conf, 2, input_file_ext.data)) {
-        println("\033[1;31m%s:\033[0m", input_filepath);
-        CSortEntity entity = CSortEntity_mk(csort, input_filepath);
-        CSortEntity_do(&entity);
-        CSortEntity_deinit(&entity);
-        println("");
+_query_top(CSort* csort, const CSortIndex* index, u32 top) {
+    const u32 modules_len = index->header->modules_len;
+    u32* stamp = (u32*) calloc(index->header->files_len ? index->header->files_len : 1, sizeof(u32));
+    DynArray packages = DynArray_mk(sizeof(_TopPackage));
+
+    for (u32 m = 0; m < modules_len;) {
+        const char* name = CSortIndex_module_name(index, m);
+        const char* dot = memchr(name, '.', index->modules[m].name_len);
+        const u32 name_len = dot ? (u32) (dot - name) : index->modules[m].name_len;
+
+        _TopPackage package = { .files = 0, .module = m, .name_len = name_len };
+        for (; m < modules_len; ++m) {
+            const CSortIndexModule* module = &index->modules[m];
+            const char* module_name = CSortIndex_module_name(index, m);
+            if (module->name_len < name_len || memcmp(module_name, name, name_len) != 0 ||
+                (module->name_len > name_len && module_name[name_len] != '.')) {
+                break;
+            }
+            FOR (i, module->importers_len) {
+                const u32 f = index->importers[module->importers_at + i];
+                if (stamp[f] == package.module + 1) continue;
+                stamp[f] = package.module + 1;
+                package.files += 1;
+            }
+        }
+        if (name_len && ! _is_standard_library(&csort->conf, name, name_len)) {
+            DynArray_push(&packages, (void*) &package);
+        }
+    }
+
+    _TopPackage* data = DynArray_data(&packages);
+    qsort(data, packages.len, sizeof(_TopPackage), _compare_top_packages);
+    for (u32 i = 0; i < packages.len && i < top; ++i) {
+        println("%u %.*s", data[i].files, data[i].name_len, CSortIndex_module_name(index, data[i].module));
+    }
+    DynArray_free(&packages);
+    free(stamp);
+}
+
+internal int
+CSortQueryCmd(CSort* csort, int argc, char* argv[]) {
+    bool prefix = false, files = false;
+    u64 top = 0;
+    CSortOptObj options[] = {
+        CSortOptBool(csort, &prefix, "--prefix", "-p", "also the files importing modules below MODULE, `a.b` for `a`"),
+        CSortOptBool(csort, &files, "--files", "-f", "the arguments are files, print the modules each imports"),
+        CSortOptInt(csort, &top, "--top", "-t", "print the N third-party packages imported by the most files"),
+    };
+    const u32 options_len = sizeof(options) / sizeof(options[0]);
+
+    DynArray args = DynArray_mk(sizeof(char*));
+    CSortOptParse(argc - 1, &argv[1], options, options_len, csort_query_usage, &args);
+    if (! args.len || (args.len == 1 && ! top)) {
+        eprintln(csort_query_usage);
+        CSortOptParse_show_usage(stderr, options, options_len);
+        DynArray_free(&args);
+        return 1;
+    }
+
+    const char* index_path = *(char**) DynArray_get(&args, 0);
+    CSortIndex index;
+    if (CSortIndex_open(&index, index_path) < 0) {
+        log_error("csort: Could not open index: %s: %s", index_path, strerror(errno));
+        DynArray_free(&args);
+        return 1;
+    }
+
+    if (top) {
+        _query_top(csort, &index, (u32) top);
+    }
+    for (u32 i = 1; i < args.len; ++i) {
+        const char* arg = *(char**) DynArray_get(&args, i);
+        if (args.len > 2) {
+            println("\033[1;31m%s:\033[0m", arg);
+        }
+        if (files) {
+            _query_imports(&index, arg);
+        } else {
+            _query_importers(&index, arg, prefix);
+        }
     }
+
+    CSortIndex_close(&index);
+    DynArray_free(&args);
+    return 0;
 }
 
 
 // --------------------------------------------------------------------------------------------
 int main(int argc, char* argv[]) {
     CSort csort = CSort_mk();
-    CSort_init_config(&csort, _config_file_to_load());
+    const char* lua_config = _config_file_to_load();
+    CSort_init_config(&csort, lua_config);
+    const CSortConfig from_file = csort.conf;
+
+    // subcommands with options of their own
+    if (argc > 1 && (DEV_strIsEq(argv[1], "index") || DEV_strIsEq(argv[1], "query"))) {
+        CSort_init_config_tree(&csort, lua_config, &from_file);
+        const int result = DEV_strIsEq(argv[1], "index") ? CSortIndexCmd(&csort, argc - 1, &argv[1])
+                                                          : CSortQueryCmd(&csort, argc - 1, &argv[1]);
+        CSort_deinit(&csort);
+        return result;
+    }
 
     u32 options_len = 0;
     CSortOptObj* options = CSort_update_config_via_cmd(&csort, &options_len);
 
-    if (argc <= 1) {
-        eprintln("usage: csort [FILE] [options..]");
+    if (argc <= 1 || CSortOptParse_is_help_flag(argv[1])) {
+        eprintln(csort_usage);
         CSortOptParse_show_usage(stderr, options, options_len);
         exit(1);
     }
 
-    const char* input_filepath = argv[1];
-    if (CSortOptParse_is_help_flag(input_filepath)) {
-        eprintln("usage: csort [FILE] [options..]");
+    // any number of FILEs, none when the files come from `--files-from`
+    DynArray roots = DynArray_mk(sizeof(char*));
+    CSortOptParse(argc - 1, &argv[1], options, options_len, "usage: csort [FILE..] [options..]", &roots);
+    const char* files_from = csort.conf.cmd_options.files_from;
+    if (! roots.len && ! files_from) {
+        eprintln(csort_usage);
         CSortOptParse_show_usage(stderr, options, options_len);
         exit(1);
     }
-    CSortOptParse(argc - 1, &argv[2], options, options_len, "usage: csort [FILE] [options..]");
+    // .csortconfig files further down are loaded on top of this one, as they're reached
+    CSort_init_config_tree(&csort, lua_config, &from_file);
+    csort.conf.cmd_options.print_stats |= csort.conf.cmd_options.perf_counters;
+    csort_stats_enabled = csort.conf.cmd_options.print_stats;
+    csort_perf_enabled = csort.conf.cmd_options.perf_counters;
+    csort_trace_enabled = csort.conf.cmd_options.trace_file != NULL;
+    if (csort.conf.cmd_options.shard && CSort_parse_shard(&csort, csort.conf.cmd_options.shard) < 0) {
+        log_error("csort: --shard expects i/N with 1 <= i <= N, got: %s", csort.conf.cmd_options.shard);
+        CSort_deinit(&csort);
+        exit(1);
+    }
+    if (csort.conf.cmd_options.max_memory && CSort_parse_max_memory(&csort, csort.conf.cmd_options.max_memory) < 0) {
+        log_error("csort: --max-memory expects a size in bytes, with an optional K, M or G suffix, got: %s", csort.conf.cmd_options.max_memory);
+        CSort_deinit(&csort);
+        exit(1);
+    }
 
-    bool success = false;
-    if (is_directory(&csort, input_filepath, &success) < 0) {
-        log_error("csort: Couldn't check if %s is a directory.", input_filepath);
+    if (CSortPipeline_start(&pipeline, &csort) < 0) {
         CSort_deinit(&csort);
         exit(1);
     }
+    csort.on_panic = CSortDrainPipeline;
 
-    if (! success) {
-        CSortEntity entity = CSortEntity_mk(&csort, input_filepath);
-        CSortEntity_do(&entity);
-        CSortEntity_deinit(&entity);
-    } else {
-        if (csort.conf.cmd_options.recursive_apply) {
-            CSortPerformOnFileCallbackRecur(&csort, input_filepath, CSortHandlePyFile);
-        } else {
-            CSortPerformOnFileCallback(&csort, input_filepath, CSortHandlePyFile);
+    // one config and one set of workers for all of them, overlaps are only sorted once
+    const u32 sources = roots.len + (files_from ? 1 : 0);
+    if (sources > 1) {
+        CSortInodeSet_init(&csort.seen);
+    }
+    FOR (i, roots.len) {
+        CSortSortRoot(&csort, *(char**) DynArray_get(&roots, i), sources == 1);
+    }
+    DynArray_free(&roots);
+
+    if (files_from) {
+        FILE* fp = DEV_strIsEq(files_from, "-") ? stdin : fopen(files_from, "r");
+        if (! fp) {
+            log_error("csort: Could not open: %s: %s", files_from, strerror(errno));
+            CSortExit(&csort);
         }
+        CSortPerformOnFilesFrom(&csort, fp, CSortHandlePyFile);
+        if (fp != stdin) fclose(fp);
+    }
+
+    csort.on_panic = NULL;
+    const u32 failures = CSortPipeline_finish(&pipeline);
+    if (failures) {
+        log_error("csort: %u of %u files could not be sorted", failures, pipeline.files);
     }
 
+    if (csort.conf.cmd_options.print_stats) {
+        CSortStats_thread_end();
+        CSortStats_print(stderr);
+    }
+    if (csort.conf.cmd_options.print_mem_stats) {
+        CSortMemStats_print(stderr);
+    }
+    if (csort_trace_enabled) {
+        CSortTrace_write(csort.conf.cmd_options.trace_file);
+    }
     CSort_deinit(&csort);
-    return 0;
+    return failures ? 1 : 0;
 }
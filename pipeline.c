@@ -0,0 +1,362 @@
+#define _GNU_SOURCE
+#include "pipeline.h"
+
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+
+// --------------------------------------------------------------------------------------------
+// ~Queue
+void
+CSortQueue_init(CSortQueue* queue, u32 cap) {
+    assert(cap && (cap & (cap - 1)) == 0);
+    *queue = (CSortQueue) {0};
+    queue->slots = (void**) DEV_malloc(cap, sizeof(void*));
+    queue->cap = cap;
+    pthread_mutex_init(&queue->lock, NULL);
+    pthread_cond_init(&queue->wake, NULL);
+}
+
+void
+CSortQueue_free(CSortQueue* queue) {
+    free(queue->slots);
+    pthread_mutex_destroy(&queue->lock);
+    pthread_cond_destroy(&queue->wake);
+    *queue = (CSortQueue) {0};
+}
+
+// The waiting side sets #sleeping before it checks the ring again, the other side moves its
+// index before it takes #sleeping back, both in one total order, so either the waiter sees
+// the move or the mover sees the waiter. Taking it back means a waiter is only woken once,
+// not once for every item pushed before it gets to run.
+internal void
+_queue_wake(CSortQueue* queue) {
+    if (__atomic_exchange_n(&queue->sleeping, false, __ATOMIC_SEQ_CST)) {
+        pthread_mutex_lock(&queue->lock);
+        pthread_cond_broadcast(&queue->wake);
+        pthread_mutex_unlock(&queue->lock);
+    }
+}
+
+// waits for room when the ring is full
+void
+CSortQueue_push(CSortQueue* queue, void* item) {
+    const u32 tail = queue->tail;
+    if (tail - __atomic_load_n(&queue->head, __ATOMIC_ACQUIRE) == queue->cap) {
+        pthread_mutex_lock(&queue->lock);
+        for (;;) {
+            __atomic_store_n(&queue->sleeping, true, __ATOMIC_SEQ_CST);
+            if (tail - __atomic_load_n(&queue->head, __ATOMIC_SEQ_CST) != queue->cap) break;
+            pthread_cond_wait(&queue->wake, &queue->lock);
+        }
+        pthread_mutex_unlock(&queue->lock);
+    }
+
+    queue->slots[tail & (queue->cap - 1)] = item;
+    __atomic_store_n(&queue->tail, tail + 1, __ATOMIC_SEQ_CST);
+    _queue_wake(queue);
+}
+
+// waits for an item when the ring is empty, false once it's closed and drained
+bool
+CSortQueue_pop(CSortQueue* queue, void** item) {
+    const u32 head = queue->head;
+    if (head == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE)) {
+        pthread_mutex_lock(&queue->lock);
+        for (;;) {
+            __atomic_store_n(&queue->sleeping, true, __ATOMIC_SEQ_CST);
+            if (head != __atomic_load_n(&queue->tail, __ATOMIC_SEQ_CST) ||
+                __atomic_load_n(&queue->closed, __ATOMIC_SEQ_CST)) break;
+            pthread_cond_wait(&queue->wake, &queue->lock);
+        }
+        pthread_mutex_unlock(&queue->lock);
+        if (head == __atomic_load_n(&queue->tail, __ATOMIC_ACQUIRE)) {
+            return false;
+        }
+    }
+
+    *item = queue->slots[head & (queue->cap - 1)];
+    __atomic_store_n(&queue->head, head + 1, __ATOMIC_SEQ_CST);
+    _queue_wake(queue);
+    return true;
+}
+
+// the producer is done, the consumer gets what's left and then false
+void
+CSortQueue_close(CSortQueue* queue) {
+    pthread_mutex_lock(&queue->lock);
+    __atomic_store_n(&queue->closed, true, __ATOMIC_SEQ_CST);
+    pthread_cond_broadcast(&queue->wake);
+    pthread_mutex_unlock(&queue->lock);
+}
+
+
+
+// --------------------------------------------------------------------------------------------
+// ~Budget
+//
+// Reserved bytes the pipeline holds, the walk's own since the pipeline started and each
+// stage's as it last told, with #budget_lock. A thread frees what another one allocated
+// (sources, outputs), so only the sum means anything.
+internal u64
+_held(const CSortPipeline* pipe) {
+    i64 held = csort_mem_stats.live - pipe->walk_base;
+    FOR (i, CSortPipeStage_COUNT) {
+        held += pipe->held[i];
+    }
+    return held > 0 ? (u64) held : 0;
+}
+
+// waits until #file, of #size bytes, fits next to what's held and estimated and charges it
+internal void
+_charge(CSortPipeline* pipe, CSortPipeFile* file, u64 size) {
+    if (! pipe->budget) {
+        return;
+    }
+    u64 estimate = size * CSortPipeline_byte_cost;
+    file->stream = estimate > pipe->budget / CSortPipeline_stream_share;
+    if (file->stream) {
+        // nothing else is let in until it's sorted
+        estimate = pipe->budget;
+    }
+    const u64 cost = CSortPipeline_file_cost + estimate;
+
+    pthread_mutex_lock(&pipe->budget_lock);
+    // with nothing in flight anything is let in, else a file larger than the budget never is
+    while (pipe->queued && _held(pipe) + pipe->estimated + cost > pipe->budget) {
+        pthread_cond_wait(&pipe->budget_freed, &pipe->budget_lock);
+    }
+    pipe->estimated += cost;
+    pipe->queued += 1;
+    pthread_mutex_unlock(&pipe->budget_lock);
+    file->cost = cost;
+}
+
+// #stage's thread tells the walk what it holds now and gives back #release of the estimates,
+// once the counters have what it stood for
+internal void
+_account(CSortPipeline* pipe, enum CSortPipeStage stage, u64 release, bool printed) {
+    if (! pipe->budget) {
+        return;
+    }
+    pthread_mutex_lock(&pipe->budget_lock);
+    pipe->held[stage] = csort_mem_stats.live;
+    pipe->estimated -= release;
+    if (printed) pipe->queued -= 1;
+    pthread_cond_broadcast(&pipe->budget_freed);
+    pthread_mutex_unlock(&pipe->budget_lock);
+}
+
+
+
+// --------------------------------------------------------------------------------------------
+// ~Stages
+// the source is gone by then, the sort stage frees it as soon as it's sorted
+internal void
+_file_free(CSortPipeFile* file) {
+    string_free(&file->output);
+    free(file->path);
+    free(file);
+}
+
+// the thread's stats go back to the pipeline when its stage is done
+internal void
+_stage_done(CSortPipeline* pipe, enum CSortPipeStage stage) {
+    CSortStats_thread_end();
+    pipe->stats[stage] = csort_stats;
+    pipe->mem_stats[stage] = csort_mem_stats;
+}
+
+internal void*
+_read_stage(void* arg) {
+    CSortPipeline* pipe = arg;
+    CSortPipeFile* file;
+    while (CSortQueue_pop(&pipe->to_read, (void**) &file)) {
+        CSortStats_begin(CSortPhase_Read);
+        CSortTrace_begin("read", file->path);
+        // a streamed file is read by the sort stage, as it goes
+        if (file->fd < 0 || (! file->stream && string_from_fd(&file->source, file->fd) < 0)) {
+            snprintf(file->error, CSort_error_len, "error: could not read: %s: %s",
+                     file->path, strerror(file->fd < 0 ? file->open_errno : errno));
+            file->status = CSortStatus_IOError;
+        }
+        CSortTrace_end();
+        CSortStats_end();
+        if (file->fd >= 0 && ! file->stream) {
+            close(file->fd);
+            file->fd = -1;
+        }
+        _account(pipe, CSortPipeStage_Read, 0, false);
+        CSortQueue_push(&pipe->to_sort, file);
+    }
+    CSortQueue_close(&pipe->to_sort);
+    _stage_done(pipe, CSortPipeStage_Read);
+    return NULL;
+}
+
+internal void*
+_sort_stage(void* arg) {
+    CSortPipeline* pipe = arg;
+    CSortWorker worker = CSortWorker_mk();
+    CSortPipeFile* file;
+    while (CSortQueue_pop(&pipe->to_sort, (void**) &file)) {
+        if (file->status == CSortStatus_Ok) {
+            CSortMemStats_file_begin();
+            CSortTrace_begin("file", file->path);
+            CSortEntity entity = CSortEntity_mk_w_buffer(pipe->csort, &worker, file->path,
+                                                         file->source.data, file->source.len);
+            entity.conf = file->conf;
+            if (CSortEntity_do(&entity, file->stream ? file->fd : -1) != CSortStatus_Ok) {
+                file->status = entity.status;
+                memcpy(file->error, worker.error, CSort_error_len);
+            } else {
+                // the result leaves with the file, the worker keeps the file's empty string
+                const String output = worker.output;
+                worker.output = file->output;
+                file->output = output;
+            }
+            CSortEntity_deinit(&entity);
+            CSortTrace_end();
+            CSortMemStats_file_end(file->path);
+        }
+        string_free(&file->source);
+        if (file->fd >= 0) {
+            close(file->fd);
+            file->fd = -1;
+        }
+        if (file->stream) {
+            // what it grew would hold back every file after it
+            CSortWorker_free(&worker);
+            worker = CSortWorker_mk();
+        }
+        // the counters have its output and the worker's scratch now, only its record is estimated
+        _account(pipe, CSortPipeStage_Sort, file->cost - (file->cost ? CSortPipeline_file_cost : 0), false);
+        file->cost = file->cost ? CSortPipeline_file_cost : 0;
+        CSortQueue_push(&pipe->to_write, file);
+    }
+    CSortQueue_close(&pipe->to_write);
+    CSortWorker_free(&worker);
+    _stage_done(pipe, CSortPipeStage_Sort);
+    return NULL;
+}
+
+internal void*
+_write_stage(void* arg) {
+    CSortPipeline* pipe = arg;
+    CSortPipeFile* file;
+    while (CSortQueue_pop(&pipe->to_write, (void**) &file)) {
+        CSortStats_begin(CSortPhase_Emit);
+        if (file->header) {
+            println("\033[1;31m%s:\033[0m", file->path);
+        }
+        pipe->files += 1;
+        if (file->status != CSortStatus_Ok) {
+            // the worker was reset after it, the files after it are sorted as usual
+            if (file->status == CSortStatus_IOError) {
+                eprintln("csort: %s", file->error);
+            } else eprintln("csort: %s:%s", file->path, file->error);
+            pipe->failures += 1;
+            CSortStats_count(files_failed, 1);
+        } else {
+            fwrite(file->output.data, 1, file->output.len, stdout);
+            if (file->header) println("");
+        }
+        CSortStats_end();
+        const u64 cost = file->cost;
+        _file_free(file);
+        _account(pipe, CSortPipeStage_Write, cost, true);
+    }
+    _stage_done(pipe, CSortPipeStage_Write);
+    return NULL;
+}
+
+
+
+// --------------------------------------------------------------------------------------------
+// ~Pipeline
+varGlobal void* (*stage_main[CSortPipeStage_COUNT])(void*) = {
+    _read_stage,
+    _sort_stage,
+    _write_stage,
+};
+
+internal void
+_pipeline_free(CSortPipeline* pipe) {
+    CSortQueue_free(&pipe->to_read);
+    CSortQueue_free(&pipe->to_sort);
+    CSortQueue_free(&pipe->to_write);
+    pthread_mutex_destroy(&pipe->budget_lock);
+    pthread_cond_destroy(&pipe->budget_freed);
+}
+
+int
+CSortPipeline_start(CSortPipeline* pipe, CSort* csort) {
+    *pipe = (CSortPipeline) {0};
+    pipe->csort = csort;
+    pipe->budget = csort->conf.cmd_options.max_memory_bytes;
+    pipe->walk_base = csort_mem_stats.live;
+    pthread_mutex_init(&pipe->budget_lock, NULL);
+    pthread_cond_init(&pipe->budget_freed, NULL);
+    CSortQueue_init(&pipe->to_read, CSortPipeline_to_read_cap);
+    CSortQueue_init(&pipe->to_sort, CSortPipeline_to_sort_cap);
+    CSortQueue_init(&pipe->to_write, CSortPipeline_to_write_cap);
+    FOR (i, CSortPipeStage_COUNT) {
+        const int err = pthread_create(&pipe->threads[i], NULL, stage_main[i], pipe);
+        if (err) {
+            log_error("csort: could not start the pipeline: %s", strerror(err));
+            // the stages already running see their queue closed and empty, and end
+            CSortQueue_close(&pipe->to_read);
+            FOR (j, i) {
+                pthread_join(pipe->threads[j], NULL);
+            }
+            _pipeline_free(pipe);
+            return -1;
+        }
+    }
+    pipe->running = true;
+    return 0;
+}
+
+// queues #path, to be sorted with #conf
+void
+CSortPipeline_add(CSortPipeline* pipe, const char* path, const CSortConfig* conf, bool header) {
+    CSortPipeFile* file = (CSortPipeFile*) DEV_malloc(1, sizeof(CSortPipeFile));
+    *file = (CSortPipeFile) {
+        .path = strdup(path),
+        .conf = conf,
+        .header = header,
+        .source = string("", 0),
+        .output = string("", 0),
+        .status = CSortStatus_Ok,
+    };
+    file->fd = open(path, O_RDONLY | O_CLOEXEC);
+    if (file->fd < 0) {
+        file->open_errno = errno;
+    }
+
+    struct stat st;
+    _charge(pipe, file, (file->fd >= 0 && fstat(file->fd, &st) == 0 && st.st_size > 0) ? (u64) st.st_size : 0);
+    // so the kernel reads it in while the files queued before it are sorted
+    if (file->fd >= 0) {
+        posix_fadvise(file->fd, 0, 0, POSIX_FADV_WILLNEED);
+    }
+    CSortQueue_push(&pipe->to_read, file);
+}
+
+// waits for every queued file to be printed, returns how many of them failed
+u32
+CSortPipeline_finish(CSortPipeline* pipe) {
+    if (! pipe->running) {
+        return 0;
+    }
+    CSortQueue_close(&pipe->to_read);
+    FOR (i, CSortPipeStage_COUNT) {
+        pthread_join(pipe->threads[i], NULL);
+        CSortStats_merge(&pipe->stats[i]);
+        CSortMemStats_merge(&pipe->mem_stats[i]);
+    }
+    fflush(stdout);
+    _pipeline_free(pipe);
+    pipe->running = false;
+    return pipe->failures;
+}
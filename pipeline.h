@@ -0,0 +1,127 @@
+#ifndef __PIPELINE_H__
+#define __PIPELINE_H__
+
+#include "csort.h"
+
+#include <pthread.h>
+
+// --------------------------------------------------------------------------------------------
+//
+// Sorting pipeline of the CLI
+//
+// The walk hands files to a chain of stages, each on a thread of its own:
+//
+//   walk (caller)  opens the file and asks the kernel to read it ahead
+//   read           reads it into memory
+//   sort           tokenizes, parses and sorts it, with a worker of its own
+//   write          prints the result, in the order the walk found the files
+//
+// so reading the next files overlaps sorting this one. Stages are linked by bounded queues,
+// a stage that gets ahead of the next one waits for room, so no more than the queues hold
+// is ever in flight, whatever the size of the tree.
+//
+// A file that can't be read or parsed is reported by the write stage, in its place in the
+// output, and counted, the sort stage's worker is reset after it like after any other file,
+// so the rest of the run goes on.
+//
+// With `--max-memory` the walk waits while the next file doesn't fit, which holds back
+// reading too, as only queued files are read. What the stages hold, sources, the worker's
+// arena and scratch, outputs waiting to be printed, comes from the reserved bytes of
+// #CSortMemStats, each stage's thread tells it after every file. What a file will need
+// before it's sorted is estimated from its size, charged when it's queued and given back
+// once it's sorted and the counters have it. Records and paths aren't in the counters,
+// each file is charged #CSortPipeline_file_cost for them until it's printed.
+//
+// A file estimated over a quarter of the budget is streamed: it waits for everything
+// before it to be printed and nothing is queued after it until it's sorted, and the sort
+// stage reads it from its fd into the lexer a chunk at a time, never holding all of it.
+// The worker's scratch is freed after it.
+//
+// --------------------------------------------------------------------------------------------
+#define CSortPipeline_to_read_cap 64                    // open fds the walk is ahead by
+#define CSortPipeline_to_sort_cap 16                    // sources read but not sorted
+#define CSortPipeline_to_write_cap 64                   // results not printed yet
+
+#define CSortPipeline_file_cost 4096                    // record and path, which the counters miss
+#define CSortPipeline_byte_cost 8                       // source, tokens, arena and output per byte, until sorted
+#define CSortPipeline_stream_share 4                    // files estimated over 1 / this of the budget are streamed
+
+// --------------------------------------------------------------------------------------------
+// ~Queue
+//
+// Single producer, single consumer ring. The indexes only grow and are taken modulo #cap, a
+// power of two, each side only writes its own, so neither takes a lock while the ring is
+// neither full nor empty. A side that has to wait sleeps on #wake, the other side only
+// takes #lock to wake it up when #sleeping says someone is there.
+typedef struct CSortQueue CSortQueue;
+struct CSortQueue {
+    u32 tail;                                           // producer's
+    u8 tail_pad[60];
+    u32 head;                                           // consumer's
+    u8 head_pad[60];
+
+    void** slots;
+    u32 cap;
+    bool sleeping;
+    bool closed;
+    pthread_mutex_t lock;
+    pthread_cond_t wake;
+};
+
+extern void CSortQueue_init(CSortQueue* queue, u32 cap);
+extern void CSortQueue_free(CSortQueue* queue);
+extern void CSortQueue_push(CSortQueue* queue, void* item);
+extern bool CSortQueue_pop(CSortQueue* queue, void** item);
+extern void CSortQueue_close(CSortQueue* queue);
+
+
+// --------------------------------------------------------------------------------------------
+// ~Pipeline
+typedef struct CSortPipeFile CSortPipeFile;
+struct CSortPipeFile {
+    char* path;
+    const CSortConfig* conf;
+    bool header;                                        // print the path above it
+    int fd, open_errno;
+    String source;
+    String output;
+    u64 cost;                                           // estimated against the budget, 0 without one
+    bool stream;                                        // sorted from #fd, with nothing else in flight
+    enum CSortStatus status;
+    char error[CSort_error_len];
+};
+
+enum CSortPipeStage {
+    CSortPipeStage_Read,
+    CSortPipeStage_Sort,
+    CSortPipeStage_Write,
+    CSortPipeStage_COUNT,
+};
+
+typedef struct CSortPipeline CSortPipeline;
+struct CSortPipeline {
+    CSort* csort;
+    CSortQueue to_read, to_sort, to_write;
+    pthread_t threads[CSortPipeStage_COUNT];
+    bool running;
+    u32 files, failures;                                // printed so far, by the write stage
+
+    // --max-memory, held is what the counters say, #estimated what they don't have yet
+    u64 budget;                                         // 0 for no limit
+    u64 estimated;
+    u32 queued;                                         // files not printed yet
+    i64 walk_base;                                      // the walk's live bytes before the run
+    i64 held[CSortPipeStage_COUNT];                     // each stage's live bytes, after its last file
+    pthread_mutex_t budget_lock;
+    pthread_cond_t budget_freed;
+
+    // what each stage's thread counted, merged into the caller's by #CSortPipeline_finish
+    CSortStats stats[CSortPipeStage_COUNT];
+    CSortMemStats mem_stats[CSortPipeStage_COUNT];
+};
+
+extern int CSortPipeline_start(CSortPipeline* pipe, CSort* csort);
+extern void CSortPipeline_add(CSortPipeline* pipe, const char* path, const CSortConfig* conf, bool header);
+extern u32 CSortPipeline_finish(CSortPipeline* pipe);
+
+#endif
@@ -0,0 +1,457 @@
+#define PY_SSIZE_T_CLEAN
+#include <Python.h>
+
+#include "../csort.h"
+
+#include <pthread.h>
+#include <unistd.h>
+
+
+// --------------------------------------------------------------------------------------------
+//
+// `import csort`, sorts in process instead of spawning csort per file
+//
+// A #CSortPyConfig holds the settings, loaded once, and the workers sorting with them.
+// Sorting runs with the GIL released, every thread on a worker of its own taken from
+// #idle, so the settings are only read while sorting and are shared by all of them.
+//
+// --------------------------------------------------------------------------------------------
+typedef struct CSortPyConfig CSortPyConfig;
+struct CSortPyConfig {
+    PyObject_HEAD
+    CSort csort;
+    bool loaded;
+    pthread_mutex_t lock;
+    DynArray idle;                                      // CSortWorker*, not used by any thread
+};
+
+varGlobal PyTypeObject CSortPyConfig_type;
+varGlobal PyObject* csort_py_error = NULL;
+varGlobal CSortPyConfig* csort_py_default_config = NULL;
+
+
+internal CSortWorker*
+CSortPyConfig_take_worker(CSortPyConfig* self) {
+    CSortWorker* worker = NULL;
+    pthread_mutex_lock(&self->lock);
+    if (self->idle.len) {
+        worker = *(CSortWorker**) DynArray_get(&self->idle, self->idle.len - 1);
+        DynArray_pop(&self->idle);
+    }
+    pthread_mutex_unlock(&self->lock);
+
+    if (! worker) {
+        worker = malloc(sizeof(CSortWorker));
+        if (! worker) return NULL;
+        *worker = CSortWorker_mk();
+    }
+    return worker;
+}
+
+internal void
+CSortPyConfig_give_worker(CSortPyConfig* self, CSortWorker* worker) {
+    CSortWorker_reset(worker);
+    pthread_mutex_lock(&self->lock);
+    DynArray_push(&self->idle, &worker);
+    pthread_mutex_unlock(&self->lock);
+}
+
+
+internal PyObject*
+CSortPyConfig_new(PyTypeObject* type, PyObject* args, PyObject* kwargs) {
+    CSortPyConfig* self = (CSortPyConfig*) type->tp_alloc(type, 0);
+    if (! self) return NULL;
+
+    self->csort = CSort_mk();
+    self->loaded = false;
+    pthread_mutex_init(&self->lock, NULL);
+    self->idle = DynArray_mk(sizeof(CSortWorker*));
+    return (PyObject*) self;
+}
+
+// Config(path=None), settings from a .csortconfig at #path, defaults without one
+internal int
+CSortPyConfig_init(CSortPyConfig* self, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"path", NULL};
+    PyObject* path = NULL;
+    if (! PyArg_ParseTupleAndKeywords(args, kwargs, "|O&:Config", kwlist, PyUnicode_FSConverter, &path)) {
+        return -1;
+    }
+
+    if (self->loaded) {
+        Py_XDECREF(path);
+        PyErr_SetString(PyExc_RuntimeError, "csort.Config is already initialized");
+        return -1;
+    }
+
+    const int loaded = CSort_try_init_config(&self->csort, path ? PyBytes_AS_STRING(path) : NULL);
+    Py_XDECREF(path);
+    // #CSortConfig has to be freed even if loading it failed half way
+    self->loaded = true;
+    if (loaded < 0) {
+        PyErr_SetString(csort_py_error, self->csort.error);
+        return -1;
+    }
+    return 0;
+}
+
+internal void
+CSortPyConfig_dealloc(CSortPyConfig* self) {
+    FOR (i, self->idle.len) {
+        CSortWorker* worker = *(CSortWorker**) DynArray_get(&self->idle, i);
+        CSortWorker_free(worker);
+        free(worker);
+    }
+    DynArray_free(&self->idle);
+    pthread_mutex_destroy(&self->lock);
+
+    if (self->loaded) {
+        CSort_deinit(&self->csort);
+    } else {
+        CSortMemArena_free(&self->csort.arena);
+        CSortWorker_free(&self->csort.worker);
+    }
+    Py_TYPE(self)->tp_free((PyObject*) self);
+}
+
+// #config, or the default settings loaded on first use
+internal CSortPyConfig*
+_py_config_or_default(PyObject* config) {
+    if (config && config != Py_None) {
+        if (! PyObject_TypeCheck(config, &CSortPyConfig_type)) {
+            PyErr_SetString(PyExc_TypeError, "config must be a csort.Config");
+            return NULL;
+        }
+
+        CSortPyConfig* conf = (CSortPyConfig*) config;
+        if (! conf->loaded) {
+            PyErr_SetString(PyExc_RuntimeError, "csort.Config is not initialized");
+            return NULL;
+        }
+        return conf;
+    }
+
+    if (! csort_py_default_config) {
+        csort_py_default_config = (CSortPyConfig*) PyObject_CallNoArgs((PyObject*) &CSortPyConfig_type);
+    }
+    return csort_py_default_config;
+}
+
+
+
+// --------------------------------------------------------------------------------------------
+// ~sort_source
+internal PyObject*
+csort_py_sort_source(PyObject* module, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"source", "config", NULL};
+    const char* source;
+    Py_ssize_t source_len;
+    PyObject* config = NULL;
+    if (! PyArg_ParseTupleAndKeywords(args, kwargs, "s#|O:sort_source", kwlist, &source, &source_len, &config)) {
+        return NULL;
+    }
+    if ((size_t) source_len > UINT32_MAX) {
+        PyErr_SetString(PyExc_ValueError, "source is too large");
+        return NULL;
+    }
+
+    CSortPyConfig* conf = _py_config_or_default(config);
+    if (! conf) return NULL;
+    CSortWorker* worker = CSortPyConfig_take_worker(conf);
+    if (! worker) return PyErr_NoMemory();
+
+    enum CSortStatus status;
+    Py_BEGIN_ALLOW_THREADS
+    status = CSortWorker_sort(worker, &conf->csort, "<string>", (char*) source, (u32) source_len, NULL);
+    Py_END_ALLOW_THREADS
+
+    PyObject* result = NULL;
+    if (status == CSortStatus_Ok) {
+        result = PyUnicode_FromStringAndSize(worker->output.data, worker->output.len);
+    } else {
+        PyErr_SetString(csort_py_error, worker->error);
+    }
+    CSortPyConfig_give_worker(conf, worker);
+    return result;
+}
+
+
+
+// --------------------------------------------------------------------------------------------
+// ~paths
+//
+// #sort_paths and #check convert every path while holding the GIL, then sort all of them
+// on #jobs threads without it, results are copied out of the workers before they're given back.
+typedef struct CSortPyItem CSortPyItem;
+struct CSortPyItem {
+    const char* path;
+    enum CSortStatus status;
+    bool is_sorted;
+    char* text;                                         // sorted imports, or the error
+    u32 text_len;
+};
+
+typedef struct CSortPyRun CSortPyRun;
+struct CSortPyRun {
+    CSortPyConfig* conf;
+    CSortPyItem* items;
+    u32 items_len;
+    u32 next;                                           // next item to be taken, atomic
+    bool check;                                         // only #is_sorted is wanted
+};
+
+internal void
+_py_item_keep(CSortPyItem* item, const char* text, u32 len) {
+    item->text = malloc(len + 1);
+    if (! item->text) return;
+    memcpy(item->text, text, len);
+    item->text[len] = '\0';
+    item->text_len = len;
+}
+
+internal void*
+_py_run_worker(void* arg) {
+    CSortPyRun* run = arg;
+    CSortWorker* worker = CSortPyConfig_take_worker(run->conf);
+
+    for (;;) {
+        const u32 i = __atomic_fetch_add(&run->next, 1, __ATOMIC_RELAXED);
+        if (i >= run->items_len) break;
+
+        CSortPyItem* item = &run->items[i];
+        if (! worker) {
+            item->status = CSortStatus_IOError;
+            _py_item_keep(item, "out of memory", strlen("out of memory"));
+            continue;
+        }
+
+        item->status = CSortWorker_read_file(worker, item->path);
+        if (item->status == CSortStatus_Ok) {
+            item->status = CSortWorker_sort(worker, &run->conf->csort, item->path,
+                    worker->source.data, worker->source.len, &item->is_sorted);
+        }
+
+        if (item->status != CSortStatus_Ok) {
+            _py_item_keep(item, worker->error, strlen(worker->error));
+        } else if (! run->check) {
+            _py_item_keep(item, worker->output.data, worker->output.len);
+        }
+        CSortWorker_reset(worker);
+    }
+
+    if (worker) CSortPyConfig_give_worker(run->conf, worker);
+    return NULL;
+}
+
+internal void
+_py_run(CSortPyRun* run, Py_ssize_t jobs) {
+    if (jobs <= 0) jobs = sysconf(_SC_NPROCESSORS_ONLN);
+    if (jobs > run->items_len) jobs = run->items_len;
+    if (jobs < 1) jobs = 1;
+
+    pthread_t* threads = malloc(sizeof(pthread_t) * jobs);
+    Py_ssize_t spawned = 0;
+    // the calling thread is one of the #jobs, fewer threads if we can't spawn them all
+    while (threads && spawned < jobs - 1 && pthread_create(&threads[spawned], NULL, _py_run_worker, run) == 0) {
+        ++spawned;
+    }
+    _py_run_worker(run);
+    FOR (i, spawned) {
+        pthread_join(threads[i], NULL);
+    }
+    free(threads);
+}
+
+// converts #paths into #CSortPyRun::items, #bytes keeps what they point to alive
+internal int
+_py_run_mk(CSortPyRun* run, PyObject* paths, PyObject* config, PyObject** bytes) {
+    *run = (CSortPyRun) {0};
+    run->conf = _py_config_or_default(config);
+    if (! run->conf) return -1;
+
+    PyObject* seq = PySequence_Fast(paths, "paths must be an iterable of paths");
+    if (! seq) return -1;
+    const Py_ssize_t len = PySequence_Fast_GET_SIZE(seq);
+    *bytes = PyList_New(len);
+    run->items = calloc(len ? len : 1, sizeof(CSortPyItem));
+    if (! *bytes || ! run->items) {
+        Py_DECREF(seq);
+        if (*bytes) PyErr_NoMemory();
+        return -1;
+    }
+
+    for (Py_ssize_t i = 0; i < len; ++i) {
+        PyObject* path = NULL;
+        if (! PyUnicode_FSConverter(PySequence_Fast_GET_ITEM(seq, i), &path)) {
+            Py_DECREF(seq);
+            return -1;
+        }
+        PyList_SET_ITEM(*bytes, i, path);
+        run->items[i].path = PyBytes_AS_STRING(path);
+    }
+    run->items_len = (u32) len;
+    Py_DECREF(seq);
+    return 0;
+}
+
+internal void
+_py_run_free(CSortPyRun* run) {
+    if (! run->items) return;
+    FOR (i, run->items_len) {
+        free(run->items[i].text);
+    }
+    free(run->items);
+}
+
+internal PyObject*
+_py_item_error(const CSortPyItem* item) {
+    return PyObject_CallFunction(csort_py_error, "ss", item->path, item->text ? item->text : "");
+}
+
+
+// sort_paths(paths, jobs=1, config=None), sorted imports of every file, a csort.Error
+// in place of the files which failed
+internal PyObject*
+csort_py_sort_paths(PyObject* module, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"paths", "jobs", "config", NULL};
+    PyObject* paths;
+    Py_ssize_t jobs = 1;
+    PyObject* config = NULL;
+    if (! PyArg_ParseTupleAndKeywords(args, kwargs, "O|nO:sort_paths", kwlist, &paths, &jobs, &config)) {
+        return NULL;
+    }
+
+    CSortPyRun run;
+    PyObject* bytes = NULL;
+    PyObject* result = NULL;
+    if (_py_run_mk(&run, paths, config, &bytes) < 0) goto done;
+
+    Py_BEGIN_ALLOW_THREADS
+    _py_run(&run, jobs);
+    Py_END_ALLOW_THREADS
+
+    result = PyList_New(run.items_len);
+    if (! result) goto done;
+    FOR (i, run.items_len) {
+        const CSortPyItem* item = &run.items[i];
+        PyObject* value = (item->status == CSortStatus_Ok)
+            ? PyUnicode_FromStringAndSize(item->text ? item->text : "", item->text_len)
+            : _py_item_error(item);
+        if (! value) {
+            Py_CLEAR(result);
+            goto done;
+        }
+        PyList_SET_ITEM(result, i, value);
+    }
+
+done:
+    _py_run_free(&run);
+    Py_XDECREF(bytes);
+    return result;
+}
+
+
+// check(paths, jobs=1, config=None), paths whose imports sorting would change
+internal PyObject*
+csort_py_check(PyObject* module, PyObject* args, PyObject* kwargs) {
+    static char* kwlist[] = {"paths", "jobs", "config", NULL};
+    PyObject* paths;
+    Py_ssize_t jobs = 1;
+    PyObject* config = NULL;
+    if (! PyArg_ParseTupleAndKeywords(args, kwargs, "O|nO:check", kwlist, &paths, &jobs, &config)) {
+        return NULL;
+    }
+
+    CSortPyRun run;
+    PyObject* bytes = NULL;
+    PyObject* result = NULL;
+    if (_py_run_mk(&run, paths, config, &bytes) < 0) goto done;
+    run.check = true;
+
+    Py_BEGIN_ALLOW_THREADS
+    _py_run(&run, jobs);
+    Py_END_ALLOW_THREADS
+
+    // the first failed file is raised, a partial answer would read as "sorted"
+    FOR (i, run.items_len) {
+        const CSortPyItem* item = &run.items[i];
+        if (item->status != CSortStatus_Ok) {
+            PyObject* error = _py_item_error(item);
+            if (error) {
+                PyErr_SetObject(csort_py_error, error);
+                Py_DECREF(error);
+            }
+            goto done;
+        }
+    }
+
+    result = PyList_New(0);
+    if (! result) goto done;
+    FOR (i, run.items_len) {
+        if (run.items[i].is_sorted) continue;
+        PyObject* path = PyUnicode_DecodeFSDefault(run.items[i].path);
+        if (! path || PyList_Append(result, path) < 0) {
+            Py_XDECREF(path);
+            Py_CLEAR(result);
+            goto done;
+        }
+        Py_DECREF(path);
+    }
+
+done:
+    _py_run_free(&run);
+    Py_XDECREF(bytes);
+    return result;
+}
+
+
+
+// --------------------------------------------------------------------------------------------
+// ~module
+varGlobal PyTypeObject CSortPyConfig_type = {
+    PyVarObject_HEAD_INIT(NULL, 0)
+    .tp_name = "csort.Config",
+    .tp_doc = "Config(path=None)\n\nSettings from a .csortconfig, the defaults without one.",
+    .tp_basicsize = sizeof(CSortPyConfig),
+    .tp_flags = Py_TPFLAGS_DEFAULT,
+    .tp_new = CSortPyConfig_new,
+    .tp_init = (initproc) CSortPyConfig_init,
+    .tp_dealloc = (destructor) CSortPyConfig_dealloc,
+};
+
+varGlobal PyMethodDef csort_py_methods[] = {
+    {"sort_source", (PyCFunction)(void(*)(void)) csort_py_sort_source, METH_VARARGS | METH_KEYWORDS,
+        "sort_source(source, config=None) -> str\n\nSorted import statements of source."},
+    {"sort_paths", (PyCFunction)(void(*)(void)) csort_py_sort_paths, METH_VARARGS | METH_KEYWORDS,
+        "sort_paths(paths, jobs=1, config=None) -> list\n\n"
+        "Sorted import statements of every file, in order, a csort.Error for files which failed.\n"
+        "jobs <= 0 uses a thread per cpu."},
+    {"check", (PyCFunction)(void(*)(void)) csort_py_check, METH_VARARGS | METH_KEYWORDS,
+        "check(paths, jobs=1, config=None) -> list\n\n"
+        "Paths whose import statements sorting would change, raises csort.Error if a file fails."},
+    {NULL, NULL, 0, NULL},
+};
+
+varGlobal PyModuleDef csort_py_module = {
+    PyModuleDef_HEAD_INIT,
+    .m_name = "csort",
+    .m_doc = "Sorts python imports in process, see csort(1).",
+    .m_size = -1,
+    .m_methods = csort_py_methods,
+};
+
+PyMODINIT_FUNC
+PyInit_csort(void) {
+    if (PyType_Ready(&CSortPyConfig_type) < 0) return NULL;
+
+    PyObject* module = PyModule_Create(&csort_py_module);
+    if (! module) return NULL;
+
+    csort_py_error = PyErr_NewException("csort.Error", NULL, NULL);
+    if (PyModule_AddObjectRef(module, "Error", csort_py_error) < 0
+            || PyModule_AddObjectRef(module, "Config", (PyObject*) &CSortPyConfig_type) < 0) {
+        Py_DECREF(module);
+        return NULL;
+    }
+    return module;
+}
@@ -0,0 +1,273 @@
+#define _GNU_SOURCE
+#include "stats.h"
+
+#include <time.h>
+#include <assert.h>
+#include <errno.h>
+#include <string.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+
+__thread CSortStats csort_stats = {0};
+bool csort_stats_enabled = false;
+bool csort_perf_enabled = false;
+
+varGlobal const char* phase_names[CSortPhase_COUNT] = {
+    "traverse",
+    "read",
+    "tokenize",
+    "parse",
+    "sort",
+    "emit",
+};
+
+varGlobal const struct {
+    const char* name;
+    u32 type;
+    u64 config;
+} perf_events[CSortPerf_COUNT] = {
+    {"cycles", PERF_TYPE_HARDWARE, PERF_COUNT_HW_CPU_CYCLES},
+    {"instructions", PERF_TYPE_HARDWARE, PERF_COUNT_HW_INSTRUCTIONS},
+    {"branch-miss", PERF_TYPE_HARDWARE, PERF_COUNT_HW_BRANCH_MISSES},
+    {"L1d-miss", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_L1D | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+    {"LLC-miss", PERF_TYPE_HW_CACHE, PERF_COUNT_HW_CACHE_LL | (PERF_COUNT_HW_CACHE_OP_READ << 8) | (PERF_COUNT_HW_CACHE_RESULT_MISS << 16)},
+};
+
+// what a read of the group gives, the values in the order the counters joined it
+typedef struct _PerfRead _PerfRead;
+struct _PerfRead {
+    u64 nr;
+    u64 time_enabled, time_running;
+    u64 values[CSortPerf_COUNT];
+};
+
+
+
+// --------------------------------------------------------------------------------------------
+// ~Perf counters
+//
+// opens the calling thread's group, the first counter that opens leads it
+internal void
+_perf_open(CSortStats* s) {
+    int leader = -1;
+    s->perf_errno = 0;
+    FOR (i, CSortPerf_COUNT) {
+        struct perf_event_attr attr = {0};
+        attr.size = sizeof(attr);
+        attr.type = perf_events[i].type;
+        attr.config = perf_events[i].config;
+        attr.exclude_kernel = 1;
+        attr.exclude_hv = 1;
+        attr.read_format = PERF_FORMAT_GROUP | PERF_FORMAT_TOTAL_TIME_ENABLED | PERF_FORMAT_TOTAL_TIME_RUNNING;
+
+        s->perf_fd[i] = (int) syscall(SYS_perf_event_open, &attr, 0, -1, leader, PERF_FLAG_FD_CLOEXEC);
+        if (s->perf_fd[i] < 0) {
+            if (! s->perf_errno) s->perf_errno = errno;
+            continue;
+        }
+        if (leader < 0) leader = s->perf_fd[i];
+        s->perf_counted |= 1u << i;
+    }
+    s->perf_state = (leader < 0) ? CSortPerfState_Unavailable : CSortPerfState_Open;
+    if (leader >= 0) {
+        s->perf_errno = 0;
+    }
+}
+
+// the group's values by CSortPerfEvent, scaled up for the time the kernel had it switched out
+internal bool
+_perf_read(CSortStats* s, u64 now[CSortPerf_COUNT], u64* enabled, u64* running) {
+    int leader = -1;
+    FOR (i, CSortPerf_COUNT) {
+        if (s->perf_fd[i] >= 0) {
+            leader = s->perf_fd[i];
+            break;
+        }
+    }
+    _PerfRead r;
+    if (read(leader, &r, sizeof(r)) <= 0) {
+        return false;
+    }
+    u32 value = 0;
+    FOR (i, CSortPerf_COUNT) {
+        now[i] = (s->perf_fd[i] >= 0 && value < r.nr) ? r.values[value++] : 0;
+    }
+    *enabled = r.time_enabled;
+    *running = r.time_running;
+    return true;
+}
+
+internal void
+_perf_charge(CSortStats* s, bool charge, enum CSortPhase phase) {
+    if (s->perf_state == CSortPerfState_Closed) {
+        _perf_open(s);
+    }
+    u64 now[CSortPerf_COUNT], enabled, running;
+    if (s->perf_state != CSortPerfState_Open || ! _perf_read(s, now, &enabled, &running)) {
+        return;
+    }
+
+    const u64 d_enabled = enabled - s->perf_enabled_mark;
+    const u64 d_running = running - s->perf_running_mark;
+    if (charge && d_running) {
+        FOR (i, CSortPerf_COUNT) {
+            const u64 delta = now[i] - s->perf_mark[i];
+            s->perf[phase][i] += (d_running < d_enabled) ? (u64) ((double) delta * d_enabled / d_running) : delta;
+        }
+    }
+    memcpy(s->perf_mark, now, sizeof(now));
+    s->perf_enabled_mark = enabled;
+    s->perf_running_mark = running;
+}
+
+
+
+// --------------------------------------------------------------------------------------------
+// ~Phases
+internal inline u64
+_clock_ns(clockid_t clock) {
+    struct timespec ts;
+    clock_gettime(clock, &ts);
+    return (u64) ts.tv_sec * 1000000000ull + (u64) ts.tv_nsec;
+}
+
+// charge the time since the last mark to the phase on top of the stack
+internal inline void
+_charge_top(CSortStats* s) {
+    const u64 wall = _clock_ns(CLOCK_MONOTONIC);
+    const u64 cpu = _clock_ns(CLOCK_THREAD_CPUTIME_ID);
+    const enum CSortPhase top = (s->depth > 0) ? s->stack[s->depth - 1].phase : CSortPhase_COUNT;
+    if (s->depth > 0) {
+        s->wall_ns[top] += wall - s->wall_mark;
+        s->cpu_ns[top] += cpu - s->cpu_mark;
+    }
+    s->wall_mark = wall;
+    s->cpu_mark = cpu;
+    if (csort_perf_enabled) {
+        _perf_charge(s, s->depth > 0, top);
+    }
+}
+
+void
+CSortStats_push(enum CSortPhase phase) {
+    CSortStats* s = &csort_stats;
+    if (s->depth > 0 && s->stack[s->depth - 1].phase == phase) {
+        s->stack[s->depth - 1].reentry += 1;
+        return;
+    }
+
+    assert(s->depth < CSortStats_max_depth);
+    _charge_top(s);
+    s->stack[s->depth].phase = phase;
+    s->stack[s->depth].reentry = 0;
+    s->depth += 1;
+}
+
+void
+CSortStats_pop(void) {
+    CSortStats* s = &csort_stats;
+    assert(s->depth > 0);
+    if (s->stack[s->depth - 1].reentry > 0) {
+        s->stack[s->depth - 1].reentry -= 1;
+        return;
+    }
+
+    _charge_top(s);
+    s->depth -= 1;
+}
+
+// closes the calling thread's counters, before it exits
+void
+CSortStats_thread_end(void) {
+    CSortStats* s = &csort_stats;
+    if (s->perf_state == CSortPerfState_Open) {
+        FOR (i, CSortPerf_COUNT) {
+            if (s->perf_fd[i] >= 0) close(s->perf_fd[i]);
+        }
+    }
+    if (s->perf_state != CSortPerfState_Unavailable) {
+        s->perf_state = CSortPerfState_Closed;
+    }
+}
+
+// adds what another thread counted and timed to this thread's, phase time is then summed
+// over the threads, so it can be more than the wall time of the run
+void
+CSortStats_merge(const CSortStats* from) {
+    CSortStats* s = &csort_stats;
+    u64* to_counter = (u64*) &s->counters;
+    const u64* from_counter = (const u64*) &from->counters;
+    FOR (i, sizeof(CSortStatsCounters) / sizeof(u64)) {
+        to_counter[i] += from_counter[i];
+    }
+    FOR (i, CSortPhase_COUNT) {
+        s->wall_ns[i] += from->wall_ns[i];
+        s->cpu_ns[i] += from->cpu_ns[i];
+        FOR (e, CSortPerf_COUNT) {
+            s->perf[i][e] += from->perf[i][e];
+        }
+    }
+    s->perf_counted |= from->perf_counted;
+    if (! s->perf_errno) {
+        s->perf_errno = from->perf_errno;
+    }
+}
+
+internal void
+_print_perf(FILE* fp, const CSortStats* s) {
+    if (! s->perf_counted) {
+        fprintf(fp, "  perf counters unavailable: %s (perf_event_paranoid, or no PMU)\n\n",
+                s->perf_errno ? strerror(s->perf_errno) : "not opened");
+        return;
+    }
+
+    fprintf(fp, "  %-10s", "phase");
+    FOR (e, CSortPerf_COUNT) {
+        fprintf(fp, " %14s", perf_events[e].name);
+    }
+    fprintf(fp, " %6s\n", "IPC");
+    FOR (i, CSortPhase_COUNT) {
+        fprintf(fp, "  %-10s", phase_names[i]);
+        FOR (e, CSortPerf_COUNT) {
+            if (s->perf_counted & (1u << e)) {
+                fprintf(fp, " %14lu", s->perf[i][e]);
+            } else fprintf(fp, " %14s", "-");
+        }
+        const u64 cycles = s->perf[i][CSortPerf_Cycles];
+        if (cycles && (s->perf_counted & (1u << CSortPerf_Instructions))) {
+            fprintf(fp, " %6.2f\n", (double) s->perf[i][CSortPerf_Instructions] / cycles);
+        } else fprintf(fp, " %6s\n", "-");
+    }
+    fprintf(fp, "\n");
+}
+
+void
+CSortStats_print(FILE* fp) {
+    const CSortStats* s = &csort_stats;
+    const CSortStatsCounters* c = &s->counters;
+    u64 wall_total = 0, cpu_total = 0;
+
+    fprintf(fp, "csort stats:\n");
+    fprintf(fp, "  %-10s %12s %12s\n", "phase", "wall(ms)", "cpu(ms)");
+    FOR (i, CSortPhase_COUNT) {
+        fprintf(fp, "  %-10s %12.3f %12.3f\n", phase_names[i], s->wall_ns[i] / 1e6, s->cpu_ns[i] / 1e6);
+        wall_total += s->wall_ns[i];
+        cpu_total += s->cpu_ns[i];
+    }
+    fprintf(fp, "  %-10s %12.3f %12.3f\n\n", "total", wall_total / 1e6, cpu_total / 1e6);
+    if (csort_perf_enabled) {
+        _print_perf(fp, s);
+    }
+
+    fprintf(fp, "  files visited:        %lu\n", c->files_visited);
+    fprintf(fp, "  files skipped:        %lu\n", c->files_skipped);
+    fprintf(fp, "  files processed:      %lu\n", c->files_processed);
+    fprintf(fp, "  files failed:         %lu\n", c->files_failed);
+    fprintf(fp, "  dirs pruned:          %lu\n", c->dirs_pruned);
+    fprintf(fp, "  lines read:           %lu\n", c->lines_read);
+    fprintf(fp, "  tokens:               %lu\n", c->tokens);
+    fprintf(fp, "  modules:              %lu\n", c->modules);
+    fprintf(fp, "  imports:              %lu\n", c->imports);
+    fprintf(fp, "  duplicates squashed:  %lu\n", c->duplicates_squashed);
+}
@@ -0,0 +1,106 @@
+#ifndef __STATS_H__
+#define __STATS_H__
+
+#include "core.h"
+
+#include <stdbool.h>
+
+// --------------------------------------------------------------------------------------------
+//
+// Run statistics, printed by `--stats`
+//
+// Each thread has its own, the CLI merges the ones of its pipeline stages into the
+// main thread's and prints that.
+//
+// Counters are plain increments and are always on, phase timers are only
+// taken when #csort_stats_enabled is set, so a run without `--stats` pays a
+// predictable branch per phase boundary and nothing else.
+//
+// Phase time is exclusive: entering a nested phase (eg. tokenize inside parse)
+// pauses the enclosing one.
+//
+// With #csort_perf_enabled (`--perf-counters`) each thread also opens a group of hardware
+// counters on its first phase and reads them at the same boundaries, user space only, so it
+// works up to perf_event_paranoid 2. Counters the kernel won't give are left out of the
+// group, when it gives none the report says why and the run goes on without them.
+//
+// --------------------------------------------------------------------------------------------
+enum CSortPhase {
+    CSortPhase_Traverse,
+    CSortPhase_Read,
+    CSortPhase_Tokenize,
+    CSortPhase_Parse,
+    CSortPhase_Sort,
+    CSortPhase_Emit,
+    CSortPhase_COUNT,
+};
+
+typedef struct CSortStatsCounters CSortStatsCounters;
+struct CSortStatsCounters {
+    u64 files_visited,
+        files_skipped,
+        files_processed,
+        files_failed,
+        dirs_pruned,
+        lines_read,
+        tokens,
+        modules,
+        imports,
+        duplicates_squashed;
+};
+
+enum CSortPerfEvent {
+    CSortPerf_Cycles,
+    CSortPerf_Instructions,
+    CSortPerf_BranchMisses,
+    CSortPerf_L1dMisses,
+    CSortPerf_LLCMisses,
+    CSortPerf_COUNT,
+};
+
+enum CSortPerfState {
+    CSortPerfState_Closed,                              // not opened on this thread yet
+    CSortPerfState_Open,
+    CSortPerfState_Unavailable,
+};
+
+#define CSortStats_max_depth 32
+
+typedef struct CSortStats CSortStats;
+struct CSortStats {
+    CSortStatsCounters counters;
+    u64 wall_ns[CSortPhase_COUNT],
+        cpu_ns[CSortPhase_COUNT];
+
+    // stack of open phases, re-entering the phase on top only bumps #reentry
+    struct {
+        enum CSortPhase phase;
+        u32 reentry;
+    } stack[CSortStats_max_depth];
+    u32 depth;
+    u64 wall_mark, cpu_mark;
+
+    // --perf-counters, #perf_fd are only valid on the thread they were opened on
+    u64 perf[CSortPhase_COUNT][CSortPerf_COUNT];
+    u32 perf_counted;                                   // bit per CSortPerfEvent in the group
+    int perf_errno;                                     // why none could be opened
+    enum CSortPerfState perf_state;
+    int perf_fd[CSortPerf_COUNT];                       // -1 for the ones left out
+    u64 perf_mark[CSortPerf_COUNT], perf_enabled_mark, perf_running_mark;
+};
+
+extern __thread CSortStats csort_stats;
+extern bool csort_stats_enabled;
+extern bool csort_perf_enabled;
+
+extern void CSortStats_push(enum CSortPhase phase);
+extern void CSortStats_pop(void);
+extern void CSortStats_thread_end(void);
+extern void CSortStats_merge(const CSortStats* from);
+extern void CSortStats_print(FILE* fp);
+
+#define CSortStats_count(X, N) (csort_stats.counters.X += (N))
+#define CSortStats_begin(X) do { if (csort_stats_enabled) CSortStats_push((X)); } while (0)
+#define CSortStats_end() do { if (csort_stats_enabled) CSortStats_pop(); } while (0)
+
+#endif
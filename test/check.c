@@ -1,26 +1,94 @@
+#define _GNU_SOURCE
 #include <stdio.h>
+#include <unistd.h>
+#include <limits.h>
+#include <sys/stat.h>
 #include "../core.h"
 #include "../csort.h"
+#include "../csortlib.h"
+#include "../index.h"
+#include "../pipeline.h"
 #include "check.h"
 
 typedef struct sample_struct sample_struct;
 struct sample_struct { int data; };
 
+varGlobal u32 listed_len = 0;
+varGlobal bool listed_in_order = true;
+
+// pushes 1..N through a queue, so the consumer has to wait for it and it for the consumer
+#define queue_items 10000
+
+internal void*
+_queue_producer(void* queue) {
+    for (uintptr_t i = 1; i <= queue_items; ++i) {
+        CSortQueue_push((CSortQueue*) queue, (void*) i);
+    }
+    CSortQueue_close((CSortQueue*) queue);
+    return NULL;
+}
+
+internal void
+_check_listed(CSort* csort, const char* path, const CSortConfig* conf) {
+    char expected[32];
+    snprintf(expected, sizeof(expected), "pkg/module_%05u.py", listed_len * 2);
+    listed_in_order &= DEV_strIsEq(expected, path);
+    listed_len += 1;
+}
+
 int main() {
     CHECK_Init();
     
     /* -------------------------------------------------------------------------------------------- */
-    TEST(CSort_nexttoken_for_identifiers) {
-        const char* fileName = "./test/example_test_python.py";
-        FILE* fp = fopen(fileName, "r");
-        if (! fp) {
-            eprintln("error: failed to open '%s'", fileName);
-            exit(1);
+    TEST(CSortLexer_feed) {
+        char src[] = "from pkg.mod import (alpha,\n    beta)  # c\nx = \"import no\"\nimport os, \\\n  sys";
+        const enum CSortTokenType expected[] = {
+            CSortTokenFrom, CSortTokenIdentifier, CSortTokenImport, CSortTokenLParen, CSortTokenIdentifier,
+            CSortTokenComma, CSortTokenIdentifier, CSortTokenRParen, CSortTokenNewline,
+            CSortTokenIdentifier, CSortTokenIdentifier, CSortTokenNewline,
+            CSortTokenImport, CSortTokenIdentifier, CSortTokenComma, CSortTokenIdentifier, CSortTokenNewline,
+        };
+        const u32 expected_len = sizeof(expected) / sizeof(expected[0]);
+        CSortMemArena arena = CSortMemArena_mk();
+        CHECK_INT(8, sizeof(CSortToken));
+
+        // whole, one byte at a time and one byte at a time out of a reused buffer
+        FOR (mode, 3) {
+            DynArray tokens = DynArray_mk(sizeof(CSortToken));
+            CSortLexer lexer = CSortLexer_mk(&arena, &tokens);
+            char bounce[2][2];                          // [i][1] unused, so they don't touch
+            if (mode == 0) {
+                CSortLexer_feed(&lexer, SV_buff(src, sizeof(src) - 1));
+            } else FOR (i, sizeof(src) - 1) {
+                char* chunk = src + i;
+                if (mode == 2) {
+                    chunk = bounce[i & 1];
+                    chunk[0] = src[i];
+                }
+                CSortLexer_feed(&lexer, SV_buff(chunk, 1));
+            }
+            CSortLexer_finish(&lexer);
+
+            CHECK_INT(expected_len, tokens.len);
+            const CSortToken* toks = (const CSortToken*) DynArray_data(&tokens);
+            FOR (i, expected_len) {
+                CHECK_INT(expected[i], toks[i].type);
+            }
+            CHECK_EXPR(SV_isEq(CSortLexer_text(&lexer, toks[1]), SV("pkg.mod")));
+            CHECK_EXPR(SV_isEq(CSortLexer_text(&lexer, toks[6]), SV("beta")));
+            CHECK_EXPR(SV_isEq(CSortLexer_text(&lexer, toks[15]), SV("sys")));
+            // out of the reused buffer every token was moved, and lost its position
+            if (mode != 2) {
+                u32 line, col;
+                CSortLexer_position(&lexer, toks[6], &line, &col);
+                CHECK_INT(2, line);
+                CHECK_INT(4, col);
+                CHECK_INT(2, CSortLexer_line(&lexer, toks[6]));
+            }
+            DynArray_free(&tokens);
         }
-        
-        // TODO(emf): implement test 
 
-        fclose(fp);
+        CSortMemArena_free(&arena);
     }
 
     /* -------------------------------------------------------------------------------------------- */
@@ -34,8 +102,64 @@ int main() {
         CHECK_INT(2, a.len);
         CHECK_INT(59, ((sample_struct*) DynArray_get(&a, 0))->data);
         CHECK_INT(69, ((sample_struct*) DynArray_get(&a, 1))->data);
-        CHECK_INT((1 << 4) - 2, a.mem_free);
+        CHECK_INT(DynArray_inline_size / sizeof(sample_struct) - 2, a.mem_free);
+        CHECK_EXPR(a.mem == NULL);
+        DynArray_free(&a);
+    }
+
+    /* -------------------------------------------------------------------------------------------- */
+    TEST(DynArray_growth_and_reserve) {
+        DynArray a = DynArray_mk(sizeof(sample_struct));
+        FOR (i, 1000) {
+            sample_struct s = { .data = i };
+            DynArray_push(&a, (void*) &s);
+        }
+        CHECK_INT(1000, a.len);
+        CHECK_EXPR(a.mem != NULL);
+        CHECK_EXPR(a.mem_size >= 1000 && a.mem_size < 2000);
+        CHECK_INT(0, ((sample_struct*) DynArray_get(&a, 0))->data);
+        CHECK_INT(999, ((sample_struct*) DynArray_get(&a, 999))->data);
         DynArray_free(&a);
+
+        DynArray b = DynArray_mk_w_size(sizeof(sample_struct), 100);
+        CHECK_INT(100, b.mem_size);
+        FOR (i, 100) {
+            sample_struct s = { .data = i };
+            DynArray_push(&b, (void*) &s);
+        }
+        CHECK_INT(100, b.mem_size);
+        CHECK_INT(0, b.mem_free);
+        DynArray_free(&b);
+    }
+
+
+    /* -------------------------------------------------------------------------------------------- */
+    TEST(CSortMemArena_push_and_reset) {
+        CSortMemArena arena = CSortMemArena_mk();
+        char* first = (char*) CSortMemArena_push(&arena, 3);
+        u64* second = (u64*) CSortMemArena_push(&arena, sizeof(u64));
+        CHECK_EXPR(((uintptr_t) second & 7) == 0);
+        CHECK_EXPR(arena.first == arena.head);
+
+        // bigger than a chunk gets a node of its own
+        CSortMemArena_push(&arena, CSortMemArena_chunk_size * 2);
+        CHECK_EXPR(arena.first != arena.head);
+
+        CSortMemArena_reset(&arena);
+        CHECK_EXPR(arena.first == NULL && arena.free_list != NULL);
+        CHECK_INT(0, arena.used);
+
+        // chunks are reused, not allocated again
+        char* again = (char*) CSortMemArena_push(&arena, 3);
+        CHECK_EXPR(again == first);
+
+        // pushing after the node being filled is dealloc'd takes a new one
+        CSortMemArena_dealloc(&arena, arena.head);
+        CHECK_EXPR(arena.bump == NULL);
+        CHECK_EXPR(CSortMemArena_push(&arena, 3) != NULL);
+        CHECK_EXPR(arena.bump == arena.head);
+
+        CSortMemArena_free(&arena);
     }
 
 
@@ -53,14 +177,408 @@ int main() {
     }
 
     /* -------------------------------------------------------------------------------------------- */
-    TEST(_compare_cstr_nodes) {
-        CSortMemArena arena = CSortMemArena_mk();
-        CSortMemArenaNode* n1 = CSortMemArenaCopyCStr(&arena, "lib10", 5);
-        CSortMemArenaNode* n2 = CSortMemArenaCopyCStr(&arena, "lib110", 6);
+    TEST(csort_sort_buffer) {
+        enum CSortStatus status;
+        char error[CSort_error_len];
+        CSortCtx* ctx = csort_ctx_new(NULL, &status, error);
+        CHECK_EXPR(ctx != NULL && status == CSortStatus_Ok);
 
-        CHECK_INT(0, _compare_cstr_nodes(&n1, &n2));
+        // the context is gone, the message isn't
+        CHECK_EXPR(csort_ctx_new("/nonexistent/.csortconfig", &status, error) == NULL);
+        CHECK_INT(CSortStatus_ConfigError, status);
+        CHECK_EXPR(strstr(error, "/nonexistent/.csortconfig") != NULL);
 
-        CSortMemArena_free(&arena);
+        const char* src = "import sys\nfrom b import y, a\nfrom b import (c,\n    a)\n";
+        const char* sorted = "import sys\nfrom b import a, c, y\n";
+        char* out = NULL;
+        size_t out_len = 0;
+        CHECK_INT(0, csort_sort_buffer(ctx, src, strlen(src), &out, &out_len, &status));
+        CHECK_INT(strlen(sorted), out_len);
+        CHECK_EXPR(DEV_strIsEq(sorted, out));
+
+        // into a caller buffer, too small first
+        char buf[64];
+        out = buf;
+        out_len = 4;
+        CHECK_INT(-1, csort_sort_buffer(ctx, src, strlen(src), &out, &out_len, &status));
+        CHECK_INT(CSortStatus_BufferTooSmall, status);
+        CHECK_INT(strlen(sorted) + 1, out_len);
+        out_len = sizeof(buf);
+        CHECK_INT(0, csort_sort_buffer(ctx, src, strlen(src), &out, &out_len, &status));
+        CHECK_EXPR(DEV_strIsEq(sorted, buf));
+
+        // errors don't exit and leave the context usable
+        const char* bad = "import os\nfrom x import\n";
+        out = NULL;
+        CHECK_INT(-1, csort_sort_buffer(ctx, bad, strlen(bad), &out, &out_len, &status));
+        CHECK_INT(CSortStatus_ParseError, status);
+        CHECK_EXPR(DEV_strIsEq("2:13: Expected module, got newline", csort_ctx_error(ctx)));
+        CHECK_INT(0, csort_sort_buffer(ctx, src, strlen(src), &out, &out_len, &status));
+        CHECK_EXPR(DEV_strIsEq(sorted, out));
+
+        CHECK_INT(0, csort_check_buffer(ctx, src, strlen(src), &status));
+        CHECK_INT(1, csort_check_buffer(ctx, sorted, strlen(sorted), &status));
+        CHECK_INT(-1, csort_check_buffer(ctx, bad, strlen(bad), &status));
+
+        csort_ctx_free(ctx);
+    }
+
+    /* -------------------------------------------------------------------------------------------- */
+    TEST(csort_sort_batch) {
+        enum CSortStatus status;
+        CSortCtx* ctx = csort_ctx_new(NULL, &status, NULL);
+
+        const char* src = "import sys\nfrom b import y, a\n";
+        const char* sorted = "import sys\nfrom b import a, y\n";
+        const char* bad = "from x import\n";
+        CSortBatchItem items[64];
+        FOR (i, 64) {
+            items[i].in = (i % 8 == 3) ? bad : src;
+            items[i].in_len = strlen(items[i].in);
+        }
+
+        // a cap smaller than any item runs them one at a time, results stay in input order
+        const CSortBatchOpts opts[] = { {.jobs = 4}, {.jobs = 4, .max_memory = 1}, {0} };
+        FOR (o, 3) {
+            CHECK_INT(8, csort_sort_batch(ctx, items, 64, &opts[o], &status));
+            CHECK_INT(CSortStatus_Ok, status);
+            FOR (i, 64) {
+                if (i % 8 == 3) {
+                    CHECK_INT(CSortStatus_ParseError, items[i].status);
+                    CHECK_EXPR(items[i].out == NULL);
+                    CHECK_EXPR(DEV_strIsEq("1:13: Expected module, got newline", items[i].error));
+                } else {
+                    CHECK_INT(CSortStatus_Ok, items[i].status);
+                    CHECK_EXPR(DEV_strIsEq(sorted, items[i].out));
+                }
+            }
+            csort_batch_free(items, 64);
+        }
+
+        CHECK_INT(-1, csort_sort_batch(NULL, items, 64, NULL, &status));
+        CHECK_INT(CSortStatus_InvalidArgument, status);
+        csort_ctx_free(ctx);
+    }
+
+    /* -------------------------------------------------------------------------------------------- */
+    TEST(CSortEntity_sort_fd) {
+        CSort csort = CSort_mk();
+        CHECK_INT(0, CSort_try_init_config(&csort, NULL));
+
+        // one statement over more than three chunks, so both halves of the buffer are reused
+        String src = string("", 0);
+        string_appendf(&src, "import os\nfrom big import (\n");
+        for (u32 i = 20000; i; --i) {
+            string_appendf(&src, "    name_%05u,\n", i);
+        }
+        string_appendf(&src, ")\nimport abc\n");
+        CHECK_EXPR(src.len > 3 * CSortLexer_chunk_size);
+
+        CHECK_INT(CSortStatus_Ok, CSortWorker_sort(&csort.worker, &csort, "<buffer>", src.data, src.len, NULL));
+        String expected = string(csort.worker.output.data, csort.worker.output.len);
+
+        FILE* fp = tmpfile();
+        fwrite(src.data, 1, src.len, fp);
+        rewind(fp);
+        CSortEntity entity = CSortEntity_mk_w_buffer(&csort, &csort.worker, "<fd>", NULL, 0);
+        CSortEntity_sort_fd(&entity, fileno(fp));
+        CHECK_INT(CSortStatus_Ok, entity.status);
+        CSortEntity_emit(&entity, &csort.worker.output);
+        CHECK_INT(expected.len, csort.worker.output.len);
+        CHECK_EXPR(DEV_strIsEq(expected.data, csort.worker.output.data));
+        CSortEntity_deinit(&entity);
+        fclose(fp);
+
+        string_free(&expected);
+        string_free(&src);
+        CSort_deinit(&csort);
+    }
+
+
+    /* -------------------------------------------------------------------------------------------- */
+    TEST(CSortSuffixMatcher_match) {
+        DynArray exts = DynArray_mk(sizeof(String));
+        const char* list[] = {".py", ".pyi", "_py"};
+        FOR (i, 3) {
+            const String ext = string_raw((char*) list[i]);
+            DynArray_push(&exts, (void*) &ext);
+        }
+        CSortSuffixMatcher matcher;
+        CSortSuffixMatcher_build(&matcher, &exts);
+
+        CHECK_EXPR(CSortSuffixMatcher_match(&matcher, "a.py", 4));
+        CHECK_EXPR(CSortSuffixMatcher_match(&matcher, "a.pyi", 5));
+        CHECK_EXPR(CSortSuffixMatcher_match(&matcher, "gen_py", 6));
+        CHECK_EXPR(! CSortSuffixMatcher_match(&matcher, "a.pyc", 5));
+        CHECK_EXPR(! CSortSuffixMatcher_match(&matcher, "a.ppy", 5));
+        CHECK_EXPR(! CSortSuffixMatcher_match(&matcher, ".py", 3));
+        CHECK_EXPR(! CSortSuffixMatcher_match(&matcher, "", 0));
+
+        CSortSuffixMatcher_free(&matcher);
+        FOR (i, exts.len) string_free(DynArray_get(&exts, i));
+        DynArray_free(&exts);
+    }
+
+    /* -------------------------------------------------------------------------------------------- */
+    TEST(CSortGlobSet_is_ignored) {
+        CSortGlobSet set = CSortGlobSet_mk();
+        const char* gitignore =
+            "# comment\n"
+            "*.pyc\n"
+            "bazel-*/\n"
+            "/dist\n"
+            "docs/**/gen\n"
+            "a/**\n"
+            "[!x]venv\n"
+            "!keep.pyc\n";
+        CSortGlobSet_add_gitignore(&set, gitignore, strlen(gitignore));
+
+        CHECK_EXPR(CSortGlobSet_is_ignored(&set, "x.pyc", false));
+        CHECK_EXPR(CSortGlobSet_is_ignored(&set, "src/pkg/x.pyc", false));
+        CHECK_EXPR(! CSortGlobSet_is_ignored(&set, "src/keep.pyc", false));
+        CHECK_EXPR(! CSortGlobSet_is_ignored(&set, "x.py", false));
+
+        CHECK_EXPR(CSortGlobSet_is_ignored(&set, "bazel-out", true));
+        CHECK_EXPR(! CSortGlobSet_is_ignored(&set, "bazel-out", false));
+        CHECK_EXPR(CSortGlobSet_is_ignored(&set, "dist", true));
+        CHECK_EXPR(! CSortGlobSet_is_ignored(&set, "src/dist", true));
+
+        CHECK_EXPR(CSortGlobSet_is_ignored(&set, "docs/gen", true));
+        CHECK_EXPR(CSortGlobSet_is_ignored(&set, "docs/x/y/gen", true));
+        CHECK_EXPR(! CSortGlobSet_is_ignored(&set, "docs/xgen", true));
+        CHECK_EXPR(CSortGlobSet_is_ignored(&set, "a/b/c.py", false));
+        CHECK_EXPR(! CSortGlobSet_is_ignored(&set, "b/a/c.py", false));
+
+        CHECK_EXPR(CSortGlobSet_is_ignored(&set, "pkg/.venv", true));
+        CHECK_EXPR(! CSortGlobSet_is_ignored(&set, "xvenv", true));
+        CHECK_EXPR(! CSortGlobSet_is_ignored(&set, "/venv", true));
+
+        CSortGlobSet_free(&set);
+    }
+
+    /* -------------------------------------------------------------------------------------------- */
+    TEST(CSort_in_shard) {
+        CSort csort = {0};
+        CHECK_INT(-1, CSort_parse_shard(&csort, "0/3"));
+        CHECK_INT(-1, CSort_parse_shard(&csort, "4/3"));
+        CHECK_INT(-1, CSort_parse_shard(&csort, "1/3x"));
+        CHECK_INT(0, CSort_parse_shard(&csort, "2/3"));
+        CHECK_INT(1, csort.conf.cmd_options.shard_index);
+        CHECK_INT(-1, CSort_parse_max_memory(&csort, "0"));
+        CHECK_INT(-1, CSort_parse_max_memory(&csort, "-1M"));
+        CHECK_INT(-1, CSort_parse_max_memory(&csort, "12T"));
+        CHECK_INT(0, CSort_parse_max_memory(&csort, "64M"));
+        CHECK_EXPR(csort.conf.cmd_options.max_memory_bytes == 64ull << 20);
+
+        // the hash of a path doesn't depend on how it's split into directories and names
+        const u64 dir = CSortPathHash_feed(CSortPathHash_basis, "pkg/", 4);
+        CHECK_EXPR(CSortPathHash_feed(dir, "a.py", 4) == CSortPathHash_feed(CSortPathHash_basis, "pkg/a.py", 8));
+
+        // every path lands in exactly one shard
+        FOR (i, 64) {
+            char path[32];
+            const int len = snprintf(path, sizeof(path), "src/f%u.py", i);
+            const u64 hash = CSortPathHash_feed(CSortPathHash_basis, path, len);
+            u32 owners = 0;
+            FOR (s, 3) {
+                csort.conf.cmd_options.shard_index = s;
+                owners += CSort_in_shard(&csort, hash);
+            }
+            CHECK_INT(1, owners);
+        }
+    }
+
+    /* -------------------------------------------------------------------------------------------- */
+    TEST(CSortImportOrder_rank) {
+        DynArray top = DynArray_mk(sizeof(String));
+        DynArray bottom = DynArray_mk(sizeof(String));
+        const char* top_patterns[] = { "__future__", "os*", "os.path", "os*" };
+        const char* bottom_patterns[] = { ".*" };
+        FOR (i, 4) {
+            const String s = string((char*) top_patterns[i], strlen(top_patterns[i]));
+            DynArray_push(&top, (void*) &s);
+        }
+        const String s = string((char*) bottom_patterns[0], 2);
+        DynArray_push(&bottom, (void*) &s);
+
+        CSortImportOrder order = {0};
+        CSortImportOrder_build(&order, &top, &bottom, true);
+        CHECK_INT(0, CSortImportOrder_rank(&order, "__future__", 10));
+        CHECK_INT(1, CSortImportOrder_rank(&order, "os", 2));
+        CHECK_INT(2, CSortImportOrder_rank(&order, "os.path", 7));
+        CHECK_INT(1, CSortImportOrder_rank(&order, "os.pathlib", 10));
+        CHECK_EXPR(CSortImportOrder_rank(&order, "sys", 3) == CSortImportOrder_unranked);
+        CHECK_EXPR(CSortImportOrder_rank(&order, ".local", 6) == CSortImportOrder_unranked + 1);
+        CSortImportOrder_free(&order);
+        FOR (i, top.len) string_free((String*) DynArray_get(&top, i));
+        string_free((String*) DynArray_get(&bottom, 0));
+        DynArray_free(&top);
+        DynArray_free(&bottom);
+    }
+
+    /* -------------------------------------------------------------------------------------------- */
+    TEST(CSortPerformOnFilesFrom) {
+        CSort csort = CSort_mk();
+        CSortConfig_init(&csort.conf, &csort.arena);
+
+        // every other one isn't python, more than a chunk of them so some are cut in two
+        FOR (sep, 2) {
+            FILE* fp = tmpfile();
+            FOR (i, 8000) {
+                fprintf(fp, "pkg/module_%05u.%s%c", i, (i & 1) ? "pyc" : "py", sep ? '\n' : '\0');
+            }
+            rewind(fp);
+            listed_len = 0;
+            listed_in_order = true;
+            CHECK_INT(0, CSortPerformOnFilesFrom(&csort, fp, _check_listed));
+            CHECK_INT(4000, listed_len);
+            CHECK_EXPR(listed_in_order);
+            fclose(fp);
+        }
+        CSort_deinit(&csort);
+    }
+
+    /* -------------------------------------------------------------------------------------------- */
+    TEST(CSort_config_for_file) {
+        char root[] = "/tmp/csort_check_XXXXXX";
+        CHECK_EXPR(mkdtemp(root) != NULL);
+        char dir[128], path[160];
+        snprintf(dir, sizeof(dir), "%s/sub", root);
+        mkdir(dir, 0700);
+        snprintf(dir, sizeof(dir), "%s/sub/deep", root);
+        mkdir(dir, 0700);
+        snprintf(path, sizeof(path), "%s/sub/.csortconfig", root);
+        FILE* fp = fopen(path, "w");
+        fputs("wrap_after_n_imports = 2;\n", fp);
+        fclose(fp);
+
+        CSort csort = CSort_mk();
+        CSortConfig_init(&csort.conf, &csort.arena);
+        CSort_init_config_tree(&csort, NULL, &csort.conf);
+
+        snprintf(path, sizeof(path), "%s/a.py", root);
+        CHECK_EXPR(CSort_config_for_file(&csort, path, strlen(path)) == &csort.conf);
+
+        // the rest comes from the directory above, and everything below shares it
+        snprintf(path, sizeof(path), "%s/sub/b.py", root);
+        const CSortConfig* sub = CSort_config_for_file(&csort, path, strlen(path));
+        CHECK_EXPR(sub != &csort.conf);
+        CHECK_INT(2, sub->wrap_after_n_imports);
+        CHECK_INT(csort.conf.wrap_after_col, sub->wrap_after_col);
+        CHECK_INT(csort.conf.know_standard_library.len, sub->know_standard_library.len);
+        snprintf(path, sizeof(path), "%s/sub/deep/c.py", root);
+        CHECK_EXPR(CSort_config_for_file(&csort, path, strlen(path)) == sub);
+        CHECK_INT(1, csort.configs.owned.len);
+        CSort_deinit(&csort);
+
+        // run from below the .csortconfig, what's above it doesn't inherit from the run's
+        char cwd[PATH_MAX], found[PATH_MAX];
+        CHECK_EXPR(getcwd(cwd, sizeof(cwd)) != NULL);
+        CHECK_INT(0, chdir(dir));
+        CHECK_INT(0, CSort_find_config(found, sizeof(found)));
+        snprintf(path, sizeof(path), "%s/sub/.csortconfig", root);
+        CHECK_EXPR(DEV_strIsEq(path, found));
+        csort = CSort_mk();
+        CSort_init_config(&csort, found);
+        CSort_init_config_tree(&csort, found, &csort.conf);
+        CHECK_INT(2, csort.conf.wrap_after_n_imports);
+        CHECK_EXPR(CSort_config_for_file(&csort, "c.py", 4) == &csort.conf);
+        snprintf(path, sizeof(path), "%s/a.py", root);
+        const CSortConfig* above = CSort_config_for_file(&csort, path, strlen(path));
+        CHECK_EXPR(above != &csort.conf);
+        CHECK_INT(4, above->wrap_after_n_imports);
+        CSort_deinit(&csort);
+        CHECK_INT(0, chdir(cwd));
+
+        snprintf(path, sizeof(path), "%s/sub/.csortconfig", root);
+        unlink(path);
+        rmdir(dir);
+        snprintf(dir, sizeof(dir), "%s/sub", root);
+        rmdir(dir);
+        rmdir(root);
+    }
+
+    /* -------------------------------------------------------------------------------------------- */
+    TEST(CSortIndex_build) {
+        char root[] = "/tmp/csort_index_XXXXXX";
+        CHECK_EXPR(mkdtemp(root) != NULL);
+        char path[2][128], out[128];
+        snprintf(path[0], sizeof(path[0]), "%s/a.py", root);
+        snprintf(path[1], sizeof(path[1]), "%s/b.py", root);
+        snprintf(out, sizeof(out), "%s.idx", root);
+        FILE* fp = fopen(path[0], "w");
+        fputs("import os, numpy as np\nfrom requests import get\n", fp);
+        fclose(fp);
+        fp = fopen(path[1], "w");
+        fputs("from requests.adapters import HTTPAdapter\nimport os\n", fp);
+        fclose(fp);
+
+        CSort csort = CSort_mk();
+        CSortConfig_init(&csort.conf, &csort.arena);
+        CSortIndexStats stats;
+        CHECK_INT(0, CSortIndex_build(&csort, root, out, 2, &stats));
+        CHECK_INT(2, stats.files);
+        CHECK_INT(2, stats.parsed);
+        CHECK_INT(4, stats.modules);
+
+        CSortIndex index;
+        CHECK_INT(0, CSortIndex_open(&index, out));
+        const u32 os = CSortIndex_find_module(&index, "os", 2);
+        CHECK_EXPR(os != CSortIndex_none);
+        CHECK_INT(2, index.modules[os].importers_len);
+        CHECK_EXPR(CSortIndex_find_module(&index, "np", 2) == CSortIndex_none);
+        const u32 b = CSortIndex_find_file(&index, path[1], strlen(path[1]));
+        CHECK_INT(1, b);
+        CHECK_INT(2, index.files[b].imports_len);
+        CHECK_STR("os", CSortIndex_module_name(&index, index.imports[index.files[b].imports_at]));
+        CSortIndex_close(&index);
+
+        // nothing changed, nothing parsed
+        CHECK_INT(0, CSortIndex_build(&csort, root, out, 2, &stats));
+        CHECK_INT(0, stats.parsed);
+        CHECK_INT(2, stats.reused);
+        CSort_deinit(&csort);
+
+        unlink(out);
+        unlink(path[0]);
+        unlink(path[1]);
+        rmdir(root);
+    }
+
+    /* -------------------------------------------------------------------------------------------- */
+    TEST(CSortQueue) {
+        CSortQueue queue;
+        CSortQueue_init(&queue, 4);
+        pthread_t producer;
+        CHECK_INT(0, pthread_create(&producer, NULL, _queue_producer, &queue));
+        uintptr_t expected = 1;
+        bool in_order = true;
+        void* item;
+        while (CSortQueue_pop(&queue, &item)) {
+            in_order &= (uintptr_t) item == expected;
+            expected += 1;
+        }
+        pthread_join(producer, NULL);
+        CHECK_EXPR(in_order);
+        CHECK_INT(queue_items + 1, expected);
+        CHECK_EXPR(! CSortQueue_pop(&queue, &item));
+        CSortQueue_free(&queue);
+    }
+
+    /* -------------------------------------------------------------------------------------------- */
+    TEST(_compare_names) {
+        // views into a larger buffer, not NUL terminated
+        char buf[] = "lib10,lib110,lib2,abc,abd";
+        const String_View n1 = SV_buff(buf, 5);
+        const String_View n2 = SV_buff(buf + 6, 6);
+        const String_View n3 = SV_buff(buf + 13, 4);
+        const String_View n4 = SV_buff(buf + 18, 3);
+        const String_View n5 = SV_buff(buf + 22, 3);
+
+        CHECK_INT(0, _compare_names(&n1, &n2));
+        CHECK_INT(1, _compare_names(&n1, &n3));
+        CHECK_EXPR(_compare_names(&n4, &n5) < 0);
+        CHECK_EXPR(_compare_names(&n5, &n4) > 0);
     }
 
     CHECK_Deinit();
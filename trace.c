@@ -0,0 +1,135 @@
+#define _GNU_SOURCE
+#include "trace.h"
+
+#include <time.h>
+#include <errno.h>
+#include <assert.h>
+#include <pthread.h>
+#include <unistd.h>
+#include <sys/syscall.h>
+
+bool csort_trace_enabled = false;
+
+varGlobal __thread CSortTraceBuf* trace_tls_buf = NULL;
+varGlobal CSortTraceBuf* trace_bufs = NULL;
+varGlobal pthread_mutex_t trace_bufs_lock = PTHREAD_MUTEX_INITIALIZER;
+varGlobal u64 trace_epoch_ns = 0;
+
+internal inline u64
+_trace_now_ns(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (u64) ts.tv_sec * 1000000000ull + (u64) ts.tv_nsec;
+}
+
+// buffer of the calling thread, registered on first use
+internal CSortTraceBuf*
+_trace_buf(void) {
+    if (trace_tls_buf) {
+        return trace_tls_buf;
+    }
+
+    CSortTraceBuf* buf = (CSortTraceBuf*) DEV_malloc(1, sizeof(CSortTraceBuf));
+    buf->events = DynArray_mk(sizeof(CSortTraceEvent));
+    buf->strings = string("", 0);
+    buf->depth = 0;
+    buf->tid = (u32) syscall(SYS_gettid);
+
+    pthread_mutex_lock(&trace_bufs_lock);
+    if (! trace_epoch_ns) trace_epoch_ns = _trace_now_ns();
+    buf->next = trace_bufs;
+    trace_bufs = buf;
+    pthread_mutex_unlock(&trace_bufs_lock);
+
+    trace_tls_buf = buf;
+    return buf;
+}
+
+void
+CSortTrace_push(const char* name, const char* path) {
+    CSortTraceBuf* buf = _trace_buf();
+    assert(buf->depth < CSortTrace_max_depth);
+
+    CSortTraceEvent ev = {
+        .name = name,
+        .ts_ns = _trace_now_ns(),
+        .dur_ns = 0,
+        .arg_offset = -1,
+    };
+    if (path) {
+        ev.arg_offset = buf->strings.len;
+        string_append(&buf->strings, (char*) path, strlen(path) + 1);
+    }
+
+    buf->stack[buf->depth++] = buf->events.len;
+    DynArray_push(&buf->events, (void*) &ev);
+}
+
+void
+CSortTrace_pop(void) {
+    CSortTraceBuf* buf = _trace_buf();
+    assert(buf->depth > 0);
+    CSortTraceEvent* ev = (CSortTraceEvent*) DynArray_get(&buf->events, buf->stack[--buf->depth]);
+    ev->dur_ns = _trace_now_ns() - ev->ts_ns;
+}
+
+
+// --------------------------------------------------------------------------------------------
+internal void
+_write_json_str(FILE* fp, const char* s) {
+    fputc('"', fp);
+    for (; *s; ++s) {
+        const unsigned char c = (unsigned char) *s;
+        if (c == '"' || c == '\\') {
+            fputc('\\', fp);
+            fputc(c, fp);
+        } else if (c < 0x20) {
+            fprintf(fp, "\\u%04x", c);
+        } else fputc(c, fp);
+    }
+    fputc('"', fp);
+}
+
+// writes every thread's events to #trace_file and frees the buffers,
+// the caller must make sure no other thread is still tracing.
+int
+CSortTrace_write(const char* trace_file) {
+    FILE* fp = fopen(trace_file, "w");
+    if (! fp) {
+        log_error("trace: could not open: %s: %s", trace_file, strerror(errno));
+        return -1;
+    }
+
+    const u32 pid = (u32) getpid();
+    bool first = true;
+    fputs("{\"traceEvents\":[\n", fp);
+
+    pthread_mutex_lock(&trace_bufs_lock);
+    for (CSortTraceBuf* buf = trace_bufs, * tmp = buf; buf; tmp = buf) {
+        buf = buf->next;
+        FOR (i, tmp->events.len) {
+            const CSortTraceEvent* ev = (const CSortTraceEvent*) DynArray_get(&tmp->events, i);
+            fprintf(fp, "%s{\"name\":\"%s\",\"ph\":\"X\",\"pid\":%u,\"tid\":%u,\"ts\":%.3f,\"dur\":%.3f",
+                    first ? "" : ",\n", ev->name, pid, tmp->tid,
+                    (ev->ts_ns - trace_epoch_ns) / 1e3, ev->dur_ns / 1e3);
+            if (ev->arg_offset >= 0) {
+                fputs(",\"args\":{\"path\":", fp);
+                _write_json_str(fp, tmp->strings.data + ev->arg_offset);
+                fputc('}', fp);
+            }
+            fputc('}', fp);
+            first = false;
+        }
+
+        DynArray_free(&tmp->events);
+        string_free(&tmp->strings);
+        free(tmp);
+    }
+    trace_bufs = NULL;
+    pthread_mutex_unlock(&trace_bufs_lock);
+
+    trace_tls_buf = NULL;
+    fputs("\n],\"displayTimeUnit\":\"ms\"}\n", fp);
+    fclose(fp);
+    return 0;
+}
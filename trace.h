@@ -0,0 +1,45 @@
+#ifndef __TRACE_H__
+#define __TRACE_H__
+
+#include "core.h"
+
+#include <stdbool.h>
+
+// --------------------------------------------------------------------------------------------
+//
+// Chrome/Perfetto trace events, written by `--trace FILE`
+//
+// Each thread records complete ("X") events into its own buffer, buffers are
+// only touched by their owner until #CSortTrace_write which serializes them
+// all at exit. Spans must nest properly per thread.
+//
+// --------------------------------------------------------------------------------------------
+#define CSortTrace_max_depth 64
+
+typedef struct CSortTraceEvent CSortTraceEvent;
+struct CSortTraceEvent {
+    const char* name;                  // static string
+    u64 ts_ns, dur_ns;
+    i32 arg_offset;                    // offset of the "path" arg in #CSortTraceBuf::strings, -1 if none
+};
+
+typedef struct CSortTraceBuf CSortTraceBuf;
+struct CSortTraceBuf {
+    DynArray events;                   // CSortTraceEvent
+    String   strings;
+    u32      stack[CSortTrace_max_depth];
+    u32      depth;
+    u32      tid;
+    CSortTraceBuf* next;
+};
+
+extern bool csort_trace_enabled;
+
+extern void CSortTrace_push(const char* name, const char* path);
+extern void CSortTrace_pop(void);
+extern int CSortTrace_write(const char* trace_file);
+
+#define CSortTrace_begin(NAME, PATH) do { if (csort_trace_enabled) CSortTrace_push((NAME), (PATH)); } while (0)
+#define CSortTrace_end() do { if (csort_trace_enabled) CSortTrace_pop(); } while (0)
+
+#endif